@@ -0,0 +1,59 @@
+#include "alloc_counter.h"
+
+using namespace cv;
+
+AllocationCounter *AllocationCounter::instance = NULL;
+
+AllocationCounter::AllocationCounter() : n_allocations(0), n_bytes(0) {}
+
+UMatData *AllocationCounter::allocate(int dims, const int *sizes, int type, void *data,
+                                      size_t *step, AllocAccessFlags flags,
+                                      UMatUsageFlags usage) const
+{
+  /* With data set the Mat only wraps memory it was given */
+  if (data == NULL) {
+    size_t total = CV_ELEM_SIZE(type);
+    for (int i = 0; i < dims; i++)
+      total *= sizes[i];
+    n_allocations++;
+    n_bytes += (long) total;
+  }
+  /* The standard allocator records itself as the owner, so buffers
+   * are freed through it directly */
+  return Mat::getStdAllocator()->allocate(dims, sizes, type, data, step, flags, usage);
+}
+
+bool AllocationCounter::allocate(UMatData *data, AllocAccessFlags access,
+                                 UMatUsageFlags usage) const
+{
+  return Mat::getStdAllocator()->allocate(data, access, usage);
+}
+
+void AllocationCounter::deallocate(UMatData *data) const
+{
+  Mat::getStdAllocator()->deallocate(data);
+}
+
+void AllocationCounter::install()
+{
+  if (instance)
+    return;
+  /* Never freed, Mats may outlive anything we could tie it to */
+  instance = new AllocationCounter;
+  Mat::setDefaultAllocator(instance);
+}
+
+bool AllocationCounter::installed()
+{
+  return instance != NULL;
+}
+
+long AllocationCounter::allocations()
+{
+  return instance ? (long) instance->n_allocations : 0;
+}
+
+long AllocationCounter::bytes()
+{
+  return instance ? (long) instance->n_bytes : 0;
+}
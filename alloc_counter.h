@@ -0,0 +1,41 @@
+#ifndef _INCLUDED_ALLOC_COUNTER_H_
+#define _INCLUDED_ALLOC_COUNTER_H_
+
+#include <opencv2/core/core.hpp>
+#include <atomic>
+
+#if CV_VERSION_MAJOR >= 4
+typedef cv::AccessFlag AllocAccessFlags;
+#else
+typedef int AllocAccessFlags;
+#endif
+
+/*
+ * Mat allocator that counts the buffers it hands out and passes the
+ * work on to OpenCV's standard allocator. Installed as the default, it
+ * shows how many pixel buffers the per-frame path still allocates.
+ */
+class AllocationCounter : public cv::MatAllocator {
+public:
+  cv::UMatData *allocate(int dims, const int *sizes, int type, void *data, size_t *step,
+                         AllocAccessFlags flags, cv::UMatUsageFlags usage) const;
+  bool allocate(cv::UMatData *data, AllocAccessFlags access, cv::UMatUsageFlags usage) const;
+  void deallocate(cv::UMatData *data) const;
+
+  /* Make every Mat allocated from now on go through the counter */
+  static void install();
+  static bool installed();
+
+  /* Buffers and bytes allocated since install() */
+  static long allocations();
+  static long bytes();
+
+private:
+  mutable std::atomic< long > n_allocations;
+  mutable std::atomic< long > n_bytes;
+
+  AllocationCounter();
+  static AllocationCounter *instance;
+};
+
+#endif
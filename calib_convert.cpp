@@ -0,0 +1,85 @@
+#include <opencv2/core/core.hpp>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <iostream>
+#include "popt_pp.h"
+#include "calibration.h"
+#include "file_util.h"
+
+using namespace std;
+using namespace cv;
+
+/* FileStorage picks its format from these extensions */
+static bool is_text_format(const char *filename)
+{
+  static const char *exts[] = { ".yml", ".yaml", ".xml", ".json" };
+  size_t len = strlen(filename);
+  for (size_t i = 0; i < sizeof(exts) / sizeof(exts[0]); i++) {
+    size_t n = strlen(exts[i]);
+    if (len > n && strcasecmp(filename + len - n, exts[i]) == 0)
+      return true;
+  }
+  return false;
+}
+
+int main(int argc, char const *argv[])
+{
+  const char* in_file = NULL;
+  const char* out_file = NULL;
+  int width = 0;
+  int height = 0;
+
+  static struct poptOption options[] = {
+    { "in_file",'i',POPT_ARG_STRING,&in_file,0,"Calibration to read, YAML or binary","STR" },
+    { "out_file",'o',POPT_ARG_STRING,&out_file,0,"Calibration to write, YAML for .yml/.yaml/.xml/.json, binary otherwise (default: input + .bin)","STR" },
+    { "width",'W',POPT_ARG_INT,&width,0,"Also store rectification maps for this image width","NUM" },
+    { "height",'H',POPT_ARG_INT,&height,0,"Also store rectification maps for this image height","NUM" },
+    POPT_AUTOHELP
+    { NULL, 0, 0, NULL, 0, NULL, NULL }
+  };
+
+  POpt popt(NULL, argc, argv, options, 0);
+  int c;
+  while((c = popt.getNextOpt()) >= 0) {}
+
+  if (!in_file) {
+      cerr << "Please supply a calibration file name" << endl;
+      exit(EXIT_FAILURE);
+  }
+
+  bool from_binary = StereoCalibration::is_binary(in_file);
+  StereoCalibration calib;
+  if (!(from_binary ? calib.load_binary(in_file) : calib.load_yaml(in_file))) {
+      cerr << "Unable to read calibration file: " << in_file << endl;
+      exit(EXIT_FAILURE);
+  }
+
+  string default_out = StereoCalibration::binary_file(in_file);
+  if (!out_file)
+    out_file = default_out.c_str();
+
+  if (is_text_format(out_file)) {
+    if (!calib.save(out_file)) {
+        cerr << "Unable to write calibration file: " << out_file << endl;
+        exit(EXIT_FAILURE);
+    }
+    printf("Wrote %s\n", out_file);
+    return 0;
+  }
+
+  RectifyMaps maps;
+  if (width > 0 && height > 0)
+    maps.build(calib.K1, calib.D1, calib.R1, calib.P1, calib.K2, calib.D2, calib.R2, calib.P2,
+               Size(width, height));
+
+  /* Tied to the YAML contents, so loaders only prefer it while the
+   * YAML file is unchanged */
+  uint64_t yaml_hash = from_binary ? 0 : hash_file(in_file);
+  if (!calib.save_binary(out_file, yaml_hash, maps.lmap1.empty() ? NULL : &maps)) {
+      cerr << "Unable to write calibration file: " << out_file << endl;
+      exit(EXIT_FAILURE);
+  }
+  printf("Wrote %s%s\n", out_file, maps.lmap1.empty() ? "" : " with rectification maps");
+  return 0;
+}
@@ -4,118 +4,137 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <stdio.h>
 #include <iostream>
+#include <thread>
 #include "popt_pp.h"
+#include "calibration.h"
+#include "corner_cache.h"
+#include "instrument.h"
+#include "online_calibration.h"
+#include "view_selector.h"
 
 using namespace std;
 using namespace cv;
 
-vector< vector< Point3f > > l_object_points;
-vector< vector< Point2f > > l_img_points;
-vector< vector< Point3f > > r_object_points;
-vector< vector< Point2f > > r_img_points;
-
-Mat imgL, grayL;
-Mat imgR, grayR;
-Size im_size;
-
-void setup_calibration(int board_width, int board_height,
-                       float square_size, VideoCapture *capture, bool show_output = false) {
-  Size board_size = Size(board_width, board_height);
-  int board_n = board_width * board_height;
-  Mat frame;
-  int k = 0;
-  vector< Point2f > corners;
-
-  vector< Point3f > obj;
-  for (int i = 0; i < board_height; i++)
-    for (int j = 0; j < board_width; j++)
-      obj.push_back(Point3f((float)j * square_size, (float)i * square_size, 0));
-
-  while (capture->read(frame)) {
-    if ( im_size == Size() ) {
-      im_size = frame.size();
-      im_size.width /= 2;
-    }
+/* Show the corners found in one half of a frame. ESC quits */
+static void show_corners(const char *window, Mat img, Size board_size,
+                         const vector< Point2f > &corners)
+{
+  drawChessboardCorners(img, board_size, corners, true);
+  imshow(window, img);
+  char c = (char)waitKey(500);
+  if( c == 27 || c == 'q' || c == 'Q' ) //Allow ESC to quit
+    exit(-1);
+}
 
-    int cy = im_size.height;
-    int cx = im_size.width;
-
-    imgL = frame(Rect(0, 0, cx, cy));
-    imgR = frame(Rect(cx, 0, cx, cy));
-
-    cv::cvtColor(imgL, grayL, CV_BGR2GRAY);
-    cv::cvtColor(imgR, grayR, CV_BGR2GRAY);
-
-    bool found = false;
-
-    found = cv::findChessboardCorners(grayR, board_size, corners,
-                                      CV_CALIB_CB_ADAPTIVE_THRESH | CV_CALIB_CB_FILTER_QUADS);
-    if (found)
-    {
-      cornerSubPix(grayR, corners, cv::Size(5, 5), cv::Size(-1, -1),
-                   TermCriteria(CV_TERMCRIT_EPS | CV_TERMCRIT_ITER, 30, 0.1));
-      if (show_output) {
-        drawChessboardCorners(imgR, board_size, corners, found);
-        imshow("cornersR", imgR);
-        char c = (char)waitKey(500);
-        if( c == 27 || c == 'q' || c == 'Q' ) //Allow ESC to quit
-          exit(-1);
-      }
-      cout << k << ". Found " << corners.size() << " right corners" << endl;
-      r_img_points.push_back(corners);
-      r_object_points.push_back(obj);
+static Size setup_calibration(BoardCollector &boards, VideoCapture *capture,
+                              const char *video_filename, const string &cache_file,
+                              int num_workers, const DetectOptions &detect_options,
+                              OnlineCalibration *online, bool show_output = false) {
+  ScopedTimer timer("setup_calibration");
+  Size board_size = boards.board_size();
+  CornerSource pipeline(capture, video_filename, cache_file, board_size, num_workers,
+                        show_output, detect_options);
+  FrameCorners detection;
+  int n_frames = 0;
+  int64 start = getTickCount();
+
+  while (pipeline.next(detection)) {
+    int k = detection.index;
+    n_frames++;
+    Instrument::count("frames");
+    boards.add(detection);
+
+    /* Frames replayed from the corner cache have no image */
+    bool show = show_output && !detection.frame.empty();
+    Size half = pipeline.image_size();
+
+    if (detection.right.found) {
+      if (show)
+        show_corners("cornersR", detection.frame(Rect(half.width, 0, half.width, half.height)),
+                     board_size, detection.right.corners);
+      cout << k << ". Found " << detection.right.corners.size() << " right corners" << endl;
+    }
+    if (detection.left.found) {
+      if (show)
+        show_corners("cornersL", detection.frame(Rect(0, 0, half.width, half.height)),
+                     board_size, detection.left.corners);
+      cout << k << ". Found " << detection.left.corners.size() << " left corners" << endl;
     }
 
-    found = cv::findChessboardCorners(grayL, board_size, corners,
-                                      CV_CALIB_CB_ADAPTIVE_THRESH | CV_CALIB_CB_FILTER_QUADS);
-    if (found)
-    {
-      cornerSubPix(grayL, corners, cv::Size(5, 5), cv::Size(-1, -1),
-                   TermCriteria(CV_TERMCRIT_EPS | CV_TERMCRIT_ITER, 30, 0.1));
-      if (show_output) {
-        drawChessboardCorners(imgL, board_size, corners, found);
-        imshow("cornersL", imgL);
-        char c = (char)waitKey(500);
-        if( c == 27 || c == 'q' || c == 'Q' ) //Allow ESC to quit
-          exit(-1);
+    if (online) {
+      online->update(boards, half);
+      if (online->converged()) {
+        printf("Calibration settled after %d frames, not reading the rest\n", n_frames);
+        break;
       }
-      cout << k << ". Found " << corners.size() << " left corners" << endl;
-      l_img_points.push_back(corners);
-      l_object_points.push_back(obj);
     }
-    k++;
   }
+
+  double secs = (getTickCount() - start) / getTickFrequency();
+  printf("Searched %d frames in %.1fs (%.1f frames/sec)\n", n_frames, secs, n_frames / secs);
+  return pipeline.image_size();
 }
 
-double computeReprojectionErrors(const vector< vector< Point3f > >& objectPoints,
-                                 const vector< vector< Point2f > >& imagePoints,
-                                 const vector< Mat >& rvecs, const vector< Mat >& tvecs,
-                                 const Mat& cameraMatrix , const Mat& distCoeffs) {
-  vector< Point2f > imagePoints2;
-  int i, totalPoints = 0;
-  double totalErr = 0, err;
-  vector< float > perViewErrors;
-  perViewErrors.resize(objectPoints.size());
-
-  for (i = 0; i < (int)objectPoints.size(); ++i) {
-    projectPoints(Mat(objectPoints[i]), rvecs[i], tvecs[i], cameraMatrix,
-                  distCoeffs, imagePoints2);
-    err = norm(Mat(imagePoints[i]), Mat(imagePoints2), CV_L2);
-    int n = (int)objectPoints[i].size();
-    perViewErrors[i] = (float) std::sqrt(err*err/n);
-    totalErr += err*err;
-    totalPoints += n;
+static void solve(BoardCollector &boards, Size im_size, int flags, CameraCalibration &left,
+                  CameraCalibration &right)
+{
+  /* The two cameras share no data, solve them side by side */
+  thread right_thread(calibrate_camera, std::cref(boards.right), im_size, flags, std::ref(right));
+  calibrate_camera(boards.left, im_size, flags, left);
+  right_thread.join();
+}
+
+/* Extrinsics from the views both cameras saw, with the intrinsics just
+ * solved, written out as calibrate_stereo would */
+static void solve_stereo(StereoViews &views, Size board_size, Size im_size, int max_views,
+                         const CameraCalibration &left, const CameraCalibration &right,
+                         const RefineOptions &refine_options, const char *out_file,
+                         Residuals &epipolar)
+{
+  int n_found = views.size();
+  if (!n_found) {
+    cerr << "No frames where both cameras found the board, no extrinsics" << endl;
+    exit(EXIT_FAILURE);
   }
-  return std::sqrt(totalErr/totalPoints);
+  views.select(board_size, im_size, max_views);
+  printf("Starting Stereo Calibration with %d of %d views\n", views.size(), n_found);
+
+  StereoCalibration calib;
+  calib.K1 = left.K;
+  calib.D1 = left.D;
+  calib.K2 = right.K;
+  calib.D2 = right.D;
+  vector< RefineIteration > iterations;
+  calib.refine(views, im_size, CV_CALIB_FIX_INTRINSIC, refine_options, epipolar, &iterations);
+
+  print_iterations(stdout, iterations);
+
+  if (!calib.save_all(out_file, im_size))
+    exit(EXIT_FAILURE);
+  printf("Done Stereo Calibration\n");
 }
 
 int main(int argc, char const **argv)
 {
   int board_width = 8, board_height = 6;
   int show_images = 0;
+  int num_workers = CornerPipeline::default_workers();
+  int fast_detect = 0;
+  DetectOptions detect_options;
+  int max_views = 60;
+  const char* cache_file = NULL;
+  int no_cache = 0;
   float square_size = 1.0;
   char* videoFilename = NULL;
   const char* out_file = "intrinsics.yml";
+  const char* extrinsics_file = NULL;
+  double reject = 0;
+  int max_iterations = 10;
+  const char* report_file = NULL;
+  OnlineOptions online_options;
+  online_options.solve_every = 0;
+  int show_stats = 0;
+  const char* trace_file = NULL;
 
   static struct poptOption options[] = {
     { "show_images",'i',POPT_ARG_NONE,&show_images,0,"Display found checkerboard corners", NULL },
@@ -124,6 +143,20 @@ int main(int argc, char const **argv)
     { "square_size",'s',POPT_ARG_FLOAT,&square_size,0,"Size of checkerboard square","NUM" },
     { "video_filename",'v',POPT_ARG_STRING,&videoFilename,0,"Video file to read", "STR" },
     { "out_file",'o',POPT_ARG_STRING,&out_file,0,"Output calibration filename (YML)","STR" },
+    { "extrinsics_file",'e',POPT_ARG_STRING,&extrinsics_file,0,"Also solve the stereo extrinsics from the same frames and write them here (YML)","STR" },
+    { "threads",'j',POPT_ARG_INT,&num_workers,0,"Corner detection worker threads","NUM" },
+    { "fast_detect",'f',POPT_ARG_NONE,&fast_detect,0,"Coarse-to-fine corner search with tracking", NULL },
+    { "pyramid_levels",'p',POPT_ARG_INT,&detect_options.pyramid_levels,0,"Downscaling steps for the coarse search","NUM" },
+    { "max_views",'n',POPT_ARG_INT,&max_views,0,"Most views to calibrate with, 0 for all","NUM" },
+    { "corner_cache",'c',POPT_ARG_STRING,&cache_file,0,"Detected corners cache (default: video name + .corners)","STR" },
+    { "no_corner_cache",'C',POPT_ARG_NONE,&no_cache,0,"Don't read or write the corners cache", NULL },
+    { "reject",'r',POPT_ARG_DOUBLE,&reject,0,"Drop views more than this many deviations worse than the median and solve again","NUM" },
+    { "max_iterations",'x',POPT_ARG_INT,&max_iterations,0,"Most stereo solves when rejecting outliers","NUM" },
+    { "residuals",'R',POPT_ARG_STRING,&report_file,0,"Write per-view reprojection errors to this file","STR" },
+    { "online",'O',POPT_ARG_INT,&online_options.solve_every,0,"Solve in the background every NUM new views and stop reading once the result settles","NUM" },
+    { "online_window",'W',POPT_ARG_INT,&online_options.window,0,"Most views in each background solve","NUM" },
+    { "stats",'I',POPT_ARG_NONE,&show_stats,0,"Print per-stage timings at exit", NULL },
+    { "trace",'T',POPT_ARG_STRING,&trace_file,0,"Write a Chrome trace of the timed stages","STR" },
     POPT_AUTOHELP
     { NULL, 0, 0, NULL, 0, NULL, NULL }
   };
@@ -132,6 +165,9 @@ int main(int argc, char const **argv)
   int c;
   while((c = popt.getNextOpt()) >= 0) {}
 
+  if (show_stats || trace_file)
+    Instrument::enable(trace_file != NULL);
+
   if (!videoFilename) {
       cerr << "Please supply a video file name" << endl;
       exit(EXIT_FAILURE);
@@ -143,23 +179,58 @@ int main(int argc, char const **argv)
       cerr << "Unable to open video file: " << videoFilename << endl;
       exit(EXIT_FAILURE);
   }
+  string default_cache = default_corner_cache_file(videoFilename);
+  if (!cache_file)
+    cache_file = default_cache.c_str();
 
-  setup_calibration(board_width, board_height, square_size, &capture, show_images);
+  detect_options.fast = fast_detect;
+  Size board_size(board_width, board_height);
+  BoardCollector boards(board_size, square_size);
+  int flag = CV_CALIB_FIX_K4 | CV_CALIB_FIX_K5;
+  OnlineCalibration *online = NULL;
+  if (online_options.solve_every > 0)
+    online = new OnlineCalibration(board_size, flag, online_options);
+  Size im_size = setup_calibration(boards, &capture, videoFilename,
+                                   no_cache ? string() : string(cache_file), num_workers,
+                                   detect_options, online, show_images);
+  /* Waits for a solve still running */
+  delete online;
 
-  printf("Starting Calibration with %d left and %d right images\n", l_img_points.size(), r_img_points.size());
-  Mat K_l, K_r;
-  Mat D_l, D_r;
+  int l_found = boards.left.size(), r_found = boards.right.size();
+  boards.left.select(board_size, im_size, max_views);
+  boards.right.select(board_size, im_size, max_views);
 
-  vector< Mat > rvecs, tvecs;
-  int flag = CV_CALIB_FIX_K4 | CV_CALIB_FIX_K5;
+  printf("Starting Calibration with %d of %d left and %d of %d right images\n",
+         boards.left.size(), l_found, boards.right.size(), r_found);
+  CameraCalibration left, right;
+  int64 start = getTickCount();
 
-  calibrateCamera(r_object_points, r_img_points, im_size, K_r, D_r, rvecs, tvecs, flag);
-  cout << "Right Calibration error: " << computeReprojectionErrors(r_object_points, r_img_points, rvecs, tvecs, K_r, D_r) << endl;
+  solve(boards, im_size, flag, left, right);
 
-  calibrateCamera(l_object_points, l_img_points, im_size, K_l, D_l, rvecs, tvecs, flag);
+  if (reject > 0) {
+    vector< int > keep_l = left.residuals.inliers(reject);
+    vector< int > keep_r = right.residuals.inliers(reject);
+    int drop_l = boards.left.size() - (int) keep_l.size();
+    int drop_r = boards.right.size() - (int) keep_r.size();
+    if (drop_l || drop_r) {
+      printf("Rejected %d left and %d right outlier views (errors %.3f, %.3f), solving again\n",
+             drop_l, drop_r, left.error, right.error);
+      boards.left.keep(keep_l);
+      boards.right.keep(keep_r);
+      solve(boards, im_size, flag, left, right);
+    }
+  }
 
-  cout << "Left Calibration error: " << computeReprojectionErrors(l_object_points, l_img_points, rvecs, tvecs, K_l, D_l) << endl;
+  double secs = (getTickCount() - start) / getTickFrequency();
+  cout << "Right Calibration error: " << right.error << " (" << right.secs << "s)" << endl;
+  cout << "Left Calibration error: " << left.error << " (" << left.secs << "s)" << endl;
 
+  int n_used = boards.left.size() + boards.right.size();
+  printf("Solved in %.1fs, view selection saved at least %.1fs\n",
+         secs, solver_time_saved(left.secs + right.secs, n_used, l_found + r_found));
+
+  Mat &K_l = left.K, &D_l = left.D;
+  Mat &K_r = right.K, &D_r = right.D;
 
   FileStorage fs(out_file, FileStorage::WRITE);
   fs << "K1" << K_l;
@@ -169,7 +240,33 @@ int main(int argc, char const **argv)
   fs << "board_width" << board_width;
   fs << "board_height" << board_height;
   fs << "square_size" << square_size;
+  fs.release();
   printf("Done Calibration\n");
 
+  /* The views where both cameras saw the board came from the same
+   * frames, the video is not read a second time */
+  Residuals epipolar;
+  if (extrinsics_file) {
+    RefineOptions refine_options;
+    refine_options.reject = reject;
+    refine_options.max_iterations = reject > 0 ? max_iterations : 1;
+    solve_stereo(boards.both, board_size, im_size, max_views, left, right, refine_options,
+                 extrinsics_file, epipolar);
+  }
+
+  if (report_file) {
+    FILE *fp = fopen(report_file, "w");
+    if (fp) {
+      left.residuals.print(fp, "left");
+      right.residuals.print(fp, "right");
+      if (extrinsics_file)
+        epipolar.print(fp, "epipolar");
+      fclose(fp);
+    } else {
+      cerr << "Unable to write " << report_file << endl;
+    }
+  }
+
+  Instrument::report(trace_file);
   return 0;
 }
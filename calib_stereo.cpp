@@ -4,85 +4,48 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <stdio.h>
 #include <iostream>
+#include <algorithm>
 #include "popt_pp.h"
+#include "calibration.h"
+#include "corner_cache.h"
+#include "instrument.h"
+#include "online_calibration.h"
+#include "view_selector.h"
 
 using namespace std;
 using namespace cv;
 
-vector< vector< Point3f > > object_points;
-vector< vector< Point2f > > imagePoints1, imagePoints2;
-vector< Point2f > corners1, corners2;
-vector< vector< Point2f > > left_img_points, right_img_points;
-
-Mat imgL, imgR, grayL, grayR;
-
-Size im_size;
-
-void load_image_points(int board_width, int board_height, float square_size,
-                      VideoCapture *capture)
+static Size load_image_points(BoardCollector &boards, VideoCapture *capture,
+                              const char *video_filename, const string &cache_file,
+                              int num_workers, const DetectOptions &detect_options,
+                              OnlineCalibration *online)
 {
-  Size board_size = Size(board_width, board_height);
-  int board_n = board_width * board_height;
-  int img_n = 0;
-  Mat frame;
-
-  vector< Point3f > obj;
-  for (int i = 0; i < board_height; i++)
-    for (int j = 0; j < board_width; j++)
-      obj.push_back(Point3f((float)j * square_size, (float)i * square_size, 0));
-
-  while (capture->read(frame)) {
-    if ( im_size == Size() ) {
-      im_size = frame.size();
-      im_size.width /= 2;
-    }
-
-    int cy = im_size.height;
-    int cx = im_size.width;
-
-    imgL = frame(Rect(0, 0, cx, cy));
-    imgR = frame(Rect(cx, 0, cx, cy));
-
-    cv::cvtColor(imgL, grayL, CV_BGR2GRAY);
-    cv::cvtColor(imgR, grayR, CV_BGR2GRAY);
-
-    bool found1 = false, found2 = false;
-
-    found1 = cv::findChessboardCorners(imgL, board_size, corners1,
-  CV_CALIB_CB_ADAPTIVE_THRESH | CV_CALIB_CB_FILTER_QUADS);
-    found2 = cv::findChessboardCorners(imgR, board_size, corners2,
-  CV_CALIB_CB_ADAPTIVE_THRESH | CV_CALIB_CB_FILTER_QUADS);
-
-    if (found1)
-    {
-      cv::cornerSubPix(grayL, corners1, cv::Size(5, 5), cv::Size(-1, -1),
-  cv::TermCriteria(CV_TERMCRIT_EPS | CV_TERMCRIT_ITER, 30, 0.1));
-      //cv::drawChessboardCorners(gray1, board_size, corners1, found1);
-    }
-    if (found2)
-    {
-      cv::cornerSubPix(grayR, corners2, cv::Size(5, 5), cv::Size(-1, -1),
-  cv::TermCriteria(CV_TERMCRIT_EPS | CV_TERMCRIT_ITER, 30, 0.1));
-      //cv::drawChessboardCorners(grayR, board_size, corners2, found2);
-    }
-
-    if (found1 && found2) {
-      cout << img_n << ". Found both checkerboards" << endl;
-      imagePoints1.push_back(corners1);
-      imagePoints2.push_back(corners2);
-      object_points.push_back(obj);
+  ScopedTimer timer("load_image_points");
+  CornerSource pipeline(capture, video_filename, cache_file, boards.board_size(), num_workers,
+                        false, detect_options);
+  FrameCorners detection;
+  int n_frames = 0;
+  int64 start = getTickCount();
+
+  while (pipeline.next(detection)) {
+    n_frames++;
+    Instrument::count("frames");
+    boards.add(detection);
+    if (detection.left.found && detection.right.found)
+      cout << detection.index << ". Found both checkerboards" << endl;
+
+    if (online) {
+      online->update(boards, pipeline.image_size());
+      if (online->converged()) {
+        printf("Calibration settled after %d frames, not reading the rest\n", n_frames);
+        break;
+      }
     }
-    img_n++;
-  }
-  for (int i = 0; i < imagePoints1.size(); i++) {
-    vector< Point2f > v1, v2;
-    for (int j = 0; j < imagePoints1[i].size(); j++) {
-      v1.push_back(Point2f((double)imagePoints1[i][j].x, (double)imagePoints1[i][j].y));
-      v2.push_back(Point2f((double)imagePoints2[i][j].x, (double)imagePoints2[i][j].y));
-    }
-    left_img_points.push_back(v1);
-    right_img_points.push_back(v2);
   }
+
+  double secs = (getTickCount() - start) / getTickFrequency();
+  printf("Searched %d frames in %.1fs (%.1f frames/sec)\n", n_frames, secs, n_frames / secs);
+  return pipeline.image_size();
 }
 
 int main(int argc, char const *argv[])
@@ -90,11 +53,37 @@ int main(int argc, char const *argv[])
   const char* incalib_file = "intrinsics.yml";
   char* videoFilename = NULL;
   const char* out_file = "extrinsics.yml";
+  int num_workers = CornerPipeline::default_workers();
+  int fast_detect = 0;
+  DetectOptions detect_options;
+  int max_views = 60;
+  const char* cache_file = NULL;
+  int no_cache = 0;
+  double reject = 0;
+  int max_iterations = 10;
+  const char* report_file = NULL;
+  OnlineOptions online_options;
+  online_options.solve_every = 0;
+  int show_stats = 0;
+  const char* trace_file = NULL;
 
   static struct poptOption options[] = {
     { "video_filename",'v',POPT_ARG_STRING,&videoFilename,0,"Video file to read", "STR" },
     { "cameras_calibration_file",'u',POPT_ARG_STRING,&incalib_file,0,"cameras calibration","STR" },
     { "out_file",'o',POPT_ARG_STRING,&out_file,0,"Output calibration filename (YML)","STR" },
+    { "threads",'j',POPT_ARG_INT,&num_workers,0,"Corner detection worker threads","NUM" },
+    { "fast_detect",'f',POPT_ARG_NONE,&fast_detect,0,"Coarse-to-fine corner search with tracking", NULL },
+    { "pyramid_levels",'p',POPT_ARG_INT,&detect_options.pyramid_levels,0,"Downscaling steps for the coarse search","NUM" },
+    { "max_views",'n',POPT_ARG_INT,&max_views,0,"Most views to calibrate with, 0 for all","NUM" },
+    { "corner_cache",'c',POPT_ARG_STRING,&cache_file,0,"Detected corners cache (default: video name + .corners)","STR" },
+    { "no_corner_cache",'C',POPT_ARG_NONE,&no_cache,0,"Don't read or write the corners cache", NULL },
+    { "reject",'r',POPT_ARG_DOUBLE,&reject,0,"Drop views more than this many deviations worse than the median and solve again, until the error settles","NUM" },
+    { "max_iterations",'x',POPT_ARG_INT,&max_iterations,0,"Most solves when rejecting outliers","NUM" },
+    { "residuals",'R',POPT_ARG_STRING,&report_file,0,"Write per-view epipolar errors to this file","STR" },
+    { "online",'O',POPT_ARG_INT,&online_options.solve_every,0,"Solve in the background every NUM new views and stop reading once the result settles","NUM" },
+    { "online_window",'W',POPT_ARG_INT,&online_options.window,0,"Most views in each background solve","NUM" },
+    { "stats",'I',POPT_ARG_NONE,&show_stats,0,"Print per-stage timings at exit", NULL },
+    { "trace",'T',POPT_ARG_STRING,&trace_file,0,"Write a Chrome trace of the timed stages","STR" },
     POPT_AUTOHELP
     { NULL, 0, 0, NULL, 0, NULL, NULL }
   };
@@ -103,6 +92,9 @@ int main(int argc, char const *argv[])
   int c;
   while((c = popt.getNextOpt()) >= 0) {}
 
+  if (show_stats || trace_file)
+    Instrument::enable(trace_file != NULL);
+
   FileStorage fsl(incalib_file, FileStorage::READ);
 
   if (!videoFilename) {
@@ -116,48 +108,72 @@ int main(int argc, char const *argv[])
       cerr << "Unable to open video file: " << videoFilename << endl;
       exit(EXIT_FAILURE);
   }
-
-  load_image_points(fsl["board_width"], fsl["board_height"], fsl["square_size"], &capture);
-
-  printf("Starting Calibration\n");
-  Mat K1, K2, R, F, E;
-  Vec3d T;
-  Mat D1, D2;
-  fsl["K1"] >> K1;
-  fsl["K2"] >> K2;
-  fsl["D1"] >> D1;
-  fsl["D2"] >> D2;
+  string default_cache = default_corner_cache_file(videoFilename);
+  if (!cache_file)
+    cache_file = default_cache.c_str();
+
+  detect_options.fast = fast_detect;
+  Size board_size(fsl["board_width"], fsl["board_height"]);
+  BoardCollector boards(board_size, fsl["square_size"]);
+  StereoCalibration calib;
+  fsl["K1"] >> calib.K1;
+  fsl["K2"] >> calib.K2;
+  fsl["D1"] >> calib.D1;
+  fsl["D2"] >> calib.D2;
   int flag = CV_CALIB_FIX_INTRINSIC;// | CALIB_SAME_FOCAL_LENGTH;
   
   cout << "Read intrinsics" << endl;
+
+  OnlineCalibration *online = NULL;
+  if (online_options.solve_every > 0)
+    online = new OnlineCalibration(board_size, flag, calib, online_options);
+  Size im_size = load_image_points(boards, &capture, videoFilename,
+                                   no_cache ? string() : string(cache_file),
+                                   num_workers, detect_options, online);
+  /* Waits for a solve still running */
+  delete online;
+
+  StereoViews &views = boards.both;
+  int n_found = views.size();
+  views.select(board_size, im_size, max_views);
+
+  printf("Starting Calibration with %d of %d views\n", views.size(), n_found);
   
-  stereoCalibrate(object_points, left_img_points, right_img_points, K1, D1, K2, D2, im_size, R, T, E, F, flag);
-
-  cv::FileStorage fs1(out_file, cv::FileStorage::WRITE);
-  fs1 << "K1" << K1;
-  fs1 << "K2" << K2;
-  fs1 << "D1" << D1;
-  fs1 << "D2" << D2;
-  fs1 << "R" << R;
-  fs1 << "T" << T;
-  fs1 << "E" << E;
-  fs1 << "F" << F;
+  int64 start = getTickCount();
+  RefineOptions refine_options;
+  refine_options.reject = reject;
+  refine_options.max_iterations = reject > 0 ? max_iterations : 1;
+  Residuals epipolar;
+  vector< RefineIteration > iterations;
+  calib.refine(views, im_size, flag, refine_options, epipolar, &iterations);
+
+  print_iterations(stdout, iterations);
+
+  if (report_file) {
+    FILE *fp = fopen(report_file, "w");
+    if (fp) {
+      epipolar.print(fp, "epipolar");
+      fclose(fp);
+    } else {
+      cerr << "Unable to write " << report_file << endl;
+    }
+  }
+
+  /* The first solve had every selected view, the later ones fewer */
+  double secs = (getTickCount() - start) / getTickFrequency();
+  printf("Solved in %.1fs over %d solves, view selection saved at least %.1fs\n",
+         secs, (int) iterations.size(),
+         solver_time_saved(iterations[0].secs, iterations[0].views, n_found));
   
   printf("Done Calibration\n");
 
   printf("Starting Rectification\n");
 
-  cv::Mat R1, R2, P1, P2, Q;
-  flag = CALIB_ZERO_DISPARITY;
-  stereoRectify(K1, D1, K2, D2, im_size, R, T, R1, R2, P1, P2, Q, flag);
-
-  fs1 << "R1" << R1;
-  fs1 << "R2" << R2;
-  fs1 << "P1" << P1;
-  fs1 << "P2" << P2;
-  fs1 << "Q" << Q;
+  if (!calib.save_all(out_file, im_size))
+    exit(EXIT_FAILURE);
 
   printf("Done Rectification\n");
 
+  Instrument::report(trace_file);
   return 0;
 }
@@ -0,0 +1,477 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "calibration.h"
+#include "file_util.h"
+#include "instrument.h"
+#include "view_selector.h"
+
+using namespace std;
+using namespace cv;
+
+/*
+ * Binary calibration layout, all values in host byte order:
+ *   char[8]  magic "SCCALIB\0"
+ *   uint32   format version
+ *   uint32   number of matrices
+ *   uint64   hash of the YAML file it was converted from, 0 if none
+ *   uint64   offset of the rectification maps, 0 if none
+ *   int32    width, height of the maps
+ *   24 bytes padding
+ * then a 32-byte entry per matrix:
+ *   char[12] name, NUL padded
+ *   int32    rows, cols, type
+ *   uint64   offset of the data, with no padding between rows
+ * Each matrix's data and the maps, in the RectifyMaps cache layout,
+ * start on a CALIB_ALIGN byte boundary.
+ */
+static const char CALIB_MAGIC[8] = { 'S', 'C', 'C', 'A', 'L', 'I', 'B', 0 };
+static const uint32_t CALIB_VERSION = 1;
+static const size_t CALIB_HEADER_SIZE = 64;
+static const size_t CALIB_ENTRY_SIZE = 32;
+static const size_t CALIB_NAME_SIZE = 12;
+static const size_t CALIB_ALIGN = 64;
+
+static size_t aligned(size_t n)
+{
+  return (n + CALIB_ALIGN - 1) & ~(CALIB_ALIGN - 1);
+}
+
+vector< Point3f > board_object_points(Size board_size, float square_size)
+{
+  vector< Point3f > obj;
+  for (int i = 0; i < board_size.height; i++)
+    for (int j = 0; j < board_size.width; j++)
+      obj.push_back(Point3f((float)j * square_size, (float)i * square_size, 0));
+  return obj;
+}
+
+void CameraViews::add(const vector< Point3f > &obj, const SideCorners &side)
+{
+  object_points.push_back(obj);
+  img_points.push_back(side.corners);
+  sharpness.push_back(side.sharpness);
+}
+
+void CameraViews::select(Size board_size, Size im_size, int max_views)
+{
+  ViewSelector selector(max_views);
+
+  for (size_t i = 0; i < img_points.size(); i++)
+    selector.add(view_features(img_points[i], board_size, im_size, sharpness[i]));
+
+  keep(selector.select());
+}
+
+void CameraViews::keep(const vector< int > &views)
+{
+  keep_views(object_points, views);
+  keep_views(img_points, views);
+  keep_views(sharpness, views);
+}
+
+void StereoViews::add(const vector< Point3f > &obj, const SideCorners &left,
+                      const SideCorners &right)
+{
+  object_points.push_back(obj);
+  left_img_points.push_back(left.corners);
+  right_img_points.push_back(right.corners);
+  sharpness.push_back(std::min(left.sharpness, right.sharpness));
+}
+
+void StereoViews::select(Size board_size, Size im_size, int max_views)
+{
+  ViewSelector selector(max_views);
+
+  for (size_t i = 0; i < left_img_points.size(); i++)
+    selector.add(view_features(left_img_points[i], board_size, im_size, sharpness[i]));
+
+  keep(selector.select());
+}
+
+void StereoViews::keep(const vector< int > &views)
+{
+  keep_views(object_points, views);
+  keep_views(left_img_points, views);
+  keep_views(right_img_points, views);
+  keep_views(sharpness, views);
+}
+
+BoardCollector::BoardCollector(Size board_size, float square_size)
+  : board(board_size), obj(board_object_points(board_size, square_size))
+{
+}
+
+void BoardCollector::add(const FrameCorners &frame)
+{
+  if (frame.left.found)
+    left.add(obj, frame.left);
+  if (frame.right.found)
+    right.add(obj, frame.right);
+  if (frame.left.found && frame.right.found)
+    both.add(obj, frame.left, frame.right);
+}
+
+void calibrate_camera(const CameraViews &views, Size im_size, int flags,
+                      CameraCalibration &out)
+{
+  ScopedTimer timer("calibrateCamera");
+  int64 start = getTickCount();
+
+  calibrateCamera(views.object_points, views.img_points, im_size, out.K, out.D,
+                  out.rvecs, out.tvecs, flags);
+  reprojection_residuals(views.object_points, views.img_points, out.rvecs, out.tvecs,
+                         out.K, out.D, out.residuals);
+  out.error = out.residuals.rms;
+
+  out.secs = (getTickCount() - start) / getTickFrequency();
+}
+
+bool StereoCalibration::load(const char *filename)
+{
+  if (is_binary(filename))
+    return load_binary(filename);
+
+  uint64_t yaml_hash = hash_file(filename);
+  if (yaml_hash != 0 && load_binary(binary_file(filename).c_str(), yaml_hash))
+    return true;
+  return load_yaml(filename);
+}
+
+bool StereoCalibration::load_yaml(const char *filename)
+{
+  FileStorage fs(filename, FileStorage::READ);
+  if (!fs.isOpened())
+    return false;
+
+  fs["K1"] >> K1;
+  fs["K2"] >> K2;
+  fs["D1"] >> D1;
+  fs["D2"] >> D2;
+  fs["R"] >> R;
+  fs["T"] >> T;
+  fs["E"] >> E;
+  fs["F"] >> F;
+
+  fs["R1"] >> R1;
+  fs["R2"] >> R2;
+  fs["P1"] >> P1;
+  fs["P2"] >> P2;
+  fs["Q"] >> Q;
+  return true;
+}
+
+bool StereoCalibration::save(const char *filename) const
+{
+  FileStorage fs(filename, FileStorage::WRITE);
+  if (!fs.isOpened())
+    return false;
+
+  fs << "K1" << K1;
+  fs << "K2" << K2;
+  fs << "D1" << D1;
+  fs << "D2" << D2;
+  fs << "R" << R;
+  fs << "T" << T;
+  fs << "E" << E;
+  fs << "F" << F;
+
+  fs << "R1" << R1;
+  fs << "R2" << R2;
+  fs << "P1" << P1;
+  fs << "P2" << P2;
+  fs << "Q" << Q;
+  return true;
+}
+
+string StereoCalibration::binary_file(const char *calib_file)
+{
+  return string(calib_file) + ".bin";
+}
+
+bool StereoCalibration::is_binary(const char *filename)
+{
+  char magic[sizeof(CALIB_MAGIC)];
+  FILE *fp = fopen(filename, "rb");
+  if (!fp)
+    return false;
+  bool binary = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+                memcmp(magic, CALIB_MAGIC, sizeof(magic)) == 0;
+  fclose(fp);
+  return binary;
+}
+
+bool StereoCalibration::load_binary(const char *filename, uint64_t yaml_hash)
+{
+  MappedFile file;
+  if (!file.open(filename))
+    return false;
+
+  const unsigned char *p = file.data();
+  uint32_t version, n;
+  uint64_t hash, map_offset;
+  int32_t map_w, map_h;
+
+  if (file.size() < CALIB_HEADER_SIZE || memcmp(p, CALIB_MAGIC, sizeof(CALIB_MAGIC)) != 0)
+    return false;
+  memcpy(&version, p + 8, 4);
+  memcpy(&n, p + 12, 4);
+  memcpy(&hash, p + 16, 8);
+  memcpy(&map_offset, p + 24, 8);
+  memcpy(&map_w, p + 32, 4);
+  memcpy(&map_h, p + 36, 4);
+  if (version != CALIB_VERSION || (yaml_hash != 0 && hash != yaml_hash))
+    return false;
+  if (file.size() < CALIB_HEADER_SIZE + (size_t) n * CALIB_ENTRY_SIZE)
+    return false;
+
+  Mat T_mat;
+  struct { const char *name; Mat *mat; } fields[] = {
+    { "K1", &K1 }, { "K2", &K2 }, { "D1", &D1 }, { "D2", &D2 },
+    { "R", &R }, { "T", &T_mat }, { "E", &E }, { "F", &F },
+    { "R1", &R1 }, { "R2", &R2 }, { "P1", &P1 }, { "P2", &P2 }, { "Q", &Q }
+  };
+
+  for (uint32_t i = 0; i < n; i++) {
+    const unsigned char *e = p + CALIB_HEADER_SIZE + i * CALIB_ENTRY_SIZE;
+    char name[CALIB_NAME_SIZE + 1] = { 0 };
+    int32_t rows, cols, type;
+    uint64_t offset;
+
+    memcpy(name, e, CALIB_NAME_SIZE);
+    memcpy(&rows, e + 12, 4);
+    memcpy(&cols, e + 16, 4);
+    memcpy(&type, e + 20, 4);
+    memcpy(&offset, e + 24, 8);
+    if (rows <= 0 || cols <= 0 || type < 0 || type >= CV_DEPTH_MAX * CV_CN_MAX)
+      return false;
+    if (offset + (size_t) rows * cols * CV_ELEM_SIZE(type) > file.size())
+      return false;
+
+    /* Unknown names are from a later writer, skip them */
+    for (size_t f = 0; f < sizeof(fields) / sizeof(fields[0]); f++) {
+      if (strcmp(name, fields[f].name) == 0) {
+        /* The matrices are tiny, only the maps stay in the mapping */
+        *fields[f].mat = Mat(rows, cols, type, (void *) (p + offset)).clone();
+        break;
+      }
+    }
+  }
+
+  if (!T_mat.empty()) {
+    T_mat.convertTo(T_mat, CV_64F);
+    T = Vec3d(T_mat.at< double >(0), T_mat.at< double >(1), T_mat.at< double >(2));
+  }
+
+  maps_file.clear();
+  maps_offset = 0;
+  if (map_offset != 0) {
+    maps_file = filename;
+    maps_offset = map_offset;
+    maps_size = Size(map_w, map_h);
+    maps_hash = hash;
+  }
+  return true;
+}
+
+static bool write_padding(FILE *fp, size_t n)
+{
+  static const char zeros[CALIB_ALIGN] = { 0 };
+  return fwrite(zeros, 1, n, fp) == n;
+}
+
+bool StereoCalibration::save_binary(const char *filename, uint64_t yaml_hash,
+                                    const RectifyMaps *maps) const
+{
+  Mat T_mat(T);
+  struct { const char *name; const Mat *mat; } fields[] = {
+    { "K1", &K1 }, { "K2", &K2 }, { "D1", &D1 }, { "D2", &D2 },
+    { "R", &R }, { "T", &T_mat }, { "E", &E }, { "F", &F },
+    { "R1", &R1 }, { "R2", &R2 }, { "P1", &P1 }, { "P2", &P2 }, { "Q", &Q }
+  };
+
+  /* Lay out the non-empty matrices after the entry table */
+  vector< Mat > mats;
+  vector< const char * > names;
+  for (size_t f = 0; f < sizeof(fields) / sizeof(fields[0]); f++) {
+    if (fields[f].mat->empty())
+      continue;
+    Mat m = fields[f].mat->isContinuous() ? *fields[f].mat : fields[f].mat->clone();
+    mats.push_back(m);
+    names.push_back(fields[f].name);
+  }
+
+  uint32_t n = (uint32_t) mats.size();
+  vector< uint64_t > offsets(n);
+  size_t end = aligned(CALIB_HEADER_SIZE + n * CALIB_ENTRY_SIZE);
+  for (uint32_t i = 0; i < n; i++) {
+    offsets[i] = end;
+    end = aligned(end + mats[i].total() * mats[i].elemSize());
+  }
+  uint64_t map_offset = maps && !maps->lmap1.empty() ? end : 0;
+
+  string tmp = string(filename) + ".tmp";
+  FILE *fp = fopen(tmp.c_str(), "wb");
+  if (!fp)
+    return false;
+
+  unsigned char header[CALIB_HEADER_SIZE] = { 0 };
+  int32_t map_w = map_offset ? maps->lmap1.cols : 0, map_h = map_offset ? maps->lmap1.rows : 0;
+  memcpy(header, CALIB_MAGIC, sizeof(CALIB_MAGIC));
+  memcpy(header + 8, &CALIB_VERSION, 4);
+  memcpy(header + 12, &n, 4);
+  memcpy(header + 16, &yaml_hash, 8);
+  memcpy(header + 24, &map_offset, 8);
+  memcpy(header + 32, &map_w, 4);
+  memcpy(header + 36, &map_h, 4);
+  bool ok = fwrite(header, 1, sizeof(header), fp) == sizeof(header);
+
+  for (uint32_t i = 0; i < n; i++) {
+    unsigned char entry[CALIB_ENTRY_SIZE] = { 0 };
+    int32_t rows = mats[i].rows, cols = mats[i].cols, type = mats[i].type();
+    strncpy((char *) entry, names[i], CALIB_NAME_SIZE);
+    memcpy(entry + 12, &rows, 4);
+    memcpy(entry + 16, &cols, 4);
+    memcpy(entry + 20, &type, 4);
+    memcpy(entry + 24, &offsets[i], 8);
+    ok = ok && fwrite(entry, 1, sizeof(entry), fp) == sizeof(entry);
+  }
+
+  size_t pos = CALIB_HEADER_SIZE + n * CALIB_ENTRY_SIZE;
+  for (uint32_t i = 0; i < n; i++) {
+    size_t bytes = mats[i].total() * mats[i].elemSize();
+    ok = ok && write_padding(fp, offsets[i] - pos);
+    ok = ok && fwrite(mats[i].ptr(), 1, bytes, fp) == bytes;
+    pos = offsets[i] + bytes;
+  }
+  if (map_offset) {
+    ok = ok && write_padding(fp, map_offset - pos);
+    ok = ok && maps->write(fp, yaml_hash);
+  }
+
+  ok = (fclose(fp) == 0) && ok;
+  if (!ok || rename(tmp.c_str(), filename) != 0) {
+    remove(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+double StereoCalibration::calibrate(const StereoViews &views, Size im_size, int flags)
+{
+  ScopedTimer timer("stereoCalibrate");
+  return stereoCalibrate(views.object_points, views.left_img_points, views.right_img_points,
+                         K1, D1, K2, D2, im_size, R, T, E, F, flags);
+}
+
+void print_iterations(FILE *fp, const vector< RefineIteration > &iterations)
+{
+  for (size_t i = 0; i < iterations.size(); i++) {
+    const RefineIteration &it = iterations[i];
+    fprintf(fp, "Solve %d: %d views (%d dropped), RMS error %.3f px, epipolar error %.3f px, %.2fs\n",
+            (int) i + 1, it.views, it.dropped, it.rms, it.epipolar, it.secs);
+  }
+}
+
+double StereoCalibration::refine(StereoViews &views, Size im_size, int flags,
+                                 const RefineOptions &options, Residuals &res,
+                                 vector< RefineIteration > *log)
+{
+  ScopedTimer timer("refine");
+  int max_iterations = std::max(options.max_iterations, 1);
+  int dropped = 0;
+  double rms = 0;
+
+  /* The solve before the last, to go back to if dropping made it worse */
+  StereoViews prev_views;
+  Residuals prev_res;
+  Mat prev_R, prev_E, prev_F;
+  Vec3d prev_T;
+  double prev_rms = 0;
+
+  for (int i = 0; i < max_iterations; i++) {
+    int64 start = getTickCount();
+    /* Re-solves start from the last R and T, the views barely changed */
+#ifdef HAVE_EXTRINSIC_GUESS
+    rms = calibrate(views, im_size, i ? flags | CALIB_USE_EXTRINSIC_GUESS : flags);
+#else
+    rms = calibrate(views, im_size, flags);
+#endif
+    residuals(views, res);
+
+    if (log) {
+      RefineIteration it = { views.size(), dropped, rms, res.rms,
+                             (getTickCount() - start) / getTickFrequency() };
+      log->push_back(it);
+    }
+    if (i && res.rms > prev_res.rms) {
+      views = prev_views;
+      res = prev_res;
+      R = prev_R;
+      T = prev_T;
+      E = prev_E;
+      F = prev_F;
+      rms = prev_rms;
+      break;
+    }
+    if (i && prev_res.rms - res.rms < options.tolerance)
+      break;
+    if (i + 1 == max_iterations || options.reject <= 0)
+      break;
+
+    vector< int > keep = res.inliers(options.reject, options.min_rms);
+    dropped = views.size() - (int) keep.size();
+    if (!dropped || (int) keep.size() < options.min_views)
+      break;
+
+    /* stereoCalibrate() writes into the same matrices next time */
+    prev_views = views;
+    prev_res = res;
+    prev_R = R.clone();
+    prev_T = T;
+    prev_E = E.clone();
+    prev_F = F.clone();
+    prev_rms = rms;
+    views.keep(keep);
+  }
+  return rms;
+}
+
+void StereoCalibration::residuals(const StereoViews &views, Residuals &out) const
+{
+  epipolar_residuals(views.left_img_points, views.right_img_points, K1, D1, K2, D2, F, out);
+}
+
+void StereoCalibration::rectify(Size im_size, int flags)
+{
+  ScopedTimer timer("stereoRectify");
+  stereoRectify(K1, D1, K2, D2, im_size, R, T, R1, R2, P1, P2, Q, flags);
+}
+
+bool StereoCalibration::save_all(const char *out_file, Size im_size)
+{
+  rectify(im_size, CALIB_ZERO_DISPARITY);
+  if (!save(out_file)) {
+    fprintf(stderr, "Unable to write calibration file: %s\n", out_file);
+    return false;
+  }
+
+  /* Binary copy with the maps for this image size, which the other
+   * tools map in place of parsing the YAML while it stays unchanged */
+  RectifyMaps maps;
+  maps.build(K1, D1, R1, P1, K2, D2, R2, P2, im_size);
+  string binary = binary_file(out_file);
+  if (!save_binary(binary.c_str(), hash_file(out_file), &maps))
+    fprintf(stderr, "Unable to write binary calibration file: %s\n", binary.c_str());
+  return true;
+}
+
+bool StereoCalibration::init_maps(RectifyMaps &maps, const char *calib_file,
+                                  Size im_size) const
+{
+  if (!maps_file.empty() && maps_size == im_size &&
+      maps.load(maps_file, maps_hash, im_size, maps_offset))
+    return true;
+  return maps.init(calib_file, K1, D1, R1, P1, K2, D2, R2, P2, im_size);
+}
@@ -0,0 +1,187 @@
+#ifndef _INCLUDED_CALIBRATION_H_
+#define _INCLUDED_CALIBRATION_H_
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "corner_pipeline.h"
+#include "rectify_maps.h"
+#include "residuals.h"
+
+/* stereoCalibrate() can start from the R and T it is given from 4.1 on,
+ * and in the 3.4 series from 3.4.6 */
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR >= 1) || \
+    (CV_VERSION_MAJOR == 3 && CV_VERSION_MINOR == 4 && CV_VERSION_REVISION >= 6)
+#define HAVE_EXTRINSIC_GUESS 1
+#endif
+
+/* Board corner positions on the board plane, in the order the corner
+ * detector reports them */
+std::vector< cv::Point3f > board_object_points(cv::Size board_size, float square_size);
+
+/* Chessboard views of one camera, ready for calibrateCamera() */
+struct CameraViews {
+  std::vector< std::vector< cv::Point3f > > object_points;
+  std::vector< std::vector< cv::Point2f > > img_points;
+  std::vector< float > sharpness;
+
+  int size() const { return (int) img_points.size(); }
+
+  void add(const std::vector< cv::Point3f > &obj, const SideCorners &side);
+
+  /* Keep at most max_views diverse, sharp views for the solver */
+  void select(cv::Size board_size, cv::Size im_size, int max_views);
+
+  /* Keep only the views in the sorted index list */
+  void keep(const std::vector< int > &views);
+};
+
+/* Views where both cameras found the board, for stereoCalibrate() */
+struct StereoViews {
+  std::vector< std::vector< cv::Point3f > > object_points;
+  std::vector< std::vector< cv::Point2f > > left_img_points, right_img_points;
+  std::vector< float > sharpness; /* Of the blurrier side */
+
+  int size() const { return (int) left_img_points.size(); }
+
+  void add(const std::vector< cv::Point3f > &obj, const SideCorners &left,
+           const SideCorners &right);
+
+  /* As CameraViews::select(), judging the pose from the left camera */
+  void select(cv::Size board_size, cv::Size im_size, int max_views);
+
+  void keep(const std::vector< int > &views);
+};
+
+/*
+ * Sorts per-frame detections into the views each solver needs. Holds
+ * no state beyond its own views, so several can run side by side.
+ */
+class BoardCollector {
+public:
+  BoardCollector(cv::Size board_size, float square_size);
+
+  void add(const FrameCorners &frame);
+
+  cv::Size board_size() const { return board; }
+
+  CameraViews left, right;
+  StereoViews both;
+
+private:
+  cv::Size board;
+  std::vector< cv::Point3f > obj;
+};
+
+/* One camera's intrinsic solve */
+struct CameraCalibration {
+  cv::Mat K, D;
+  std::vector< cv::Mat > rvecs, tvecs;
+  double error; /* RMS reprojection error over all corners, in pixels */
+  Residuals residuals; /* The same error per view and per corner */
+  double secs;
+};
+
+void calibrate_camera(const CameraViews &views, cv::Size im_size, int flags,
+                      CameraCalibration &out);
+
+/* When StereoCalibration::refine() drops views and when it stops */
+struct RefineOptions {
+  double reject;      /* Robust deviations, see Residuals::inliers() */
+  double min_rms;     /* Views under this epipolar error are always kept */
+  int max_iterations; /* Solves, counting the first */
+  double tolerance;   /* Stop once the epipolar error improves by less */
+  int min_views;      /* Never solve with fewer views than this */
+
+  RefineOptions() : reject(3), min_rms(0.5), max_iterations(10), tolerance(1e-3), min_views(10) {}
+};
+
+/* One solve of the refinement */
+struct RefineIteration {
+  int views;
+  int dropped;     /* Views dropped before this solve */
+  double rms;      /* As returned by stereoCalibrate() */
+  double epipolar; /* Residuals::rms of the epipolar error */
+  double secs;
+};
+
+/* One "Solve N: ..." line per iteration, as the stereo tools report them */
+void print_iterations(FILE *fp, const std::vector< RefineIteration > &iterations);
+
+/*
+ * Everything the stereo tools keep in a calibration file: intrinsics,
+ * extrinsics and the rectification derived from them.
+ *
+ * Besides the YAML file, a calibration can be kept in a binary file
+ * that is memory-mapped instead of parsed, and that can carry the
+ * rectification maps as well. The maps are only read when
+ * init_maps() asks for them at the size they were built for.
+ */
+struct StereoCalibration {
+  cv::Mat K1, D1, K2, D2;
+  cv::Mat R;
+  cv::Vec3d T;
+  cv::Mat E, F;
+  cv::Mat R1, R2, P1, P2, Q;
+
+  /* Where load_binary() found maps, if it did */
+  std::string maps_file;
+  size_t maps_offset;
+  cv::Size maps_size;
+  uint64_t maps_hash;
+
+  StereoCalibration() : maps_offset(0), maps_hash(0) {}
+
+  /* Read a calibration file of either format. For YAML, the binary
+   * file next to it is read instead when it was converted from the
+   * same YAML contents. Fails if nothing can be opened */
+  bool load(const char *filename);
+
+  /* Read the matrices that are present in a YAML calibration file, as
+   * written by calibrate_stereo */
+  bool load_yaml(const char *filename);
+  bool save(const char *filename) const;
+
+  /* yaml_hash is hash_file() of the YAML file the binary one must have
+   * been converted from, 0 to accept it regardless */
+  bool load_binary(const char *filename, uint64_t yaml_hash = 0);
+  bool save_binary(const char *filename, uint64_t yaml_hash,
+                   const RectifyMaps *maps = NULL) const;
+
+  /* The binary file kept next to a YAML calibration file */
+  static std::string binary_file(const char *calib_file);
+  static bool is_binary(const char *filename);
+
+  /* Solve R, T, E and F from the views. Returns the RMS error */
+  double calibrate(const StereoViews &views, cv::Size im_size, int flags);
+
+  /* Solve, drop the views whose epipolar error stands out and solve
+   * again, until no view is dropped or the error stops improving.
+   * Views are only dropped when options.reject is above 0 and another
+   * solve is allowed. If the last solve came out worse than the one
+   * before, that one is kept. Leaves the calibration, the views and
+   * their residuals as of the solve returned */
+  double refine(StereoViews &views, cv::Size im_size, int flags, const RefineOptions &options,
+                Residuals &residuals, std::vector< RefineIteration > *log = NULL);
+
+  /* Epipolar error of each view's corners under F */
+  void residuals(const StereoViews &views, Residuals &out) const;
+
+  /* Fill in R1, R2, P1, P2 and Q from the intrinsics and extrinsics */
+  void rectify(cv::Size im_size, int flags = cv::CALIB_ZERO_DISPARITY);
+
+  /* rectify() with CALIB_ZERO_DISPARITY, then write the YAML file and
+   * the binary one next to it with the maps for im_size. A binary file
+   * that can't be written is only reported, the tools read the YAML
+   * without it. Returns false if the YAML file could not be written */
+  bool save_all(const char *out_file, cv::Size im_size);
+
+  /* Map the maps from the binary file when it holds them at this size,
+   * otherwise RectifyMaps::init() with these matrices */
+  bool init_maps(RectifyMaps &maps, const char *calib_file, cv::Size im_size) const;
+};
+
+#endif
@@ -0,0 +1,200 @@
+#include <opencv2/calib3d/calib3d.hpp>
+#include <stdio.h>
+#include <string.h>
+#include "corner_cache.h"
+#include "file_util.h"
+
+using namespace std;
+using namespace cv;
+
+/*
+ * File layout, all values in host byte order:
+ *   char[8]  magic "SCCORNER"
+ *   uint32   version
+ *   uint64   video hash
+ *   int32    board width, board height, detection flags
+ *   int32    half-frame width, height
+ *   int32    frame count
+ * then per frame a byte with bit 0 set if the left board was found and
+ * bit 1 for the right one, followed for each found side by its float
+ * sharpness and board_width * board_height float x,y pairs.
+ */
+static const char CACHE_MAGIC[8] = { 'S', 'C', 'C', 'O', 'R', 'N', 'E', 'R' };
+/* Bump when the detection code changes the corners it finds */
+static const uint32_t CACHE_VERSION = 1;
+
+CornerCacheKey corner_cache_key(const char *video_filename, Size board_size,
+                                const DetectOptions &options)
+{
+  CornerCacheKey key;
+  key.video_hash = hash_file(video_filename);
+  key.board_size = board_size;
+  key.detect_flags = CV_CALIB_CB_ADAPTIVE_THRESH | CV_CALIB_CB_FILTER_QUADS;
+  if (options.fast)
+    key.detect_flags |= CV_CALIB_CB_FAST_CHECK | (options.pyramid_levels << 16);
+  return key;
+}
+
+string default_corner_cache_file(const char *video_filename)
+{
+  return string(video_filename) + ".corners";
+}
+
+template< typename T >
+static bool read_value(FILE *fp, T &v)
+{
+  return fread(&v, sizeof(T), 1, fp) == 1;
+}
+
+template< typename T >
+static void write_value(FILE *fp, const T &v)
+{
+  fwrite(&v, sizeof(T), 1, fp);
+}
+
+static bool read_side(FILE *fp, int board_n, SideCorners &side)
+{
+  side.found = true;
+  side.corners.resize(board_n);
+  return read_value(fp, side.sharpness) &&
+         fread(&side.corners[0], sizeof(Point2f), board_n, fp) == (size_t) board_n;
+}
+
+static void write_side(FILE *fp, const SideCorners &side)
+{
+  write_value(fp, side.sharpness);
+  fwrite(&side.corners[0], sizeof(Point2f), side.corners.size(), fp);
+}
+
+bool load_corner_cache(const string &filename, const CornerCacheKey &key,
+                       Size &im_size, vector< FrameCorners > &frames)
+{
+  FILE *fp = fopen(filename.c_str(), "rb");
+  if (!fp)
+    return false;
+
+  char magic[8];
+  uint32_t version;
+  uint64_t video_hash;
+  int32_t board_w, board_h, flags, im_w, im_h, n_frames;
+  bool ok = fread(magic, 1, 8, fp) == 8 && memcmp(magic, CACHE_MAGIC, 8) == 0 &&
+            read_value(fp, version) && version == CACHE_VERSION &&
+            read_value(fp, video_hash) && read_value(fp, board_w) &&
+            read_value(fp, board_h) && read_value(fp, flags) &&
+            read_value(fp, im_w) && read_value(fp, im_h) && read_value(fp, n_frames);
+
+  ok = ok && video_hash == key.video_hash && flags == key.detect_flags &&
+       board_w == key.board_size.width && board_h == key.board_size.height;
+
+  int board_n = board_w * board_h;
+  frames.clear();
+  for (int i = 0; ok && i < n_frames; i++) {
+    FrameCorners f;
+    unsigned char mask;
+    f.index = i;
+    ok = read_value(fp, mask);
+    if (ok && (mask & 1))
+      ok = read_side(fp, board_n, f.left);
+    if (ok && (mask & 2))
+      ok = read_side(fp, board_n, f.right);
+    frames.push_back(f);
+  }
+  fclose(fp);
+
+  if (!ok) {
+    frames.clear();
+    return false;
+  }
+  im_size = Size(im_w, im_h);
+  return true;
+}
+
+bool save_corner_cache(const string &filename, const CornerCacheKey &key,
+                       Size im_size, const vector< FrameCorners > &frames)
+{
+  /* Write next to the final name and rename, so an interrupted run
+   * never leaves a truncated cache behind */
+  string tmp = filename + ".tmp";
+  FILE *fp = fopen(tmp.c_str(), "wb");
+  if (!fp)
+    return false;
+
+  fwrite(CACHE_MAGIC, 1, 8, fp);
+  write_value(fp, CACHE_VERSION);
+  write_value(fp, key.video_hash);
+  write_value(fp, (int32_t) key.board_size.width);
+  write_value(fp, (int32_t) key.board_size.height);
+  write_value(fp, (int32_t) key.detect_flags);
+  write_value(fp, (int32_t) im_size.width);
+  write_value(fp, (int32_t) im_size.height);
+  write_value(fp, (int32_t) frames.size());
+
+  for (size_t i = 0; i < frames.size(); i++) {
+    const FrameCorners &f = frames[i];
+    unsigned char mask = (f.left.found ? 1 : 0) | (f.right.found ? 2 : 0);
+    write_value(fp, mask);
+    if (f.left.found)
+      write_side(fp, f.left);
+    if (f.right.found)
+      write_side(fp, f.right);
+  }
+
+  bool ok = !ferror(fp);
+  ok = (fclose(fp) == 0) && ok;
+  if (!ok || rename(tmp.c_str(), filename.c_str()) != 0) {
+    remove(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+CornerSource::CornerSource(VideoCapture *capture, const char *video_filename,
+                           const string &cache_file, Size board_size,
+                           int num_workers, bool keep_frames,
+                           const DetectOptions &options)
+  : cache_file(cache_file), pipeline(NULL), next_frame(0), written(false)
+{
+  if (!cache_file.empty()) {
+    key = corner_cache_key(video_filename, board_size, options);
+    if (load_corner_cache(cache_file, key, im_size, frames)) {
+      printf("Using %d frames of cached corners from %s\n", (int) frames.size(), cache_file.c_str());
+      return;
+    }
+  }
+  pipeline = new CornerPipeline(capture, board_size, num_workers, keep_frames, options);
+}
+
+CornerSource::~CornerSource()
+{
+  delete pipeline;
+}
+
+bool CornerSource::next(FrameCorners &out)
+{
+  if (pipeline == NULL) {
+    if (next_frame >= frames.size())
+      return false;
+    out = frames[next_frame++];
+    return true;
+  }
+
+  if (pipeline->next(out)) {
+    if (!cache_file.empty()) {
+      frames.push_back(out);
+      frames.back().frame = Mat();
+    }
+    return true;
+  }
+
+  if (!cache_file.empty() && !written) {
+    written = true;
+    if (!save_corner_cache(cache_file, key, pipeline->image_size(), frames))
+      printf("Failed to write corner cache %s\n", cache_file.c_str());
+  }
+  return false;
+}
+
+Size CornerSource::image_size()
+{
+  return pipeline ? pipeline->image_size() : im_size;
+}
@@ -0,0 +1,61 @@
+#ifndef _INCLUDED_CORNER_CACHE_H_
+#define _INCLUDED_CORNER_CACHE_H_
+
+#include <opencv2/core/core.hpp>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "corner_pipeline.h"
+
+/* What a set of cached corners was detected from */
+struct CornerCacheKey {
+  uint64_t video_hash;
+  cv::Size board_size;
+  int detect_flags;
+};
+
+CornerCacheKey corner_cache_key(const char *video_filename, cv::Size board_size,
+                                const DetectOptions &options);
+
+/* Where the cache for a video goes when the user doesn't say */
+std::string default_corner_cache_file(const char *video_filename);
+
+/* Read all frames from a cache file. Fails if the file is missing,
+ * damaged or was written for a different key */
+bool load_corner_cache(const std::string &filename, const CornerCacheKey &key,
+                       cv::Size &im_size, std::vector< FrameCorners > &frames);
+bool save_corner_cache(const std::string &filename, const CornerCacheKey &key,
+                       cv::Size im_size, const std::vector< FrameCorners > &frames);
+
+/*
+ * Per-frame corners for a video, either replayed from the cache file or
+ * detected with a CornerPipeline. Detected corners are written to the
+ * cache once the whole video has been read, so later runs of calibrate
+ * or calibrate_stereo with the same board skip decoding and detection.
+ */
+class CornerSource {
+public:
+  /* An empty cache_file disables the cache */
+  CornerSource(cv::VideoCapture *capture, const char *video_filename,
+               const std::string &cache_file, cv::Size board_size,
+               int num_workers, bool keep_frames = false,
+               const DetectOptions &options = DetectOptions());
+  ~CornerSource();
+
+  bool next(FrameCorners &out);
+  cv::Size image_size();
+
+  /* True when the corners come from the cache file */
+  bool cached() const { return pipeline == NULL; }
+
+private:
+  std::string cache_file;
+  CornerCacheKey key;
+  CornerPipeline *pipeline;
+  std::vector< FrameCorners > frames;
+  size_t next_frame;
+  bool written;
+  cv::Size im_size;
+};
+
+#endif
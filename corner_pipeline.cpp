@@ -0,0 +1,295 @@
+#include <opencv2/calib3d/calib3d.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "corner_pipeline.h"
+#include "instrument.h"
+
+using namespace std;
+using namespace cv;
+
+void detect_corners(const Mat &gray, Size board_size, SideCorners &out)
+{
+  ScopedTimer timer("detect_corners");
+  out.found = cv::findChessboardCorners(gray, board_size, out.corners,
+                                        CV_CALIB_CB_ADAPTIVE_THRESH | CV_CALIB_CB_FILTER_QUADS);
+  if (out.found) {
+    cv::cornerSubPix(gray, out.corners, cv::Size(5, 5), cv::Size(-1, -1),
+                     TermCriteria(CV_TERMCRIT_EPS | CV_TERMCRIT_ITER, 30, 0.1));
+  }
+}
+
+/* Pixels around the outermost corners kept for the full resolution
+ * cornerSubPix, which needs its 5x5 half-window plus a border */
+static const int REFINE_MARGIN = 8;
+
+/* How far, in board squares, the board may move between tracked frames */
+static const int TRACK_MARGIN_SQUARES = 2;
+
+/* Frame k starts its search from where frame k - TRACK_LAG found the
+ * board. A fixed predecessor keeps the result independent of which
+ * worker finishes first and of the worker count, while still letting
+ * TRACK_LAG frames per side be searched at once */
+static const int TRACK_LAG = 4;
+
+static Rect grow_rect(const Rect &r, int pad)
+{
+  return Rect(r.x - pad, r.y - pad, r.width + 2 * pad, r.height + 2 * pad);
+}
+
+/* Cheap search for the board on a downscaled copy of the image. The
+ * corners are returned in full resolution coordinates, accurate to
+ * about a pixel */
+static bool find_coarse(const Mat &gray, Size board_size, int levels,
+                        vector< Point2f > &corners)
+{
+  Mat small = gray;
+  for (int i = 0; i < levels; i++) {
+    Mat down;
+    cv::pyrDown(small, down);
+    small = down;
+  }
+
+  if (!cv::findChessboardCorners(small, board_size, corners,
+                                 CV_CALIB_CB_ADAPTIVE_THRESH | CV_CALIB_CB_FILTER_QUADS |
+                                 CV_CALIB_CB_FAST_CHECK))
+    return false;
+
+  cv::cornerSubPix(small, corners, cv::Size(3, 3), cv::Size(-1, -1),
+                   TermCriteria(CV_TERMCRIT_EPS | CV_TERMCRIT_ITER, 30, 0.1));
+
+  /* pyrDown centres each output pixel on an even input pixel */
+  float scale = (float)(1 << levels);
+  for (size_t i = 0; i < corners.size(); i++)
+    corners[i] *= scale;
+  return true;
+}
+
+void detect_corners_fast(const Mat &gray, Size board_size, int pyramid_levels,
+                         Rect &window, SideCorners &out)
+{
+  ScopedTimer timer("detect_corners_fast");
+  Rect image_rect(0, 0, gray.cols, gray.rows);
+  bool found = false;
+
+  window &= image_rect;
+  if (window.area() > 0) {
+    found = find_coarse(gray(window), board_size, pyramid_levels, out.corners);
+    if (found) {
+      Point2f offset((float)window.x, (float)window.y);
+      for (size_t i = 0; i < out.corners.size(); i++)
+        out.corners[i] += offset;
+    }
+  }
+  if (!found)
+    found = find_coarse(gray, board_size, pyramid_levels, out.corners);
+
+  out.found = found;
+  if (!found) {
+    out.corners.clear();
+    window = Rect();
+    return;
+  }
+
+  /* Refine at full resolution, looking only at the board itself */
+  Rect board = cv::boundingRect(out.corners);
+  Rect roi = grow_rect(board, REFINE_MARGIN) & image_rect;
+  Point2f offset((float)roi.x, (float)roi.y);
+
+  for (size_t i = 0; i < out.corners.size(); i++)
+    out.corners[i] -= offset;
+  cv::cornerSubPix(gray(roi), out.corners, cv::Size(5, 5), cv::Size(-1, -1),
+                   TermCriteria(CV_TERMCRIT_EPS | CV_TERMCRIT_ITER, 30, 0.1));
+  for (size_t i = 0; i < out.corners.size(); i++)
+    out.corners[i] += offset;
+
+  /* Search next to where it was found in the next frame */
+  int square = cvRound(cv::norm(out.corners[1] - out.corners[0]));
+  window = grow_rect(board, TRACK_MARGIN_SQUARES * square + REFINE_MARGIN) & image_rect;
+}
+
+float board_sharpness(const Mat &gray, const vector< Point2f > &corners)
+{
+  Rect roi = cv::boundingRect(corners) & Rect(0, 0, gray.cols, gray.rows);
+  Mat lap;
+  Scalar mean, stddev;
+
+  cv::Laplacian(gray(roi), lap, CV_16S);
+  cv::meanStdDev(lap, mean, stddev);
+  return (float) (stddev[0] * stddev[0]);
+}
+
+CornerPipeline::CornerPipeline(VideoCapture *capture, Size board_size,
+                               int num_workers, bool keep_frames,
+                               const DetectOptions &options)
+  : capture(capture), board_size(board_size), keep_frames(keep_frames), options(options),
+    decoded(0), next_index(0), eos(false), stopping(false)
+{
+  if (num_workers < 1)
+    num_workers = 1;
+
+  /* Bound the number of decoded frames waiting for a worker or for the
+   * consumer, so a slow consumer doesn't make us buffer the whole video */
+  max_in_flight = 2 * num_workers + 2;
+
+  decoder = thread(&CornerPipeline::decode_loop, this);
+  for (int i = 0; i < num_workers; i++)
+    workers.push_back(thread(&CornerPipeline::worker_loop, this));
+}
+
+CornerPipeline::~CornerPipeline()
+{
+  {
+    unique_lock< mutex > l(lock);
+    stopping = true;
+  }
+  space_cond.notify_all();
+  task_cond.notify_all();
+  track_cond.notify_all();
+
+  decoder.join();
+  for (size_t i = 0; i < workers.size(); i++)
+    workers[i].join();
+}
+
+int CornerPipeline::default_workers()
+{
+  int n = (int) thread::hardware_concurrency();
+  return n > 0 ? n : 1;
+}
+
+Size CornerPipeline::image_size()
+{
+  unique_lock< mutex > l(lock);
+  return im_size;
+}
+
+void CornerPipeline::decode_loop()
+{
+  while (true) {
+    {
+      unique_lock< mutex > l(lock);
+      while (!stopping && decoded - next_index >= max_in_flight)
+        space_cond.wait(l);
+      if (stopping)
+        break;
+    }
+
+    /* A fresh Mat per frame, as the workers still reference earlier ones */
+    Mat frame;
+    if (!capture->read(frame))
+      break;
+
+    unique_lock< mutex > l(lock);
+    if (im_size == Size()) {
+      im_size = frame.size();
+      im_size.width /= 2;
+    }
+
+    Pending &p = pending[decoded];
+    p.result.index = decoded;
+    if (keep_frames)
+      p.result.frame = frame;
+    p.remaining = 2;
+
+    Task t;
+    t.index = decoded;
+    t.frame = frame;
+    t.side = LEFT;
+    tasks.push_back(t);
+    t.side = RIGHT;
+    tasks.push_back(t);
+    decoded++;
+
+    task_cond.notify_all();
+  }
+
+  unique_lock< mutex > l(lock);
+  eos = true;
+  task_cond.notify_all();
+  done_cond.notify_all();
+}
+
+void CornerPipeline::worker_loop()
+{
+  Mat gray;
+
+  while (true) {
+    Task t;
+    Size half;
+    {
+      unique_lock< mutex > l(lock);
+      while (tasks.empty() && !eos && !stopping)
+        task_cond.wait(l);
+      if (tasks.empty() || stopping)
+        return;
+      t = tasks.front();
+      tasks.pop_front();
+      half = im_size;
+    }
+
+    int cx = half.width;
+    Mat img = t.frame(Rect(t.side == LEFT ? 0 : cx, 0, cx, half.height));
+    cv::cvtColor(img, gray, CV_BGR2GRAY);
+
+    SideCorners found;
+    Rect window;
+    if (options.fast) {
+      if (t.index >= TRACK_LAG) {
+        /* That frame was handed out earlier, so it is being searched
+         * or done, and never waits on this one */
+        unique_lock< mutex > l(lock);
+        map< int, Rect > &windows = track_windows[t.side];
+        map< int, Rect >::iterator it;
+        while ((it = windows.find(t.index - TRACK_LAG)) == windows.end() && !stopping)
+          track_cond.wait(l);
+        if (stopping)
+          return;
+        window = it->second;
+        windows.erase(it);
+      }
+      detect_corners_fast(gray, board_size, options.pyramid_levels, window, found);
+    } else {
+      detect_corners(gray, board_size, found);
+    }
+    if (found.found)
+      found.sharpness = board_sharpness(gray, found.corners);
+
+    unique_lock< mutex > l(lock);
+    if (options.fast) {
+      /* Empty when the board was not found, frame index + TRACK_LAG
+       * then searches the whole image */
+      track_windows[t.side][t.index] = window;
+      track_cond.notify_all();
+    }
+
+    Pending &p = pending[t.index];
+    if (t.side == LEFT)
+      p.result.left = found;
+    else
+      p.result.right = found;
+    if (--p.remaining == 0)
+      done_cond.notify_all();
+  }
+}
+
+bool CornerPipeline::next(FrameCorners &out)
+{
+  unique_lock< mutex > l(lock);
+
+  while (true) {
+    map< int, Pending >::iterator it = pending.find(next_index);
+    if (it != pending.end() && it->second.remaining == 0) {
+      out = it->second.result;
+      pending.erase(it);
+      next_index++;
+      space_cond.notify_one();
+      return true;
+    }
+    if (eos && next_index == decoded) {
+      /* The last TRACK_LAG frames' windows have no frame left to use them */
+      track_windows[LEFT].clear();
+      track_windows[RIGHT].clear();
+      return false;
+    }
+    done_cond.wait(l);
+  }
+}
@@ -0,0 +1,123 @@
+#ifndef _INCLUDED_CORNER_PIPELINE_H_
+#define _INCLUDED_CORNER_PIPELINE_H_
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Chessboard corners found in one half of a side-by-side frame */
+struct SideCorners {
+  bool found;
+  std::vector< cv::Point2f > corners;
+  float sharpness; /* See board_sharpness() */
+
+  SideCorners() : found(false), sharpness(0) {}
+};
+
+/* Detection results for one decoded frame */
+struct FrameCorners {
+  int index;
+  cv::Mat frame; /* Only set when the pipeline keeps frames for display */
+  SideCorners left, right;
+
+  FrameCorners() : index(-1) {}
+};
+
+/* How the workers search for the board */
+struct DetectOptions {
+  /* Coarse-to-fine search: a fast check on a downscaled image, tracked
+   * from the board position a few frames earlier, refined with
+   * cornerSubPix at full resolution inside the board's region only */
+  bool fast;
+  /* Number of pyrDown steps for the coarse check */
+  int pyramid_levels;
+
+  DetectOptions() : fast(false), pyramid_levels(1) {}
+};
+
+/* Find and refine the chessboard corners in one grayscale image */
+void detect_corners(const cv::Mat &gray, cv::Size board_size, SideCorners &out);
+
+/* Coarse-to-fine variant of detect_corners(). When the track window is
+ * not empty the coarse check looks there first. On success, window is
+ * set to the region the board occupies at full resolution */
+void detect_corners_fast(const cv::Mat &gray, cv::Size board_size, int pyramid_levels,
+                         cv::Rect &window, SideCorners &out);
+
+/* Variance of the Laplacian over the board's bounding box. Used to
+ * tell sharp views from ones blurred by focus or motion */
+float board_sharpness(const cv::Mat &gray, const std::vector< cv::Point2f > &corners);
+
+/*
+ * Staged corner detection for side-by-side videos. One thread decodes
+ * frames into a bounded window, a pool of workers searches the left and
+ * right halves independently, and next() hands the results back in
+ * decode order so the output stays deterministic.
+ */
+class CornerPipeline {
+public:
+  CornerPipeline(cv::VideoCapture *capture, cv::Size board_size,
+                 int num_workers, bool keep_frames = false,
+                 const DetectOptions &options = DetectOptions());
+  ~CornerPipeline();
+
+  /* Block until the next frame in decode order is done.
+   * Returns false once the video is exhausted */
+  bool next(FrameCorners &out);
+
+  /* Size of one half of the side-by-side frame */
+  cv::Size image_size();
+
+  /* Worker count to use when the user did not ask for one */
+  static int default_workers();
+
+private:
+  enum Side { LEFT = 0, RIGHT = 1 };
+
+  struct Task {
+    int index;
+    Side side;
+    cv::Mat frame;
+  };
+
+  struct Pending {
+    FrameCorners result;
+    int remaining;
+  };
+
+  void decode_loop();
+  void worker_loop();
+
+  cv::VideoCapture *capture;
+  cv::Size board_size;
+  bool keep_frames;
+  DetectOptions options;
+  int max_in_flight;
+
+  std::mutex lock;
+  std::condition_variable task_cond;
+  std::condition_variable done_cond;
+  std::condition_variable space_cond;
+  std::condition_variable track_cond;
+
+  std::deque< Task > tasks;
+  std::map< int, Pending > pending;
+  /* Where each frame found the board in each half, waiting for the
+   * frame that starts its fast search there. Keyed by frame index */
+  std::map< int, cv::Rect > track_windows[2];
+  cv::Size im_size;
+  int decoded;
+  int next_index;
+  bool eos;
+  bool stopping;
+
+  std::thread decoder;
+  std::vector< std::thread > workers;
+};
+
+#endif
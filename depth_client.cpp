@@ -0,0 +1,127 @@
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <stdio.h>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "popt_pp.h"
+#include "depth_service.h"
+#include "point_cloud.h"
+
+using namespace std;
+using namespace cv;
+
+/* Sends one side-by-side image to depth_server and writes what comes
+ * back the way undistort_rectify would, optionally timing repeats */
+int main(int argc, char const *argv[])
+{
+  const char* socket_path = "/tmp/stereo_depth.sock";
+  const char* calib_id = "default";
+  const char* img_filename = NULL;
+  const char* out_filename = NULL;
+  const char* point_cloud_filename = NULL;
+  int runs = 1;
+  int list_ids = 0;
+
+  static struct poptOption options[] = {
+    { "socket",'s',POPT_ARG_STRING,&socket_path,0,"Unix socket the server listens on","PATH" },
+    { "calib_id",'c',POPT_ARG_STRING,&calib_id,0,"ID of the calibration to use","STR" },
+    { "in_filename",'i',POPT_ARG_STRING,&img_filename,0,"input image path","STR" },
+    { "out_filename",'o',POPT_ARG_STRING,&out_filename,0,"out image path, written with left, right and disparity prefixes","STR" },
+    { "point_cloud",'p',POPT_ARG_STRING,&point_cloud_filename,0,"Write point cloud (.ply or .xyzrgb for binary, text otherwise)","STR" },
+    { "runs",'n',POPT_ARG_INT,&runs,0,"Send the image this many times and report the latency","NUM" },
+    { "list",'l',POPT_ARG_NONE,&list_ids,0,"List the calibration IDs the server has",NULL },
+    POPT_AUTOHELP
+    { NULL, 0, 0, NULL, 0, NULL, NULL }
+  };
+
+  POpt popt(NULL, argc, argv, options, 0);
+  int c;
+  while((c = popt.getNextOpt()) >= 0) {}
+
+  DepthClient client;
+  if (!client.connect(socket_path)) {
+    cerr << "Could not connect to " << socket_path << ": " << client.error() << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  if (list_ids) {
+    string ids;
+    if (!client.list(ids)) {
+      cerr << client.error() << endl;
+      exit(EXIT_FAILURE);
+    }
+    printf("%s\n", ids.c_str());
+    return 0;
+  }
+
+  if (img_filename == NULL) {
+    cerr << "Please supply an input file name" << endl;
+    exit(EXIT_FAILURE);
+  }
+  Mat img = imread(img_filename, CV_LOAD_IMAGE_COLOR);
+  if (img.empty()) {
+    cerr << "Failed to read " << img_filename << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  uint32_t outputs = 0;
+  if (out_filename)
+    outputs |= OUTPUT_RECTIFIED | OUTPUT_DISPARITY;
+  if (point_cloud_filename)
+    outputs |= OUTPUT_RECTIFIED | OUTPUT_POINTS | OUTPUT_MASK;
+  if (!outputs)
+    outputs = OUTPUT_DISPARITY;
+
+  /* Decode once straight into the shared buffer */
+  Mat frame = client.input(img.size(), img.type(), outputs);
+  if (frame.empty()) {
+    cerr << client.error() << endl;
+    exit(EXIT_FAILURE);
+  }
+  img.copyTo(frame);
+
+  vector< double > round_trip, server;
+  for (int i = 0; i < std::max(runs, 1); i++) {
+    int64 t0 = getTickCount();
+    if (!client.process(calib_id, frame, outputs)) {
+      cerr << "Request failed: " << client.error() << endl;
+      exit(EXIT_FAILURE);
+    }
+    round_trip.push_back((getTickCount() - t0) * 1000. / getTickFrequency());
+    server.push_back(client.server_ms());
+  }
+
+  if (runs > 1) {
+    /* The first request builds the matcher, leave it out */
+    sort(round_trip.begin() + 1, round_trip.end());
+    sort(server.begin() + 1, server.end());
+    size_t mid = 1 + (round_trip.size() - 2) / 2;
+    printf("First request: %.1f ms\n", round_trip[0]);
+    printf("Round trip: p50 %.1f ms, max %.1f ms (server %.1f ms, %.1f ms)\n",
+           round_trip[mid], round_trip.back(), server[mid], server.back());
+  }
+
+  if (out_filename) {
+    Mat disparity_eq;
+    imwrite(string("left") + out_filename, client.left);
+    imwrite(string("right") + out_filename, client.right);
+    cv::normalize(client.disparity, disparity_eq, 0, 256, cv::NORM_MINMAX, CV_8U);
+    imwrite(string("disparity") + out_filename, disparity_eq);
+  }
+
+  if (point_cloud_filename) {
+    PointCloudWriter writer;
+    if (!writer.open(point_cloud_filename, PointCloudWriter::format_for(point_cloud_filename))) {
+      cerr << "Could not write " << point_cloud_filename << endl;
+      exit(EXIT_FAILURE);
+    }
+    writer.write_rows(client.points, client.left, client.mask);
+    writer.close();
+    printf("Wrote %d points to %s\n", (int) writer.points(), point_cloud_filename);
+  }
+
+  return 0;
+}
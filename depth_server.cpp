@@ -0,0 +1,142 @@
+#include <opencv2/core/core.hpp>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "popt_pp.h"
+#include "depth_service.h"
+#include "instrument.h"
+
+using namespace std;
+using namespace cv;
+
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int)
+{
+  stop = 1;
+}
+
+static int listen_on(const char *path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return -1;
+  strcpy(addr.sun_path, path);
+
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+    return -1;
+  /* A socket left behind by a server that did not exit cleanly */
+  unlink(path);
+  if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(sock, 16) != 0) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+int main(int argc, char const *argv[])
+{
+  const char* socket_path = "/tmp/stereo_depth.sock";
+  const char* calib_spec = NULL;
+  int width = 0;
+  int height = 0;
+  int num_stripes = 0;
+  int show_stats = 0;
+  double stats_interval = 10.0;
+  const char* trace_file = NULL;
+  vector< string > specs;
+
+  static struct poptOption options[] = {
+    { "socket",'s',POPT_ARG_STRING,&socket_path,0,"Unix socket to listen on","PATH" },
+    { "calib_file",'c',POPT_ARG_STRING,&calib_spec,'c',"Stereo calibration to serve as ID=FILE, or FILE for ID default. Repeat for more","STR" },
+    { "width",'W',POPT_ARG_INT,&width,0,"Build maps for side-by-side frames of this width at startup","NUM" },
+    { "height",'H',POPT_ARG_INT,&height,0,"Build maps for side-by-side frames of this height at startup","NUM" },
+    { "stripes",'S',POPT_ARG_INT,&num_stripes,0,"Horizontal stripes matched in parallel per request, 0 for one per core","NUM" },
+    { "stats",'I',POPT_ARG_NONE,&show_stats,0,"Print request rate and p50/p99 periodically and at exit",NULL },
+    { "stats_interval",'L',POPT_ARG_DOUBLE,&stats_interval,0,"Seconds between stats lines","SECS" },
+    { "trace",'T',POPT_ARG_STRING,&trace_file,0,"Write a Chrome trace of the timed stages at exit","STR" },
+    POPT_AUTOHELP
+    { NULL, 0, 0, NULL, 0, NULL, NULL }
+  };
+
+  POpt popt(NULL, argc, argv, options, 0);
+  int c;
+  while((c = popt.getNextOpt()) >= 0) {
+    if (c == 'c')
+      specs.push_back(calib_spec);
+  }
+  if (specs.empty())
+    specs.push_back("extrinsics.yml");
+
+  if (show_stats || trace_file)
+    Instrument::enable(trace_file != NULL);
+
+  StripeOptions stripe_options;
+  stripe_options.stripes = num_stripes;
+  DepthService service(stripe_options);
+
+  for (size_t i = 0; i < specs.size(); i++) {
+    size_t eq = specs[i].find('=');
+    string id = eq == string::npos ? "default" : specs[i].substr(0, eq);
+    string file = eq == string::npos ? specs[i] : specs[i].substr(eq + 1);
+    if (!service.add_calibration(id, file.c_str())) {
+      cerr << "Could not load calibration " << id << " from " << file << endl;
+      exit(EXIT_FAILURE);
+    }
+    if (width > 0 && height > 0)
+      service.warm(id, Size(width, height));
+    printf("Serving %s as %s\n", file.c_str(), id.c_str());
+  }
+
+  int sock = listen_on(socket_path);
+  if (sock < 0) {
+    cerr << "Could not listen on " << socket_path << ": " << strerror(errno) << endl;
+    exit(EXIT_FAILURE);
+  }
+  printf("Listening on %s\n", socket_path);
+  fflush(stdout);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  /* A thread per client. Maps and idle matchers are shared, so a
+   * client connecting per request finds them warm. Clients still
+   * connected at exit are simply cut off */
+  while (!stop) {
+    struct pollfd pfd = { sock, POLLIN, 0 };
+    int ready = poll(&pfd, 1, 1000);
+    if (show_stats)
+      Instrument::print_periodic(stdout, "requests", stats_interval);
+    if (ready <= 0)
+      continue;
+
+    int client = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+    if (client < 0)
+      continue;
+    std::thread(&DepthService::serve, &service, client).detach();
+  }
+
+  close(sock);
+  unlink(socket_path);
+  Instrument::report(trace_file);
+  fflush(stdout);
+  /* Skip the destructors, detached threads may still be using the
+   * service. It goes with the process */
+  _exit(0);
+}
@@ -0,0 +1,550 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "depth_service.h"
+#include "instrument.h"
+#include "reproject.h"
+#include "rectify_maps.h"
+
+using namespace std;
+using namespace cv;
+
+static const size_t SLOT_ALIGN = 64;
+
+static uint64_t align_up(uint64_t n)
+{
+  return (n + SLOT_ALIGN - 1) & ~(SLOT_ALIGN - 1);
+}
+
+bool service_frame_ok(int width, int height, int type)
+{
+  return width > 0 && height > 0 && width % 2 == 0 &&
+         width <= SERVICE_MAX_SIDE && height <= SERVICE_MAX_SIDE &&
+         (type == CV_8UC1 || type == CV_8UC3);
+}
+
+ServiceLayout service_layout(Size frame_size, int type, uint32_t outputs)
+{
+  /* Sides of at most SERVICE_MAX_SIDE keep all of this far from overflow */
+  uint64_t half = (uint64_t) (frame_size.width / 2) * (uint64_t) frame_size.height;
+  uint64_t sizes[NUM_SLOTS];
+  sizes[SLOT_FRAME] = 2 * half * CV_ELEM_SIZE(type);
+  sizes[SLOT_LEFT] = sizes[SLOT_RIGHT] = outputs & OUTPUT_RECTIFIED ? half * CV_ELEM_SIZE(type) : 0;
+  sizes[SLOT_DISPARITY] = outputs & OUTPUT_DISPARITY ? half * sizeof(short) : 0;
+  sizes[SLOT_POINTS] = outputs & OUTPUT_POINTS ? half * sizeof(Vec3f) : 0;
+  sizes[SLOT_MASK] = outputs & OUTPUT_MASK ? half : 0;
+
+  ServiceLayout layout;
+  layout.size = 0;
+  for (int i = 0; i < NUM_SLOTS; i++) {
+    layout.offset[i] = sizes[i] ? layout.size : 0;
+    layout.size = align_up(layout.size + sizes[i]);
+  }
+  return layout;
+}
+
+bool send_message(int sock, const void *msg, size_t len, int fd)
+{
+  struct iovec iov;
+  iov.iov_base = (void *) msg;
+  iov.iov_len = len;
+
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+
+  struct msghdr mh;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  if (fd >= 0) {
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+
+  ssize_t n;
+  do {
+    n = sendmsg(sock, &mh, MSG_NOSIGNAL);
+  } while (n < 0 && errno == EINTR);
+  return n == (ssize_t) len;
+}
+
+bool recv_message(int sock, void *msg, size_t len, int *fd)
+{
+  struct iovec iov;
+  iov.iov_base = msg;
+  iov.iov_len = len;
+
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+
+  struct msghdr mh;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = control.buf;
+  mh.msg_controllen = sizeof(control.buf);
+
+  ssize_t n;
+  do {
+    n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+  } while (n < 0 && errno == EINTR);
+
+  int received = -1;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+      memcpy(&received, CMSG_DATA(cmsg), sizeof(int));
+  }
+  /* Don't leak a descriptor the caller did not ask for */
+  if (fd)
+    *fd = received;
+  else if (received >= 0)
+    ::close(received);
+
+  return n == (ssize_t) len && !(mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC));
+}
+
+SharedBuffer::SharedBuffer() : handle(-1), addr(NULL), length(0)
+{
+}
+
+SharedBuffer::~SharedBuffer()
+{
+  close();
+}
+
+bool SharedBuffer::create(size_t size)
+{
+  int fd = memfd_create("stereo-depth", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0)
+    return false;
+
+  /* Sealed against shrinking, so the server can trust its mapping */
+  if (ftruncate(fd, size) != 0 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) != 0) {
+    ::close(fd);
+    return false;
+  }
+  return attach(fd);
+}
+
+bool SharedBuffer::attach(int fd)
+{
+  close();
+
+  /* A buffer that can still shrink would fault our writes past its new
+   * end with SIGBUS. Only memfds carry seals, anything else fails here */
+  int seals = fcntl(fd, F_GET_SEALS);
+  struct stat st;
+  if (seals < 0 || !(seals & F_SEAL_SHRINK) || fstat(fd, &st) != 0 || st.st_size == 0) {
+    ::close(fd);
+    return false;
+  }
+
+  void *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    ::close(fd);
+    return false;
+  }
+
+  handle = fd;
+  addr = p;
+  length = st.st_size;
+  return true;
+}
+
+void SharedBuffer::close()
+{
+  if (addr)
+    munmap(addr, length);
+  if (handle >= 0)
+    ::close(handle);
+  handle = -1;
+  addr = NULL;
+  length = 0;
+}
+
+/* Header over a slot of the shared buffer, or over scratch when the
+ * client did not ask for the slot but a later stage needs it */
+static Mat slot_or(const SharedBuffer &buffer, const ServiceLayout &layout, int slot,
+                   Size size, int type, Mat &scratch)
+{
+  if (layout.offset[slot])
+    return Mat(size, type, buffer.data() + layout.offset[slot]);
+  scratch.create(size, type);
+  return scratch;
+}
+
+static void fail(ServiceReply &reply, int status, const char *fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(reply.message, sizeof(reply.message), fmt, args);
+  va_end(args);
+  reply.status = status;
+}
+
+DepthService::DepthService(const StripeOptions &stripes) : stripes(stripes)
+{
+}
+
+DepthService::~DepthService()
+{
+  map< string, Calibration * >::iterator it;
+  for (it = calibrations.begin(); it != calibrations.end(); ++it) {
+    map< pair< int, int >, RectifyMaps * >::iterator m;
+    for (m = it->second->maps.begin(); m != it->second->maps.end(); ++m)
+      delete m->second;
+    delete it->second;
+  }
+
+  map< pair< int, int >, vector< StripeDisparity * > >::iterator idle;
+  for (idle = idle_matchers.begin(); idle != idle_matchers.end(); ++idle) {
+    for (size_t i = 0; i < idle->second.size(); i++)
+      delete idle->second[i];
+  }
+}
+
+bool DepthService::add_calibration(const string &id, const char *calib_file)
+{
+  if (id.empty() || id.size() >= sizeof(((ServiceRequest *) 0)->calib_id) ||
+      calibrations.count(id))
+    return false;
+
+  Calibration *cal = new Calibration;
+  cal->file = calib_file;
+  if (!cal->calib.load(calib_file)) {
+    delete cal;
+    return false;
+  }
+  calibrations[id] = cal;
+  return true;
+}
+
+bool DepthService::warm(const string &id, Size frame_size, int type)
+{
+  map< string, Calibration * >::iterator it = calibrations.find(id);
+  if (it == calibrations.end())
+    return false;
+  maps_for(it->second, frame_size);
+  int cn = CV_MAT_CN(type);
+  release_matcher(frame_size.width / 2, cn, acquire_matcher(frame_size.width / 2, cn));
+  return true;
+}
+
+const RectifyMaps *DepthService::maps_for(Calibration *cal, Size frame_size)
+{
+  /* Maps are never dropped, so the pointer stays good after unlocking */
+  unique_lock< mutex > l(maps_lock);
+  RectifyMaps *&maps = cal->maps[make_pair(frame_size.width, frame_size.height)];
+  if (!maps) {
+    maps = new RectifyMaps;
+    cal->calib.init_maps(*maps, cal->file.c_str(),
+                         Size(frame_size.width / 2, frame_size.height));
+  }
+  return maps;
+}
+
+StripeDisparity *DepthService::acquire_matcher(int half_width, int channels)
+{
+  {
+    unique_lock< mutex > l(matchers_lock);
+    vector< StripeDisparity * > &idle = idle_matchers[make_pair(half_width, channels)];
+    if (!idle.empty()) {
+      StripeDisparity *matcher = idle.back();
+      idle.pop_back();
+      return matcher;
+    }
+  }
+  /* Only as many are ever built as requests of this kind run at once */
+  return new StripeDisparity(create_sgbm(half_width, 0, channels), stripes);
+}
+
+void DepthService::release_matcher(int half_width, int channels, StripeDisparity *matcher)
+{
+  unique_lock< mutex > l(matchers_lock);
+  idle_matchers[make_pair(half_width, channels)].push_back(matcher);
+}
+
+string DepthService::list() const
+{
+  string ids;
+  map< string, Calibration * >::const_iterator it;
+  for (it = calibrations.begin(); it != calibrations.end(); ++it)
+    ids += (ids.empty() ? "" : ",") + it->first;
+  return ids;
+}
+
+void DepthService::serve(int sock)
+{
+  SharedBuffer buffer;
+  Mat left_scratch, right_scratch, disparity_scratch;
+  ServiceRequest req;
+  int fd;
+
+  while (recv_message(sock, &req, sizeof(req), &fd)) {
+    int64 start = getTickCount();
+    ServiceReply reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.magic = SERVICE_MAGIC;
+
+    if (req.magic != SERVICE_MAGIC) {
+      if (fd >= 0)
+        ::close(fd);
+      break;
+    }
+
+    if (req.op == SERVICE_ATTACH) {
+      if (fd < 0 || !buffer.attach(fd))
+        fail(reply, EINVAL, "Could not map the shared buffer");
+    } else if (fd >= 0) {
+      ::close(fd);
+      fail(reply, EINVAL, "Unexpected descriptor");
+    } else if (req.op == SERVICE_LIST) {
+      snprintf(reply.message, sizeof(reply.message), "%s", list().c_str());
+    } else if (req.op == SERVICE_PROCESS) {
+      string id(req.calib_id, strnlen(req.calib_id, sizeof(req.calib_id)));
+      map< string, Calibration * >::iterator it = calibrations.find(id);
+      Size frame_size(req.width, req.height);
+      ServiceLayout layout;
+      memset(&layout, 0, sizeof(layout));
+
+      if (it == calibrations.end()) {
+        fail(reply, ENOENT, "No calibration %s", id.c_str());
+      } else if (!service_frame_ok(req.width, req.height, req.type)) {
+        fail(reply, EINVAL, "Unsupported frame %dx%d type %d", req.width, req.height, req.type);
+      } else if ((layout = service_layout(frame_size, req.type, req.outputs)).size >
+                 (uint64_t) buffer.size()) {
+        fail(reply, ENOBUFS, "Shared buffer holds %zu bytes, %llu needed",
+             buffer.size(), (unsigned long long) layout.size);
+      } else {
+        Calibration *cal = it->second;
+        const RectifyMaps *maps = maps_for(cal, frame_size);
+        Size half(req.width / 2, req.height);
+        Mat frame(frame_size, req.type, buffer.data());
+        Mat left = slot_or(buffer, layout, SLOT_LEFT, half, req.type, left_scratch);
+        Mat right = slot_or(buffer, layout, SLOT_RIGHT, half, req.type, right_scratch);
+        Mat mask;
+        if (req.outputs & OUTPUT_MASK)
+          mask = Mat(half, CV_8U, buffer.data() + layout.offset[SLOT_MASK]);
+
+        remap_side_by_side(frame, *maps, left, right, mask.empty() ? NULL : &mask);
+
+        if (req.outputs & (OUTPUT_DISPARITY | OUTPUT_POINTS)) {
+          int cn = CV_MAT_CN(req.type);
+          StripeDisparity *stereo = acquire_matcher(half.width, cn);
+          Mat disparity = slot_or(buffer, layout, SLOT_DISPARITY, half, CV_16S,
+                                  disparity_scratch);
+          stereo->compute(left, right, disparity);
+          release_matcher(half.width, cn, stereo);
+
+          if (req.outputs & OUTPUT_POINTS) {
+            Mat points(half, CV_32FC3, buffer.data() + layout.offset[SLOT_POINTS]);
+            reproject_disparity(disparity, cal->calib.Q, 0, points);
+          }
+        }
+        memcpy(reply.offset, layout.offset, sizeof(reply.offset));
+        Instrument::count("requests");
+      }
+    } else {
+      fail(reply, EINVAL, "Unknown request %u", req.op);
+    }
+
+    int64 end = getTickCount();
+    reply.ms = (end - start) * 1000. / getTickFrequency();
+    Instrument::record("request", start, end);
+    if (reply.status)
+      Instrument::count("failed");
+    if (!send_message(sock, &reply, sizeof(reply)))
+      break;
+  }
+
+  ::close(sock);
+}
+
+DepthClient::DepthClient() : sock(-1), last_ms(0)
+{
+}
+
+DepthClient::~DepthClient()
+{
+  close();
+}
+
+bool DepthClient::connect(const char *socket_path)
+{
+  close();
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    last_error = "Socket path too long";
+    return false;
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock < 0 || ::connect(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+    last_error = strerror(errno);
+    close();
+    return false;
+  }
+  return true;
+}
+
+void DepthClient::close()
+{
+  if (sock >= 0)
+    ::close(sock);
+  sock = -1;
+  buffer.close();
+}
+
+bool DepthClient::request(const ServiceRequest &req, ServiceReply &reply, int fd)
+{
+  if (sock < 0) {
+    last_error = "Not connected";
+    return false;
+  }
+  if (!send_message(sock, &req, sizeof(req), fd) ||
+      !recv_message(sock, &reply, sizeof(reply)) || reply.magic != SERVICE_MAGIC) {
+    last_error = "Lost the connection to the server";
+    close();
+    return false;
+  }
+
+  last_ms = reply.ms;
+  if (reply.status) {
+    last_error = reply.message;
+    return false;
+  }
+  return true;
+}
+
+/* Grow the shared buffer and hand the new one to the server */
+bool DepthClient::reserve(uint64_t size)
+{
+  if (buffer.size() >= size)
+    return true;
+  if (size > (uint64_t) SIZE_MAX) {
+    last_error = "Frame too large for a shared buffer";
+    return false;
+  }
+
+  if (!buffer.create(size)) {
+    last_error = "Could not create a shared buffer";
+    return false;
+  }
+
+  ServiceRequest req;
+  ServiceReply reply;
+  memset(&req, 0, sizeof(req));
+  req.magic = SERVICE_MAGIC;
+  req.op = SERVICE_ATTACH;
+  if (!request(req, reply, buffer.fd())) {
+    buffer.close();
+    return false;
+  }
+  return true;
+}
+
+Mat DepthClient::input(Size frame_size, int type, uint32_t outputs)
+{
+  if (!service_frame_ok(frame_size.width, frame_size.height, type)) {
+    last_error = "Unsupported frame size or type";
+    return Mat();
+  }
+  if (!reserve(service_layout(frame_size, type, outputs).size))
+    return Mat();
+  return Mat(frame_size, type, buffer.data());
+}
+
+bool DepthClient::process(const string &id, const Mat &frame, uint32_t outputs)
+{
+  left.release();
+  right.release();
+  disparity.release();
+  points.release();
+  mask.release();
+
+  if (id.size() >= sizeof(((ServiceRequest *) 0)->calib_id)) {
+    last_error = "Calibration ID too long";
+    return false;
+  }
+
+  Size size = frame.size();
+  if (!service_frame_ok(size.width, size.height, frame.type())) {
+    last_error = "Unsupported frame size or type";
+    return false;
+  }
+  uint64_t needed = service_layout(size, frame.type(), outputs).size;
+
+  /* A frame already in the buffer is kept in place, unless growing the
+   * buffer is about to unmap it or it is not at the start */
+  Mat src = frame;
+  bool in_buffer = frame.data >= buffer.data() && frame.data < buffer.data() + buffer.size();
+  if (in_buffer && (needed > buffer.size() || frame.data != buffer.data()))
+    src = frame.clone();
+  if (!reserve(needed))
+    return false;
+
+  if (src.data != buffer.data()) {
+    Mat dst(size, frame.type(), buffer.data());
+    src.copyTo(dst);
+  }
+
+  ServiceRequest req;
+  ServiceReply reply;
+  memset(&req, 0, sizeof(req));
+  req.magic = SERVICE_MAGIC;
+  req.op = SERVICE_PROCESS;
+  strcpy(req.calib_id, id.c_str());
+  req.width = size.width;
+  req.height = size.height;
+  req.type = frame.type();
+  req.outputs = outputs;
+  if (!request(req, reply))
+    return false;
+
+  Size half(size.width / 2, size.height);
+  unsigned char *base = buffer.data();
+  if (reply.offset[SLOT_LEFT])
+    left = Mat(half, frame.type(), base + reply.offset[SLOT_LEFT]);
+  if (reply.offset[SLOT_RIGHT])
+    right = Mat(half, frame.type(), base + reply.offset[SLOT_RIGHT]);
+  if (reply.offset[SLOT_DISPARITY])
+    disparity = Mat(half, CV_16S, base + reply.offset[SLOT_DISPARITY]);
+  if (reply.offset[SLOT_POINTS])
+    points = Mat(half, CV_32FC3, base + reply.offset[SLOT_POINTS]);
+  if (reply.offset[SLOT_MASK])
+    mask = Mat(half, CV_8U, base + reply.offset[SLOT_MASK]);
+  return true;
+}
+
+bool DepthClient::list(string &ids)
+{
+  ServiceRequest req;
+  ServiceReply reply;
+  memset(&req, 0, sizeof(req));
+  req.magic = SERVICE_MAGIC;
+  req.op = SERVICE_LIST;
+  if (!request(req, reply))
+    return false;
+  ids = reply.message;
+  return true;
+}
@@ -0,0 +1,209 @@
+#ifndef _INCLUDED_DEPTH_SERVICE_H_
+#define _INCLUDED_DEPTH_SERVICE_H_
+
+#include <opencv2/core/core.hpp>
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "calibration.h"
+#include "rectify_maps.h"
+#include "stripe_disparity.h"
+
+/*
+ * Local rectification and disparity service. A daemon keeps one or
+ * more calibrations loaded under short IDs, with their maps and
+ * matchers warm, and clients send it side-by-side frames over a Unix
+ * domain socket.
+ *
+ * Pixels never go through the socket. Each client creates a shared
+ * memory buffer, sealed so it can't shrink under the server, and hands
+ * its descriptor to the server once, with SERVICE_ATTACH. A frame is then written to the start of the buffer,
+ * SERVICE_PROCESS names the calibration and the outputs wanted, and
+ * the server rectifies, matches and reprojects straight into the same
+ * buffer at the offsets in the reply. service_layout() gives the
+ * buffer size both sides expect.
+ */
+
+static const uint32_t SERVICE_MAGIC = 0x53444550; /* "PEDS" */
+
+enum ServiceOp {
+  SERVICE_ATTACH = 1,  /* Comes with the buffer's descriptor */
+  SERVICE_PROCESS = 2,
+  SERVICE_LIST = 3     /* Reply message lists the calibration IDs */
+};
+
+/* Outputs a request can ask for, as a bit mask */
+enum ServiceOutput {
+  OUTPUT_RECTIFIED = 1, /* Both rectified halves, frame type */
+  OUTPUT_DISPARITY = 2, /* CV_16S with 4 fractional bits */
+  OUTPUT_POINTS = 4,    /* CV_32FC3, as reproject_disparity() */
+  OUTPUT_MASK = 8       /* CV_8U, valid pixels of the left half */
+};
+
+enum ServiceSlot {
+  SLOT_FRAME,
+  SLOT_LEFT,
+  SLOT_RIGHT,
+  SLOT_DISPARITY,
+  SLOT_POINTS,
+  SLOT_MASK,
+  NUM_SLOTS
+};
+
+struct ServiceRequest {
+  uint32_t magic;
+  uint32_t op;
+  char calib_id[32];
+  int32_t width, height; /* Of the whole side-by-side frame */
+  int32_t type;          /* CV_8UC1 or CV_8UC3 */
+  uint32_t outputs;
+};
+
+struct ServiceReply {
+  uint32_t magic;
+  int32_t status;       /* 0, or an errno value */
+  uint64_t offset[NUM_SLOTS];
+  double ms;            /* Server time for the request */
+  char message[256];    /* Error text, or the IDs for SERVICE_LIST */
+};
+
+/* Largest frame width or height the service takes, which keeps every
+ * buffer size well inside 64 bits */
+static const int SERVICE_MAX_SIDE = 16384;
+
+/* Whether a frame size and type from a request can be served: an even
+ * width, both sides within SERVICE_MAX_SIDE, CV_8UC1 or CV_8UC3 */
+bool service_frame_ok(int width, int height, int type);
+
+/* Where each slot goes in the shared buffer for a frame of this size
+ * and type, 64-byte aligned. The frame is always at offset 0, and
+ * slots not in outputs are left at 0 as well. Only meaningful for a
+ * frame service_frame_ok() accepts */
+struct ServiceLayout {
+  uint64_t offset[NUM_SLOTS];
+  uint64_t size;
+};
+
+ServiceLayout service_layout(cv::Size frame_size, int type, uint32_t outputs);
+
+/* One message of exactly len bytes, with a descriptor attached if fd
+ * is not -1. Both return false on error or a closed connection */
+bool send_message(int sock, const void *msg, size_t len, int fd = -1);
+bool recv_message(int sock, void *msg, size_t len, int *fd = NULL);
+
+/* Anonymous shared memory (a memfd), mapped read-write */
+class SharedBuffer {
+public:
+  SharedBuffer();
+  ~SharedBuffer();
+
+  /* A new buffer of the given size, for the client, sealed so it can
+   * never shrink */
+  bool create(size_t size);
+  /* Map a buffer received from a client. Takes ownership of fd. Fails
+   * unless the buffer is sealed against shrinking */
+  bool attach(int fd);
+  void close();
+
+  unsigned char *data() const { return (unsigned char *) addr; }
+  size_t size() const { return length; }
+  int fd() const { return handle; }
+
+private:
+  SharedBuffer(const SharedBuffer &);
+  SharedBuffer &operator=(const SharedBuffer &);
+
+  int handle;
+  void *addr;
+  size_t length;
+};
+
+/*
+ * The daemon's state: calibrations by ID and their maps by frame size,
+ * built on first use and kept. serve() runs one client connection and
+ * is meant to be called from a thread per client.
+ */
+class DepthService {
+public:
+  explicit DepthService(const StripeOptions &stripes = StripeOptions());
+  ~DepthService();
+
+  /* Load a calibration file of either format under an ID */
+  bool add_calibration(const std::string &id, const char *calib_file);
+
+  /* Build the maps and a matcher for a frame size and type now rather
+   * than on the first request */
+  bool warm(const std::string &id, cv::Size frame_size, int type = CV_8UC3);
+
+  /* Handle requests until the client disconnects, then close sock */
+  void serve(int sock);
+
+private:
+  struct Calibration {
+    std::string file;
+    StereoCalibration calib;
+    /* By side-by-side frame width and height */
+    std::map< std::pair< int, int >, RectifyMaps * > maps;
+  };
+
+  const RectifyMaps *maps_for(Calibration *cal, cv::Size frame_size);
+  /* A matcher for this half width and channel count that no other
+   * request is using, handed back with release_matcher() when the
+   * request is done */
+  StripeDisparity *acquire_matcher(int half_width, int channels);
+  void release_matcher(int half_width, int channels, StripeDisparity *matcher);
+  std::string list() const;
+
+  StripeOptions stripes;
+  std::map< std::string, Calibration * > calibrations;
+  /* Guards the maps of every calibration. Calibrations are only added
+   * before serving starts */
+  std::mutex maps_lock;
+  /* Matchers not in use, by half width and channel count, which sets
+   * the smoothness penalties. They outlive the connections, so a
+   * client connecting once per request still finds them warm */
+  std::map< std::pair< int, int >, std::vector< StripeDisparity * > > idle_matchers;
+  std::mutex matchers_lock;
+};
+
+/* Client side of the protocol, one connection and one buffer */
+class DepthClient {
+public:
+  DepthClient();
+  ~DepthClient();
+
+  bool connect(const char *socket_path);
+  void close();
+
+  /* Header into the shared buffer to fill with the next frame, which
+   * process() then sends without copying */
+  cv::Mat input(cv::Size frame_size, int type, uint32_t outputs);
+
+  /* Rectify and match a side-by-side frame with the calibration id.
+   * On success the requested outputs are headers into the shared
+   * buffer, valid until the next call. On failure error() says why */
+  bool process(const std::string &id, const cv::Mat &frame, uint32_t outputs);
+
+  /* Calibration IDs the server has, comma separated */
+  bool list(std::string &ids);
+
+  const std::string &error() const { return last_error; }
+  /* Server time for the last request */
+  double server_ms() const { return last_ms; }
+
+  cv::Mat left, right, disparity, points, mask;
+
+private:
+  bool request(const ServiceRequest &req, ServiceReply &reply, int fd = -1);
+  bool reserve(uint64_t size);
+
+  int sock;
+  SharedBuffer buffer;
+  std::string last_error;
+  double last_ms;
+};
+
+#endif
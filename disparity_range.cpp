@@ -0,0 +1,138 @@
+#include <algorithm>
+#include "disparity_range.h"
+
+using namespace std;
+using namespace cv;
+
+/* Share of matched pixels allowed in the outermost disparity of a
+ * narrowed range before we assume the scene extends past it */
+static const double EDGE_FRACTION = 0.01;
+
+DisparityRangePredictor::DisparityRangePredictor(int min_disparity, int num_disparities,
+                                                 const RangeOptions &options)
+  : options(options), min_full(min_disparity), num_full(num_disparities)
+{
+  reset();
+}
+
+void DisparityRangePredictor::reset()
+{
+  recent.clear();
+  totals.assign(num_full, 0);
+  full_coverage = 0;
+  force_full = true;
+}
+
+void DisparityRangePredictor::predict(int &min_disparity, int &num_disparities)
+{
+  unique_lock< mutex > l(lock);
+
+  min_disparity = min_full;
+  num_disparities = num_full;
+
+  if (force_full || recent.empty()) {
+    force_full = false;
+    return;
+  }
+
+  long n = 0;
+  for (int i = 0; i < num_full; i++)
+    n += totals[i];
+  if (n == 0)
+    return;
+
+  /* Trim the tails of the combined histogram */
+  long low_count = (long) (n * options.tail), high_count = n - low_count;
+  int lo = 0, hi = num_full - 1;
+  long sum = 0;
+  for (int i = 0; i < num_full; i++) {
+    sum += totals[i];
+    if (sum > low_count) {
+      lo = i;
+      break;
+    }
+  }
+  sum = 0;
+  for (int i = 0; i < num_full; i++) {
+    sum += totals[i];
+    if (sum >= high_count) {
+      hi = i;
+      break;
+    }
+  }
+
+  int lo_d = std::max(lo - options.margin, 0);
+  int hi_d = std::min(hi + options.margin, num_full - 1);
+  int num = std::min((hi_d - lo_d + 1 + 15) & -16, num_full);
+
+  /* Rounding up may run past the end of the full range */
+  lo_d = std::min(lo_d, num_full - num);
+  min_disparity = min_full + lo_d;
+  num_disparities = num;
+}
+
+void DisparityRangePredictor::update(const Mat &disparity, int min_disparity,
+                                     int num_disparities)
+{
+  CV_Assert(disparity.type() == CV_16S);
+
+  vector< int > hist(num_full, 0);
+  long matched = 0;
+  const int lo_raw = min_disparity * 16;
+  const int hi_raw = (min_disparity + num_disparities) * 16;
+
+  for (int y = 0; y < disparity.rows; y++) {
+    const short *d = disparity.ptr< short >(y);
+    for (int x = 0; x < disparity.cols; x++) {
+      if (d[x] < lo_raw || d[x] >= hi_raw)
+        continue;
+      hist[(d[x] >> 4) - min_full]++;
+      matched++;
+    }
+  }
+
+  double coverage = (double) matched / std::max((int) disparity.total(), 1);
+  bool full = min_disparity == min_full && num_disparities == num_full;
+
+  unique_lock< mutex > l(lock);
+
+  if (full) {
+    full_coverage = coverage;
+  } else {
+    int first = min_disparity - min_full, last = first + num_disparities - 1;
+    bool at_edge = (first > 0 && hist[first] > matched * EDGE_FRACTION) ||
+                   (last < num_full - 1 && hist[last] > matched * EDGE_FRACTION);
+
+    if (at_edge || coverage < full_coverage * options.min_coverage) {
+      reset();
+      return;
+    }
+  }
+
+  recent.push_back(hist);
+  for (int i = 0; i < num_full; i++)
+    totals[i] += hist[i];
+
+  while ((int) recent.size() > std::max(options.history, 1)) {
+    const vector< int > &old = recent.front();
+    for (int i = 0; i < num_full; i++)
+      totals[i] -= old[i];
+    recent.pop_front();
+  }
+}
+
+void normalize_unmatched(Mat &disparity, int min_disparity, int full_min_disparity)
+{
+  if (min_disparity == full_min_disparity)
+    return;
+
+  /* In place, without the temporary mask a comparison would allocate */
+  const short lo = (short) (min_disparity * 16);
+  const short unmatched = (short) ((full_min_disparity - 1) * 16);
+  for (int y = 0; y < disparity.rows; y++) {
+    short *d = disparity.ptr< short >(y);
+    for (int x = 0; x < disparity.cols; x++)
+      if (d[x] < lo)
+        d[x] = unmatched;
+  }
+}
@@ -0,0 +1,63 @@
+#ifndef _INCLUDED_DISPARITY_RANGE_H_
+#define _INCLUDED_DISPARITY_RANGE_H_
+
+#include <opencv2/core/core.hpp>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+struct RangeOptions {
+  /* Disparities added either side of the predicted range */
+  int margin;
+  /* Fraction of matched pixels ignored at each end of the histogram */
+  double tail;
+  /* Frames whose histograms are combined for the prediction */
+  int history;
+  /* Go back to a full search when the share of matched pixels drops
+   * below this fraction of what the last full search matched */
+  double min_coverage;
+
+  RangeOptions() : margin(8), tail(0.005), history(5), min_coverage(0.9) {}
+};
+
+/*
+ * Predicts the disparity range of the next video frame from a histogram
+ * of the last few frames, so SGBM only searches the depths actually in
+ * the scene. Starts with, and falls back to, the full range whenever
+ * the narrowed search loses coverage or the scene runs up against the
+ * edges of the range. Safe to share between disparity workers.
+ */
+class DisparityRangePredictor {
+public:
+  DisparityRangePredictor(int min_disparity, int num_disparities,
+                          const RangeOptions &options = RangeOptions());
+
+  /* Range to search for the next frame. num_disparities is a multiple
+   * of 16, as StereoSGBM requires */
+  void predict(int &min_disparity, int &num_disparities);
+
+  /* Feed back a CV_16S disparity map computed with the given range */
+  void update(const cv::Mat &disparity, int min_disparity, int num_disparities);
+
+  int full_min() const { return min_full; }
+  int full_num() const { return num_full; }
+
+private:
+  void reset();
+
+  RangeOptions options;
+  int min_full, num_full;
+
+  std::mutex lock;
+  std::deque< std::vector< int > > recent;
+  std::vector< int > totals;
+  double full_coverage;
+  bool force_full;
+};
+
+/* StereoSGBM marks unmatched pixels with min_disparity - 1. Rewrite
+ * those from a narrowed search to the full range's marker, so the
+ * output looks the same whatever range was searched */
+void normalize_unmatched(cv::Mat &disparity, int min_disparity, int full_min_disparity);
+
+#endif
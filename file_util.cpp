@@ -0,0 +1,89 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+#include "file_util.h"
+
+using namespace std;
+
+static const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+static const uint64_t FNV_PRIME = 1099511628211ULL;
+
+uint64_t hash_file(const char *filename)
+{
+  FILE *fp = fopen(filename, "rb");
+  if (!fp)
+    return 0;
+
+  vector< unsigned char > buf(1 << 20);
+  uint64_t hash = FNV_OFFSET;
+  uint64_t total = 0;
+  size_t n;
+
+  /* FNV-1a a word at a time, it only has to tell files apart */
+  while ((n = fread(&buf[0], 1, buf.size(), fp)) > 0) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+      uint64_t word;
+      memcpy(&word, &buf[i], 8);
+      hash = (hash ^ word) * FNV_PRIME;
+    }
+    for (; i < n; i++)
+      hash = (hash ^ buf[i]) * FNV_PRIME;
+    total += n;
+  }
+  fclose(fp);
+
+  return (hash ^ total) * FNV_PRIME;
+}
+
+MappedFile::MappedFile() : addr(NULL), length(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+  close();
+}
+
+bool MappedFile::open(const char *filename)
+{
+  close();
+
+  int fd = ::open(filename, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    ::close(fd);
+    return false;
+  }
+
+  void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED)
+    return false;
+
+  addr = p;
+  length = st.st_size;
+  return true;
+}
+
+void MappedFile::close()
+{
+  if (addr)
+    munmap(addr, length);
+  addr = NULL;
+  length = 0;
+}
+
+void MappedFile::swap(MappedFile &other)
+{
+  std::swap(addr, other.addr);
+  std::swap(length, other.length);
+}
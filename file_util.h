@@ -0,0 +1,31 @@
+#ifndef _INCLUDED_FILE_UTIL_H_
+#define _INCLUDED_FILE_UTIL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* 64-bit FNV-1a over the size and contents of a file, 0 on error */
+uint64_t hash_file(const char *filename);
+
+/* A whole file mapped read-only into memory, unmapped on destruction */
+class MappedFile {
+public:
+  MappedFile();
+  ~MappedFile();
+
+  bool open(const char *filename);
+  void close();
+  void swap(MappedFile &other);
+
+  const unsigned char *data() const { return (const unsigned char *) addr; }
+  size_t size() const { return length; }
+
+private:
+  MappedFile(const MappedFile &);
+  MappedFile &operator=(const MappedFile &);
+
+  void *addr;
+  size_t length;
+};
+
+#endif
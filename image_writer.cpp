@@ -0,0 +1,108 @@
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <algorithm>
+#include "image_writer.h"
+#include "instrument.h"
+
+using namespace std;
+using namespace cv;
+
+AsyncImageWriter::AsyncImageWriter(int num_threads, int max_queued, Size resize_to)
+  : resize_to(resize_to), max_queued(std::max(max_queued, 1)), busy(0), n_written(0),
+    n_failed(0), stopping(false)
+{
+  for (int i = 0; i < std::max(num_threads, 1); i++)
+    workers.push_back(thread(&AsyncImageWriter::worker_loop, this));
+}
+
+AsyncImageWriter::~AsyncImageWriter()
+{
+  {
+    unique_lock< mutex > l(lock);
+    stopping = true;
+  }
+  job_cond.notify_all();
+  for (size_t i = 0; i < workers.size(); i++)
+    workers[i].join();
+}
+
+bool AsyncImageWriter::write(const vector< string > &filenames, const vector< Mat > &images)
+{
+  CV_Assert(filenames.size() == images.size());
+  {
+    unique_lock< mutex > l(lock);
+    if (jobs.size() + images.size() > max_queued) {
+      Instrument::count("write_dropped", (long) images.size());
+      return false;
+    }
+    for (size_t i = 0; i < images.size(); i++) {
+      Job job = { filenames[i], images[i] };
+      jobs.push_back(job);
+    }
+  }
+  job_cond.notify_all();
+  return true;
+}
+
+void AsyncImageWriter::finish()
+{
+  unique_lock< mutex > l(lock);
+  while (!jobs.empty() || busy)
+    idle_cond.wait(l);
+}
+
+int AsyncImageWriter::written() const
+{
+  unique_lock< mutex > l(lock);
+  return n_written;
+}
+
+int AsyncImageWriter::failed() const
+{
+  unique_lock< mutex > l(lock);
+  return n_failed;
+}
+
+void AsyncImageWriter::worker_loop()
+{
+  Mat resized;
+  unique_lock< mutex > l(lock);
+
+  for (;;) {
+    /* Drain the queue before stopping, nothing queued is lost */
+    while (jobs.empty() && !stopping)
+      job_cond.wait(l);
+    if (jobs.empty())
+      break;
+
+    Job job = jobs.front();
+    jobs.pop_front();
+    busy++;
+    l.unlock();
+
+    bool ok;
+    {
+      ScopedTimer timer("imwrite");
+      const Mat *out = &job.image;
+      if (resize_to.area() > 0 && job.image.size() != resize_to) {
+        resize(job.image, resized, resize_to);
+        out = &resized;
+      }
+      /* An unknown extension throws, which would take the thread down */
+      try {
+        ok = imwrite(job.filename, *out);
+      } catch (const cv::Exception &) {
+        ok = false;
+      }
+    }
+
+    l.lock();
+    busy--;
+    if (ok)
+      n_written++;
+    else
+      n_failed++;
+    if (jobs.empty() && !busy)
+      idle_cond.notify_all();
+  }
+}
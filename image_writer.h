@@ -0,0 +1,62 @@
+#ifndef _INCLUDED_IMAGE_WRITER_H_
+#define _INCLUDED_IMAGE_WRITER_H_
+
+#include <opencv2/core/core.hpp>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Encodes and writes images on a pool of background threads, so a
+ * capture or display loop never waits on imwrite(). The queue in front
+ * of the pool is bounded: when the disk can't keep up, write() refuses
+ * new images instead of letting memory grow.
+ */
+class AsyncImageWriter {
+public:
+  /* Images are resized to resize_to first unless it is empty */
+  AsyncImageWriter(int num_threads, int max_queued, cv::Size resize_to = cv::Size());
+  /* Writes whatever is still queued */
+  ~AsyncImageWriter();
+
+  /* Queue images to be written under the matching file names, all of
+   * them or none: returns false without queueing anything when there
+   * isn't room for every one. The images are not copied, so the caller
+   * must not modify them afterwards */
+  bool write(const std::vector< std::string > &filenames, const std::vector< cv::Mat > &images);
+
+  /* Block until every queued image has been written */
+  void finish();
+
+  int written() const;
+  int failed() const;
+
+private:
+  AsyncImageWriter(const AsyncImageWriter &);
+  AsyncImageWriter &operator=(const AsyncImageWriter &);
+
+  struct Job {
+    std::string filename;
+    cv::Mat image;
+  };
+
+  void worker_loop();
+
+  cv::Size resize_to;
+  size_t max_queued;
+
+  mutable std::mutex lock;
+  std::condition_variable job_cond;
+  std::condition_variable idle_cond;
+  std::deque< Job > jobs;
+  int busy;
+  int n_written, n_failed;
+  bool stopping;
+
+  std::vector< std::thread > workers;
+};
+
+#endif
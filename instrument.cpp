@@ -0,0 +1,237 @@
+#include <math.h>
+#include <string.h>
+#include <map>
+#include <mutex>
+#include <vector>
+#include "instrument.h"
+
+using namespace std;
+using namespace cv;
+
+/* Histogram buckets per doubling of latency, starting at 1us */
+static const int BUCKETS_PER_OCTAVE = 8;
+/* Up to 2^26us, about a minute */
+static const int NUM_BUCKETS = 26 * BUCKETS_PER_OCTAVE;
+/* Trace events kept at most, so a long run can't eat all the memory */
+static const size_t MAX_TRACE_EVENTS = 4 << 20;
+
+/* Log-scale latency histogram, percentiles to within a tenth or so */
+struct LatencyHistogram {
+  vector< long > buckets;
+  long count;
+
+  LatencyHistogram() : buckets(NUM_BUCKETS, 0), count(0) {}
+
+  void add(double ms)
+  {
+    double us = ms * 1000;
+    int b = us > 1 ? (int) (log2(us) * BUCKETS_PER_OCTAVE) : 0;
+    buckets[std::min(b, NUM_BUCKETS - 1)]++;
+    count++;
+  }
+
+  double percentile(double p) const
+  {
+    long rank = (long) ceil(p / 100 * count), seen = 0;
+    for (int b = 0; b < NUM_BUCKETS; b++) {
+      seen += buckets[b];
+      if (seen >= rank && seen > 0)
+        return pow(2., (b + 0.5) / BUCKETS_PER_OCTAVE) / 1000;
+    }
+    return 0;
+  }
+
+  void clear()
+  {
+    buckets.assign(NUM_BUCKETS, 0);
+    count = 0;
+  }
+};
+
+struct Stage {
+  const char *name;
+  LatencyHistogram all, window;
+  double total_ms, max_ms;
+
+  Stage(const char *name) : name(name), total_ms(0), max_ms(0) {}
+};
+
+struct Counter {
+  const char *name;
+  long total, window;
+
+  Counter(const char *name) : name(name), total(0), window(0) {}
+};
+
+/* A stage run, or a counter's new total when name is a counter */
+struct TraceEvent {
+  const char *name;
+  int tid;
+  bool counter;
+  int64 start, end;
+  long value;
+};
+
+struct NameLess {
+  bool operator()(const char *a, const char *b) const { return strcmp(a, b) < 0; }
+};
+
+atomic< bool > Instrument::on(false);
+
+static mutex registry_lock;
+static bool tracing;
+static int64 enabled_at, window_start;
+static vector< Stage * > stages;
+static vector< Counter * > counters;
+static map< const char *, Stage *, NameLess > stage_index;
+static map< const char *, Counter *, NameLess > counter_index;
+static vector< TraceEvent > events;
+static atomic< int > next_tid(1);
+
+static double ticks_to_ms(int64 ticks)
+{
+  return ticks * 1000. / getTickFrequency();
+}
+
+/* Small stable number for the calling thread, for the trace */
+static int thread_id()
+{
+  static thread_local int tid = next_tid++;
+  return tid;
+}
+
+void Instrument::enable(bool trace)
+{
+  unique_lock< mutex > l(registry_lock);
+  tracing = trace;
+  enabled_at = window_start = getTickCount();
+  on = true;
+}
+
+void Instrument::add_sample(const char *name, int64 start, int64 end)
+{
+  double ms = ticks_to_ms(end - start);
+  int tid = tracing ? thread_id() : 0;
+  unique_lock< mutex > l(registry_lock);
+
+  Stage *&stage = stage_index[name];
+  if (!stage) {
+    stage = new Stage(name);
+    stages.push_back(stage);
+  }
+  stage->all.add(ms);
+  stage->window.add(ms);
+  stage->total_ms += ms;
+  stage->max_ms = std::max(stage->max_ms, ms);
+
+  if (tracing && events.size() < MAX_TRACE_EVENTS) {
+    TraceEvent e = { name, tid, false, start, end, 0 };
+    events.push_back(e);
+  }
+}
+
+void Instrument::add_count(const char *name, long n)
+{
+  int64 now = tracing ? getTickCount() : 0;
+  int tid = tracing ? thread_id() : 0;
+  unique_lock< mutex > l(registry_lock);
+
+  Counter *&counter = counter_index[name];
+  if (!counter) {
+    counter = new Counter(name);
+    counters.push_back(counter);
+  }
+  counter->total += n;
+  counter->window += n;
+
+  if (tracing && events.size() < MAX_TRACE_EVENTS) {
+    TraceEvent e = { name, tid, true, now, now, counter->total };
+    events.push_back(e);
+  }
+}
+
+void Instrument::print_summary(FILE *fp)
+{
+  unique_lock< mutex > l(registry_lock);
+
+  if (!stages.empty())
+    fprintf(fp, "%-20s %8s %9s %9s %9s %9s (ms)\n", "stage", "count", "mean", "p50", "p99", "max");
+  for (size_t i = 0; i < stages.size(); i++) {
+    const Stage *s = stages[i];
+    fprintf(fp, "%-20s %8ld %9.2f %9.2f %9.2f %9.2f\n", s->name, s->all.count,
+            s->total_ms / s->all.count, s->all.percentile(50), s->all.percentile(99), s->max_ms);
+  }
+  for (size_t i = 0; i < counters.size(); i++)
+    fprintf(fp, "%-20s %8ld\n", counters[i]->name, counters[i]->total);
+}
+
+bool Instrument::print_periodic(FILE *fp, const char *rate_counter, double interval)
+{
+  if (!enabled())
+    return false;
+
+  unique_lock< mutex > l(registry_lock);
+  int64 now = getTickCount();
+  double secs = ticks_to_ms(now - window_start) / 1000;
+  if (secs < interval)
+    return false;
+
+  map< const char *, Counter *, NameLess >::iterator it = counter_index.find(rate_counter);
+  long n = it != counter_index.end() ? it->second->window : 0;
+
+  fprintf(fp, "%.1f %s/s", n / secs, rate_counter);
+  for (size_t i = 0; i < stages.size(); i++) {
+    Stage *s = stages[i];
+    if (s->window.count)
+      fprintf(fp, " | %s %.1f/%.1f", s->name, s->window.percentile(50), s->window.percentile(99));
+    s->window.clear();
+  }
+  fprintf(fp, " (p50/p99 ms)\n");
+  fflush(fp);
+
+  for (size_t i = 0; i < counters.size(); i++)
+    counters[i]->window = 0;
+  window_start = now;
+  return true;
+}
+
+bool Instrument::write_trace(const char *filename)
+{
+  FILE *fp = fopen(filename, "w");
+  if (!fp)
+    return false;
+
+  unique_lock< mutex > l(registry_lock);
+  double us_per_tick = 1e6 / getTickFrequency();
+
+  fprintf(fp, "{\"traceEvents\":[\n");
+  for (size_t i = 0; i < events.size(); i++) {
+    const TraceEvent &e = events[i];
+    double ts = (e.start - enabled_at) * us_per_tick;
+    if (e.counter)
+      fprintf(fp, "{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,\"tid\":%d,"
+                  "\"args\":{\"value\":%ld}}",
+              e.name, ts, e.tid, e.value);
+    else
+      fprintf(fp, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d}",
+              e.name, ts, (e.end - e.start) * us_per_tick, e.tid);
+    fputs(i + 1 < events.size() ? ",\n" : "\n", fp);
+  }
+  fprintf(fp, "],\"displayTimeUnit\":\"ms\"}\n");
+
+  return fclose(fp) == 0;
+}
+
+void Instrument::report(const char *trace_file)
+{
+  if (!enabled())
+    return;
+
+  print_summary(stdout);
+  if (trace_file) {
+    if (write_trace(trace_file))
+      printf("Wrote %d trace events to %s\n", (int) events.size(), trace_file);
+    else
+      printf("Failed to write trace to %s\n", trace_file);
+  }
+}
@@ -0,0 +1,77 @@
+#ifndef _INCLUDED_INSTRUMENT_H_
+#define _INCLUDED_INSTRUMENT_H_
+
+#include <opencv2/core/core.hpp>
+#include <stdio.h>
+#include <atomic>
+
+/*
+ * Process-wide stage timings, counters and latency histograms, shared
+ * by all the tools. Nothing is recorded until enable() is called, and
+ * until then timing a scope costs one relaxed atomic load.
+ *
+ * Stages and counters are named by string literals and appear in the
+ * reports in the order they were first seen. With tracing on, every
+ * timed stage and counter change is also kept as a Chrome trace event
+ * for write_trace(), to load into chrome://tracing or Perfetto.
+ */
+class Instrument {
+public:
+  static void enable(bool tracing = false);
+  static bool enabled() { return on.load(std::memory_order_relaxed); }
+
+  /* One run of a stage, between two getTickCount() readings */
+  static void record(const char *stage, int64 start, int64 end)
+  {
+    if (enabled())
+      add_sample(stage, start, end);
+  }
+
+  static void count(const char *counter, long n = 1)
+  {
+    if (enabled())
+      add_count(counter, n);
+  }
+
+  /* Count, mean, p50, p99 and max of every stage and the counter totals */
+  static void print_summary(FILE *fp);
+
+  /* Once every interval seconds, print a line with the rate of
+   * rate_counter and p50/p99 of each stage over the interval just gone.
+   * Returns false without printing if the interval has not passed */
+  static bool print_periodic(FILE *fp, const char *rate_counter, double interval);
+
+  static bool write_trace(const char *filename);
+
+  /* End of run: the summary on stdout, and the trace if a file is given.
+   * Does nothing unless enabled */
+  static void report(const char *trace_file);
+
+private:
+  static void add_sample(const char *stage, int64 start, int64 end);
+  static void add_count(const char *counter, long n);
+
+  static std::atomic< bool > on;
+};
+
+/* Records the time from construction to destruction as one run of a stage */
+class ScopedTimer {
+public:
+  explicit ScopedTimer(const char *stage)
+    : stage(stage), start(Instrument::enabled() ? cv::getTickCount() : 0) {}
+
+  ~ScopedTimer()
+  {
+    if (start)
+      Instrument::record(stage, start, cv::getTickCount());
+  }
+
+private:
+  ScopedTimer(const ScopedTimer &);
+  ScopedTimer &operator=(const ScopedTimer &);
+
+  const char *stage;
+  int64 start;
+};
+
+#endif
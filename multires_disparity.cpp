@@ -0,0 +1,108 @@
+#include <math.h>
+#include <algorithm>
+#include "instrument.h"
+#include "multires_disparity.h"
+
+using namespace std;
+using namespace cv;
+
+/* Overlap matched either side of a refinement band, as StripeDisparity
+ * would pick for the matcher's block size */
+static int band_overlap(const Ptr< StereoSGBM > &matcher)
+{
+  return matcher->getBlockSize() / 2 + 16;
+}
+
+static StripeOptions fine_options(const Ptr< StereoSGBM > &matcher, const PyramidOptions &options)
+{
+  StripeOptions o;
+  o.stripes = 1;
+  o.overlap = band_overlap(matcher);
+  o.max_stripe_rows = std::max(options.band_rows, 1) + 2 * o.overlap;
+  return o;
+}
+
+CoarseToFineDisparity::CoarseToFineDisparity(const Ptr< StereoSGBM > &matcher,
+                                             const PyramidOptions &options)
+  : options(options), min_full(matcher->getMinDisparity()),
+    num_full(matcher->getNumDisparities()), fine(matcher, fine_options(matcher, options))
+{
+  int s = scale();
+  int lo = (int) floor((double) min_full / s);
+  int hi = (min_full + num_full + s - 1) / s;
+
+  coarse_matcher = clone_sgbm(matcher);
+  coarse_matcher->setMinDisparity(lo);
+  coarse_matcher->setNumDisparities(std::max((hi - lo + 15) & -16, 16));
+}
+
+/* Full resolution disparity range for a band of output rows, from the
+ * trimmed range of the coarse matches covering it */
+Range CoarseToFineDisparity::band_range(const Range &rows) const
+{
+  const int s = scale();
+  const int c_min = coarse_matcher->getMinDisparity();
+  const int c_num = coarse_matcher->getNumDisparities();
+  Range full(min_full, min_full + num_full);
+
+  int y0 = rows.start / s;
+  int y1 = std::min((rows.end + s - 1) / s, coarse_disparity.rows);
+  hist.assign(c_num, 0);
+  long n = 0;
+
+  for (int y = y0; y < y1; y++) {
+    const short *d = coarse_disparity.ptr< short >(y);
+    for (int x = 0; x < coarse_disparity.cols; x++) {
+      int v = d[x] >> 4;
+      if (v < c_min || v >= c_min + c_num)
+        continue;
+      hist[v - c_min]++;
+      n++;
+    }
+  }
+  /* Nothing to go on: search everything */
+  if (n == 0)
+    return full;
+
+  long skip = (long) (n * options.tail);
+  int lo = 0, hi = c_num - 1;
+  long sum = 0;
+  for (int i = 0; i < c_num; i++) {
+    sum += hist[i];
+    if (sum > skip) {
+      lo = i;
+      break;
+    }
+  }
+  sum = 0;
+  for (int i = c_num - 1; i >= 0; i--) {
+    sum += hist[i];
+    if (sum > skip) {
+      hi = i;
+      break;
+    }
+  }
+
+  /* A coarse disparity d covers full resolution d*s .. (d+1)*s */
+  int start = std::max((c_min + lo) * s - options.margin, full.start);
+  int end = std::min((c_min + hi + 1) * s + options.margin, full.end);
+  int num = std::min((end - start + 15) & -16, num_full);
+  start = std::min(start, full.end - num);
+  return Range(start, start + num);
+}
+
+void CoarseToFineDisparity::compute(const Mat &left, const Mat &right,
+                                    const Mat &coarse_left, const Mat &coarse_right,
+                                    Mat &disparity)
+{
+  int64 start = getTickCount();
+  coarse_matcher->compute(coarse_left, coarse_right, coarse_disparity);
+  Instrument::record("sgbm_coarse", start, getTickCount());
+
+  const vector< Range > &bands = fine.stripe_rows(left.rows);
+  ranges.resize(bands.size());
+  for (size_t i = 0; i < bands.size(); i++)
+    ranges[i] = band_range(bands[i]);
+
+  fine.compute(left, right, ranges, disparity);
+}
@@ -0,0 +1,57 @@
+#ifndef _INCLUDED_MULTIRES_DISPARITY_H_
+#define _INCLUDED_MULTIRES_DISPARITY_H_
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+#include "stripe_disparity.h"
+
+struct PyramidOptions {
+  /* Coarse pass at 1/2^levels of full resolution */
+  int levels;
+  /* Full resolution disparities searched either side of the range
+   * the coarse pass found */
+  int margin;
+  /* Rows per refinement band, each gets its own disparity range */
+  int band_rows;
+  /* Fraction of coarse matches ignored at each end of a band's range */
+  double tail;
+
+  PyramidOptions() : levels(1), margin(8), band_rows(96), tail(0.01) {}
+};
+
+/*
+ * Coarse-to-fine disparity. SGBM runs over the full range on a pair
+ * rectified straight to a reduced size, then again at full resolution
+ * in horizontal bands, each band only searching the disparities the
+ * coarse pass found in it plus a margin. StereoSGBM has no per-pixel
+ * search range, so the band is the finest granularity available.
+ */
+class CoarseToFineDisparity {
+public:
+  CoarseToFineDisparity(const cv::Ptr< cv::StereoSGBM > &matcher,
+                        const PyramidOptions &options = PyramidOptions());
+
+  /* coarse_left and coarse_right are the same pair rectified to the
+   * coarse size, e.g. with maps built from scale_projection() */
+  void compute(const cv::Mat &left, const cv::Mat &right,
+               const cv::Mat &coarse_left, const cv::Mat &coarse_right, cv::Mat &disparity);
+
+  /* Result of the last coarse pass, in coarse pixels */
+  const cv::Mat &coarse() const { return coarse_disparity; }
+
+  /* Full resolution size divided by the coarse size */
+  int scale() const { return 1 << options.levels; }
+
+private:
+  cv::Range band_range(const cv::Range &rows) const;
+
+  PyramidOptions options;
+  int min_full, num_full;
+  cv::Ptr< cv::StereoSGBM > coarse_matcher;
+  StripeDisparity fine;
+  cv::Mat coarse_disparity;
+  std::vector< cv::Range > ranges;
+  mutable std::vector< int > hist;
+};
+
+#endif
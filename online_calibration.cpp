@@ -0,0 +1,144 @@
+#include <opencv2/calib3d/calib3d.hpp>
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include "instrument.h"
+#include "online_calibration.h"
+
+using namespace std;
+using namespace cv;
+
+/* Largest move of the focal lengths and principal point, relative to
+ * the focal length */
+static double intrinsic_change(const Mat &before, const Mat &after)
+{
+  Matx33d a(before), b(after);
+  double fx = fabs(b(0, 0)), fy = fabs(b(1, 1));
+  double change = fabs(b(0, 0) - a(0, 0)) / fx;
+  change = std::max(change, fabs(b(1, 1) - a(1, 1)) / fy);
+  change = std::max(change, fabs(b(0, 2) - a(0, 2)) / fx);
+  change = std::max(change, fabs(b(1, 2) - a(1, 2)) / fy);
+  return change;
+}
+
+OnlineCalibration::OnlineCalibration(Size board_size, int flags, const OnlineOptions &options)
+  : stereo(false), board_size(board_size), flags(flags), options(options), last_views(0),
+    solves(0), stable_count(0), running(false), stable(false)
+{
+}
+
+OnlineCalibration::OnlineCalibration(Size board_size, int flags, const StereoCalibration &initial,
+                                     const OnlineOptions &options)
+  : stereo(true), board_size(board_size), flags(flags), options(options), last_views(0),
+    solves(0), stable_count(0), running(false), stable(false)
+{
+  /* Own copies, stereoCalibrate() writes them back even when fixed */
+  calib.K1 = initial.K1.clone();
+  calib.D1 = initial.D1.clone();
+  calib.K2 = initial.K2.clone();
+  calib.D2 = initial.D2.clone();
+}
+
+OnlineCalibration::~OnlineCalibration()
+{
+  if (solver.joinable())
+    solver.join();
+}
+
+int OnlineCalibration::views_in(const BoardCollector &boards) const
+{
+  if (stereo)
+    return boards.both.size();
+  return std::min(boards.left.size(), boards.right.size());
+}
+
+void OnlineCalibration::update(const BoardCollector &boards, Size size)
+{
+  if (stable || running)
+    return;
+  int n = views_in(boards);
+  if (n - last_views < std::max(options.solve_every, 1))
+    return;
+
+  /* The last solve is done, running is only cleared at its end */
+  if (solver.joinable())
+    solver.join();
+
+  last_views = n;
+  im_size = size;
+  if (stereo) {
+    stereo_views = boards.both;
+  } else {
+    left_views = boards.left;
+    right_views = boards.right;
+  }
+  running = true;
+  solver = thread(&OnlineCalibration::run, this);
+}
+
+void OnlineCalibration::run()
+{
+  ScopedTimer timer("online_solve");
+  int64 start = getTickCount();
+  char line[200];
+  double change = stereo ? solve_extrinsics(line, sizeof(line)) :
+                           solve_intrinsics(line, sizeof(line));
+
+  /* The first solve has nothing to compare with */
+  if (solves > 1 && change < options.tolerance)
+    stable_count++;
+  else
+    stable_count = 0;
+
+  /* One printf, so the line can't be split by the detection loop's */
+  printf("%s, %.1fs%s\n", line, (getTickCount() - start) / getTickFrequency(),
+         stable_count >= options.stable_solves ? ", settled" : "");
+  fflush(stdout);
+
+  if (stable_count >= options.stable_solves)
+    stable = true;
+  running = false;
+}
+
+double OnlineCalibration::solve_intrinsics(char *line, size_t size)
+{
+  int total = std::min(left_views.size(), right_views.size());
+  left_views.select(board_size, im_size, options.window);
+  right_views.select(board_size, im_size, options.window);
+
+  Mat K1 = left.K.clone(), K2 = right.K.clone();
+  calibrate_camera(left_views, im_size, flags, left);
+  calibrate_camera(right_views, im_size, flags, right);
+  solves++;
+
+  double change = 1;
+  if (solves > 1)
+    change = std::max(intrinsic_change(K1, left.K), intrinsic_change(K2, right.K));
+  snprintf(line, size, "Online solve %d: %d/%d of %d views, RMS %.3f/%.3f px, change %.3f%%",
+           solves, left_views.size(), right_views.size(), total, left.error, right.error, change * 100);
+  return change;
+}
+
+double OnlineCalibration::solve_extrinsics(char *line, size_t size)
+{
+  int total = stereo_views.size();
+  stereo_views.select(board_size, im_size, options.window);
+
+  Mat R = calib.R.clone();
+  Vec3d T = calib.T;
+  double rms = calib.calibrate(stereo_views, im_size, flags);
+  solves++;
+
+  /* Relative move of the baseline, and angle of the rotation between
+   * the last two solves of R */
+  double change = 1;
+  if (solves > 1) {
+    Vec3d rvec;
+    Mat dR = R.t() * calib.R;
+    Rodrigues(dR, rvec);
+    change = std::max(norm(calib.T - T) / norm(calib.T), norm(rvec));
+  }
+  snprintf(line, size, "Online solve %d: %d of %d views, RMS %.3f px, baseline %.4f, change %.3f%%",
+           solves, stereo_views.size(), total, rms, norm(calib.T), change * 100);
+  return change;
+}
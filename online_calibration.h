@@ -0,0 +1,79 @@
+#ifndef _INCLUDED_ONLINE_CALIBRATION_H_
+#define _INCLUDED_ONLINE_CALIBRATION_H_
+
+#include <opencv2/core/core.hpp>
+#include <atomic>
+#include <thread>
+#include "calibration.h"
+
+struct OnlineOptions {
+  /* New views between background solves */
+  int solve_every;
+  /* Most views in each solve, picked by select() from all so far */
+  int window;
+  /* The result has settled once no parameter moves by more than this
+   * fraction (radians for rotation) ... */
+  double tolerance;
+  /* ... in this many solves in a row */
+  int stable_solves;
+
+  OnlineOptions() : solve_every(10), window(30), tolerance(0.002), stable_solves(3) {}
+};
+
+/*
+ * Running calibration while the corners are still being detected. The
+ * detection loop hands over its views after each frame, and every
+ * solve_every new views a solve over a selected window of them starts
+ * on a background thread, unless one is still running. Each solve
+ * prints its error and how far the parameters moved. Once they stop
+ * moving, converged() tells the caller it can stop reading the video.
+ *
+ * The final result still comes from the tool's own solve over all the
+ * views collected; this only decides when there are enough.
+ */
+class OnlineCalibration {
+public:
+  /* Intrinsics of both cameras, each from its own views */
+  OnlineCalibration(cv::Size board_size, int flags, const OnlineOptions &options);
+  /* Extrinsics from the views both cameras saw, keeping the intrinsics
+   * of initial as they are */
+  OnlineCalibration(cv::Size board_size, int flags, const StereoCalibration &initial,
+                    const OnlineOptions &options);
+  /* Waits for a running solve */
+  ~OnlineCalibration();
+
+  void update(const BoardCollector &boards, cv::Size im_size);
+
+  bool converged() const { return stable; }
+
+private:
+  OnlineCalibration(const OnlineCalibration &);
+  OnlineCalibration &operator=(const OnlineCalibration &);
+
+  int views_in(const BoardCollector &boards) const;
+  void run();
+  /* Both return the parameter change and describe the solve in line */
+  double solve_intrinsics(char *line, size_t size);
+  double solve_extrinsics(char *line, size_t size);
+
+  bool stereo;
+  cv::Size board_size;
+  cv::Size im_size;
+  int flags;
+  OnlineOptions options;
+  int last_views;
+
+  /* Only touched by the background thread while it runs */
+  CameraViews left_views, right_views;
+  StereoViews stereo_views;
+  CameraCalibration left, right;
+  StereoCalibration calib;
+  int solves;
+  int stable_count;
+
+  std::atomic< bool > running;
+  std::atomic< bool > stable;
+  std::thread solver;
+};
+
+#endif
@@ -0,0 +1,189 @@
+#include <float.h>
+#include <math.h>
+#include <string.h>
+#include <strings.h>
+#include <thread>
+#include "instrument.h"
+#include "point_cloud.h"
+#include "reproject.h"
+
+using namespace std;
+using namespace cv;
+
+/* Output is gathered into chunks of this size before each fwrite */
+static const size_t CHUNK_SIZE = 4 << 20;
+
+/* Room kept free in the chunk for one text line */
+static const size_t MAX_LINE = 256;
+
+/* x y z as float, then r g b */
+static const size_t RECORD_SIZE = 3 * sizeof(float) + 3;
+
+/* Rows reprojected and written per step of save_point_cloud() */
+static const int BAND_ROWS = 64;
+
+/* Width of the vertex count in the PLY header, so it can be patched in
+ * place once the number of points is known */
+static const int COUNT_DIGITS = 10;
+
+/* The floats go out in host byte order, which the PLY header names */
+static const char *ply_format()
+{
+  const unsigned short one = 1;
+  return *(const unsigned char *) &one ? "binary_little_endian" : "binary_big_endian";
+}
+
+static bool has_suffix(const char *s, const char *suffix)
+{
+  size_t n = strlen(s), m = strlen(suffix);
+  return n >= m && strcasecmp(s + n - m, suffix) == 0;
+}
+
+/* Same filter as the original text writer: drop points at or beyond the
+ * missing-value depth */
+static inline bool valid_depth(float z)
+{
+  const float max_z = MISSING_Z;
+  return !(fabs(z - max_z) < FLT_EPSILON || fabs(z) > max_z);
+}
+
+PointCloudWriter::Format PointCloudWriter::format_for(const char *filename)
+{
+  if (has_suffix(filename, ".ply"))
+    return FORMAT_PLY;
+  if (has_suffix(filename, ".xyzrgb"))
+    return FORMAT_XYZRGB;
+  return FORMAT_TEXT;
+}
+
+PointCloudWriter::PointCloudWriter()
+  : fp(NULL), format(FORMAT_TEXT), used(0), n_points(0), count_offset(-1) {}
+
+PointCloudWriter::~PointCloudWriter()
+{
+  close();
+}
+
+bool PointCloudWriter::open(const char *filename, Format fmt)
+{
+  close();
+
+  fp = fopen(filename, fmt == FORMAT_TEXT ? "wt" : "wb");
+  if (!fp)
+    return false;
+
+  /* Everything goes out in whole chunks already */
+  setvbuf(fp, NULL, _IONBF, 0);
+
+  format = fmt;
+  buf.resize(CHUNK_SIZE);
+  used = 0;
+  n_points = 0;
+  count_offset = -1;
+
+  if (format == FORMAT_PLY) {
+    fprintf(fp, "ply\nformat %s 1.0\nelement vertex ", ply_format());
+    count_offset = ftell(fp);
+    fprintf(fp, "%0*d\n", COUNT_DIGITS, 0);
+    fputs("property float x\nproperty float y\nproperty float z\n"
+          "property uchar red\nproperty uchar green\nproperty uchar blue\n"
+          "end_header\n", fp);
+  }
+  return true;
+}
+
+void PointCloudWriter::flush()
+{
+  if (used > 0)
+    fwrite(&buf[0], 1, used, fp);
+  used = 0;
+}
+
+void PointCloudWriter::write_rows(const Mat &xyz, const Mat &bgr, const Mat &mask)
+{
+  ScopedTimer timer("write_points");
+  CV_Assert(fp != NULL && xyz.type() == CV_32FC3 && bgr.type() == CV_8UC3);
+  CV_Assert(bgr.size() == xyz.size() && (mask.empty() || mask.size() == xyz.size()));
+
+  for (int y = 0; y < xyz.rows; y++) {
+    const float *p = xyz.ptr< float >(y);
+    const uchar *col = bgr.ptr< uchar >(y);
+    const uchar *alpha = mask.empty() ? NULL : mask.ptr< uchar >(y);
+
+    for (int x = 0; x < xyz.cols; x++, p += 3, col += 3) {
+      if (!valid_depth(p[2]))
+        continue;
+      if (alpha && alpha[x] == 0) /* Ignore alpha=0.0 color */
+        continue;
+
+      if (format == FORMAT_TEXT) {
+        if (CHUNK_SIZE - used < MAX_LINE)
+          flush();
+        used += snprintf(&buf[used], MAX_LINE, "%f;%f;%f;%u;%u;%u\n",
+                         p[0], p[1], p[2], col[2], col[1], col[0]);
+      } else {
+        if (CHUNK_SIZE - used < RECORD_SIZE)
+          flush();
+        char *out = &buf[used];
+        memcpy(out, p, 3 * sizeof(float));
+        out[12] = col[2];
+        out[13] = col[1];
+        out[14] = col[0];
+        used += RECORD_SIZE;
+      }
+      n_points++;
+    }
+  }
+}
+
+bool PointCloudWriter::close()
+{
+  if (!fp)
+    return true;
+
+  flush();
+  if (count_offset >= 0) {
+    fseek(fp, count_offset, SEEK_SET);
+    fprintf(fp, "%0*lu", COUNT_DIGITS, (unsigned long) n_points);
+  }
+
+  bool ok = !ferror(fp);
+  ok = fclose(fp) == 0 && ok;
+  fp = NULL;
+  buf.clear();
+  return ok;
+}
+
+bool save_point_cloud(const char *filename, const Mat &disparity, const Mat &Q,
+                      int min_disparity, const Mat &bgr, const Mat &mask)
+{
+  ScopedTimer timer("save_point_cloud");
+  PointCloudWriter writer;
+
+  if (!writer.open(filename, PointCloudWriter::format_for(filename))) {
+    printf("Failed to open output file %s\n", filename);
+    return false;
+  }
+
+  /* Two bands: one being written while the next is reprojected */
+  Mat xyz[2];
+  thread writing;
+
+  for (int y = 0, k = 0; y < disparity.rows; y += BAND_ROWS, k ^= 1) {
+    Range rows(y, std::min(y + BAND_ROWS, disparity.rows));
+    reproject_disparity(disparity, Q, min_disparity, xyz[k], rows);
+
+    if (writing.joinable())
+      writing.join();
+
+    const Mat band_bgr = bgr.rowRange(rows);
+    const Mat band_mask = mask.empty() ? Mat() : mask.rowRange(rows);
+    writing = thread(&PointCloudWriter::write_rows, &writer, std::cref(xyz[k]),
+                     band_bgr, band_mask);
+  }
+
+  if (writing.joinable())
+    writing.join();
+
+  return writer.close();
+}
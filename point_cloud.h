@@ -0,0 +1,60 @@
+#ifndef _INCLUDED_POINT_CLOUD_H_
+#define _INCLUDED_POINT_CLOUD_H_
+
+#include <opencv2/core/core.hpp>
+#include <stdio.h>
+#include <vector>
+
+/*
+ * Buffered point cloud output. Points are packed into large chunks and
+ * written with one fwrite each, so a full frame costs a handful of
+ * syscalls. Rows can be appended a band at a time while the rest of
+ * the cloud is still being computed.
+ *
+ * Formats, picked from the file extension by format_for():
+ *   .ply     binary PLY in host byte order, float x y z and uchar r g b
+ *   .xyzrgb  the same 15-byte records with no header
+ *   other    the original "x;y;z;r;g;b" text lines
+ */
+class PointCloudWriter {
+public:
+  enum Format { FORMAT_TEXT, FORMAT_PLY, FORMAT_XYZRGB };
+
+  static Format format_for(const char *filename);
+
+  PointCloudWriter();
+  ~PointCloudWriter();
+
+  bool open(const char *filename, Format format);
+
+  /* Append the points of a band of rows. xyz is CV_32FC3, bgr CV_8UC3
+   * and mask CV_8U, all the same size. Points with mask 0 or without a
+   * valid depth are left out. An empty mask keeps every point */
+  void write_rows(const cv::Mat &xyz, const cv::Mat &bgr, const cv::Mat &mask);
+
+  /* Flush, fill in the PLY vertex count and close the file */
+  bool close();
+
+  size_t points() const { return n_points; }
+
+private:
+  PointCloudWriter(const PointCloudWriter &);
+  PointCloudWriter &operator=(const PointCloudWriter &);
+
+  void flush();
+
+  FILE *fp;
+  Format format;
+  std::vector< char > buf;
+  size_t used;
+  size_t n_points;
+  long count_offset;
+};
+
+/* Reproject a disparity map and write it out as a point cloud in the
+ * format matching the file name. Bands of rows are reprojected while
+ * the previous band is being written */
+bool save_point_cloud(const char *filename, const cv::Mat &disparity, const cv::Mat &Q,
+                      int min_disparity, const cv::Mat &bgr, const cv::Mat &mask);
+
+#endif
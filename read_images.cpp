@@ -3,24 +3,58 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <stdio.h>
 #include <iostream>
+#include <string>
+#include <vector>
 #include "popt_pp.h"
+#include "image_writer.h"
+#include "instrument.h"
+#include "stereo_capture.h"
 
 using namespace std;
 using namespace cv;
 
-int x = 0;
-
 int main(int argc, char const *argv[])
 {
-  char* imgs_directory;
-  char* extension;
-  int im_width, im_height;
+  const char* imgs_directory = "";
+  const char* extension = "jpg";
+  int im_width = 0, im_height = 0;
+  int left_device = 0, right_device = 1;
+  const char* fake_left = NULL;
+  const char* fake_right = NULL;
+  double fps = 30;
+  double fake_skew = 0;
+  double fake_jitter = 0;
+  int driver_timestamps = 0;
+  double max_skew = 0;
+  int num_writers = 2;
+  int write_queue = 16;
+  int auto_every = 0;
+  int max_pairs = 0;
+  int no_display = 0;
+  int show_stats = 0;
+  const char* trace_file = NULL;
 
   static struct poptOption options[] = {
     { "img_width",'w',POPT_ARG_INT,&im_width,0,"Image width","NUM" },
     { "img_height",'h',POPT_ARG_INT,&im_height,0,"Image height","NUM" },
     { "imgs_directory",'d',POPT_ARG_STRING,&imgs_directory,0,"Directory to save images in","STR" },
     { "extension",'e',POPT_ARG_STRING,&extension,0,"Image extension","STR" },
+    { "left_device",'l',POPT_ARG_INT,&left_device,0,"Left camera index","NUM" },
+    { "right_device",'r',POPT_ARG_INT,&right_device,0,"Right camera index","NUM" },
+    { "fake_left",'L',POPT_ARG_STRING,&fake_left,0,"Replay a video or image sequence (e.g. imgs/left%d.jpg) as the left camera","STR" },
+    { "fake_right",'R',POPT_ARG_STRING,&fake_right,0,"Replay a video or image sequence as the right camera","STR" },
+    { "fps",'f',POPT_ARG_DOUBLE,&fps,0,"Camera frame rate, the rate fake cameras replay at","NUM" },
+    { "fake_skew",'k',POPT_ARG_DOUBLE,&fake_skew,0,"Delay the replayed right camera by this many ms","MS" },
+    { "fake_jitter",'J',POPT_ARG_DOUBLE,&fake_jitter,0,"Jitter the replayed frame times by up to this many ms","MS" },
+    { "driver_timestamps",'t',POPT_ARG_NONE,&driver_timestamps,0,"Pair by the driver's frame timestamps instead of grab time",NULL },
+    { "max_skew",'m',POPT_ARG_DOUBLE,&max_skew,0,"Never pair frames further apart than this (default: half a frame)","MS" },
+    { "writers",'j',POPT_ARG_INT,&num_writers,0,"Threads encoding and writing images","NUM" },
+    { "write_queue",'q',POPT_ARG_INT,&write_queue,0,"Images waiting to be written before pairs are refused","NUM" },
+    { "auto",'a',POPT_ARG_INT,&auto_every,0,"Save every Nth pair without waiting for a key","NUM" },
+    { "pairs",'n',POPT_ARG_INT,&max_pairs,0,"Stop after saving this many pairs","NUM" },
+    { "no_display",'N',POPT_ARG_NONE,&no_display,0,"Don't show the preview windows",NULL },
+    { "stats",'I',POPT_ARG_NONE,&show_stats,0,"Print pair rate and grab/write p50/p99 periodically and at exit",NULL },
+    { "trace",'T',POPT_ARG_STRING,&trace_file,0,"Write a Chrome trace of the timed stages","STR" },
     POPT_AUTOHELP
     { NULL, 0, 0, NULL, 0, NULL, NULL }
   };
@@ -29,25 +63,93 @@ int main(int argc, char const *argv[])
   int c;
   while((c = popt.getNextOpt()) >= 0) {}
 
-  VideoCapture cap1(0);
-  VideoCapture cap2(1);
-  Mat img1, img_res1, img2, img_res2;
-  while (1) {
-    cap1 >> img1;
-    cap2 >> img2;
-    resize(img1, img_res1, Size(im_width, im_height));
-    resize(img2, img_res2, Size(im_width, im_height));
-    imshow("IMG1", img_res1);
-    imshow("IMG2", img_res2);
-    if (waitKey(30) > 0) {
-      x++;
+  if (show_stats || trace_file)
+    Instrument::enable(trace_file != NULL);
+
+  Size im_size(im_width, im_height);
+  CaptureDevice *devices[2];
+  bool opened;
+  if (fake_left || fake_right) {
+    if (!fake_left || !fake_right) {
+      cerr << "Please supply both fake cameras" << endl;
+      exit(EXIT_FAILURE);
+    }
+    FakeDevice *left = new FakeDevice(fake_left, fps, 0, fake_jitter, 1);
+    FakeDevice *right = new FakeDevice(fake_right, fps, fake_skew, fake_jitter, 2);
+    opened = left->opened() && right->opened();
+    devices[0] = left;
+    devices[1] = right;
+  } else {
+    CameraDevice *left = new CameraDevice(left_device, driver_timestamps);
+    CameraDevice *right = new CameraDevice(right_device, driver_timestamps);
+    opened = left->opened() && right->opened();
+    devices[0] = left;
+    devices[1] = right;
+  }
+  if (!opened) {
+    cerr << "Could not open both cameras" << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  CaptureOptions capture_options;
+  capture_options.max_skew_ms = max_skew > 0 ? max_skew : 500. / fps;
+  StereoCapture capture(devices[0], devices[1], capture_options);
+  AsyncImageWriter writer(num_writers, write_queue, im_size);
+
+  StereoPair pair;
+  Mat preview1, preview2;
+  int x = 0;
+  while (capture.next(pair)) {
+    Mat &img1 = pair.left->image;
+    Mat &img2 = pair.right->image;
+    bool save = auto_every > 0 && pair.index % auto_every == 0;
+
+    if (!no_display) {
+      if (im_size.area() > 0) {
+        resize(img1, preview1, im_size);
+        resize(img2, preview2, im_size);
+      } else {
+        preview1 = img1;
+        preview2 = img2;
+      }
+      imshow("IMG1", preview1);
+      imshow("IMG2", preview2);
+      int key = waitKey(1);
+      if (key == 27 || key == 'q' || key == 'Q')
+        break;
+      if (key > 0)
+        save = true;
+    }
+
+    if (save) {
       char filename1[200], filename2[200];
-      sprintf(filename1, "%sleft%d.%s", imgs_directory, x, extension);
-      sprintf(filename2, "%sright%d.%s", imgs_directory, x, extension);
-      cout << "Saving img pair " << x << endl;
-      imwrite(filename1, img_res1);
-      imwrite(filename2, img_res2);
+      snprintf(filename1, sizeof(filename1), "%sleft%d.%s", imgs_directory, x + 1, extension);
+      snprintf(filename2, sizeof(filename2), "%sright%d.%s", imgs_directory, x + 1, extension);
+      /* Copies, the pair's buffers go back to the grab threads */
+      vector< string > files;
+      vector< Mat > imgs;
+      files.push_back(filename1);
+      files.push_back(filename2);
+      imgs.push_back(img1.clone());
+      imgs.push_back(img2.clone());
+      if (writer.write(files, imgs)) {
+        x++;
+        cout << "Saving img pair " << x << " (skew " << pair.skew_ms << " ms)" << endl;
+      } else {
+        cout << "Writers are behind, pair not saved" << endl;
+      }
     }
+    capture.done(pair);
+
+    if (show_stats)
+      Instrument::print_periodic(stdout, "pairs", 1.0);
+    if (max_pairs > 0 && x >= max_pairs)
+      break;
   }
-  return 0;
+
+  writer.finish();
+  capture.print_stats(stdout);
+  printf("Wrote %d images, %d failed\n", writer.written(), writer.failed());
+  Instrument::report(trace_file);
+  return writer.failed() ? 1 : 0;
 }
@@ -0,0 +1,263 @@
+#include <opencv2/core/hal/intrin.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <stdio.h>
+#include <string.h>
+#include "instrument.h"
+#include "rectify_maps.h"
+
+using namespace std;
+using namespace cv;
+
+/*
+ * File layout, all values in host byte order:
+ *   char[8]  magic "SCRMAPS1"
+ *   uint64   hash of the calibration file
+ *   int32    width, height
+ *   8 bytes  padding
+ * followed by lmap1, lmap2, rmap1 and rmap2, each padded to a multiple
+ * of MAP_ALIGN bytes so every map starts aligned for SIMD loads.
+ */
+static const char MAPS_MAGIC[8] = { 'S', 'C', 'R', 'M', 'A', 'P', 'S', '1' };
+static const size_t MAPS_HEADER_SIZE = 32;
+static const size_t MAP_ALIGN = 64;
+
+static size_t padded(size_t n)
+{
+  return (n + MAP_ALIGN - 1) & ~(MAP_ALIGN - 1);
+}
+
+string RectifyMaps::cache_file(const char *calib_file, Size im_size)
+{
+  char suffix[64];
+  snprintf(suffix, sizeof(suffix), ".%dx%d.maps", im_size.width, im_size.height);
+  return string(calib_file) + suffix;
+}
+
+Mat RectifyMaps::scale_projection(const Mat &P, double scale)
+{
+  /* Focal lengths and principal point scale, the baseline term in
+   * the last column of P2 scales with the focal length too */
+  Mat scaled = P.clone();
+  scaled.rowRange(0, 2) *= scale;
+  return scaled;
+}
+
+void RectifyMaps::build(const Mat &K1, const Mat &D1, const Mat &R1, const Mat &P1,
+                        const Mat &K2, const Mat &D2, const Mat &R2, const Mat &P2,
+                        Size im_size)
+{
+  /* Drop any maps pointing into the cache before unmapping it */
+  lmap1.release();
+  lmap2.release();
+  rmap1.release();
+  rmap2.release();
+  mapping.close();
+
+  cv::initUndistortRectifyMap(K1, D1, R1, P1, im_size, CV_16SC2, lmap1, lmap2);
+  cv::initUndistortRectifyMap(K2, D2, R2, P2, im_size, CV_16SC2, rmap1, rmap2);
+}
+
+bool RectifyMaps::init(const char *calib_file, const Mat &K1, const Mat &D1,
+                       const Mat &R1, const Mat &P1, const Mat &K2,
+                       const Mat &D2, const Mat &R2, const Mat &P2,
+                       Size im_size)
+{
+  uint64_t calib_hash = hash_file(calib_file);
+  string filename = cache_file(calib_file, im_size);
+
+  if (calib_hash != 0 && load(filename, calib_hash, im_size))
+    return true;
+
+  build(K1, D1, R1, P1, K2, D2, R2, P2, im_size);
+  if (calib_hash != 0 && !save(filename, calib_hash))
+    printf("Failed to write rectification map cache %s\n", filename.c_str());
+  return false;
+}
+
+bool RectifyMaps::load(const string &filename, uint64_t calib_hash, Size im_size,
+                       size_t offset)
+{
+  MappedFile file;
+  if (!file.open(filename.c_str()))
+    return false;
+
+  const unsigned char *p = file.data() + offset;
+  uint64_t hash;
+  int32_t w, h;
+
+  if (file.size() < offset + MAPS_HEADER_SIZE || memcmp(p, MAPS_MAGIC, 8) != 0)
+    return false;
+  memcpy(&hash, p + 8, 8);
+  memcpy(&w, p + 16, 4);
+  memcpy(&h, p + 20, 4);
+  if (hash != calib_hash || w != im_size.width || h != im_size.height)
+    return false;
+
+  size_t map1_size = padded((size_t) w * h * 2 * sizeof(short));
+  size_t map2_size = padded((size_t) w * h * sizeof(ushort));
+  size_t total = MAPS_HEADER_SIZE + 2 * (map1_size + map2_size);
+  if (offset == 0 ? file.size() != total : file.size() < offset + total)
+    return false;
+
+  /* The file is mapped read-only, remap() never writes to its maps */
+  unsigned char *base = (unsigned char *) p + MAPS_HEADER_SIZE;
+  lmap1 = Mat(h, w, CV_16SC2, base);
+  lmap2 = Mat(h, w, CV_16UC1, base + map1_size);
+  rmap1 = Mat(h, w, CV_16SC2, base + map1_size + map2_size);
+  rmap2 = Mat(h, w, CV_16UC1, base + 2 * map1_size + map2_size);
+
+  /* Keep the file mapped for as long as the Mats above live in us */
+  mapping.swap(file);
+  return true;
+}
+
+static void write_map(FILE *fp, const Mat &map)
+{
+  static const char zeros[MAP_ALIGN] = { 0 };
+  size_t row_size = map.cols * map.elemSize();
+
+  for (int y = 0; y < map.rows; y++)
+    fwrite(map.ptr(y), 1, row_size, fp);
+  size_t n = row_size * map.rows;
+  fwrite(zeros, 1, padded(n) - n, fp);
+}
+
+bool RectifyMaps::save(const string &filename, uint64_t calib_hash) const
+{
+  string tmp = filename + ".tmp";
+  FILE *fp = fopen(tmp.c_str(), "wb");
+  if (!fp)
+    return false;
+
+  bool ok = write(fp, calib_hash);
+  ok = (fclose(fp) == 0) && ok;
+  if (!ok || rename(tmp.c_str(), filename.c_str()) != 0) {
+    remove(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool RectifyMaps::write(FILE *fp, uint64_t calib_hash) const
+{
+  unsigned char header[MAPS_HEADER_SIZE] = { 0 };
+  int32_t w = lmap1.cols, h = lmap1.rows;
+  memcpy(header, MAPS_MAGIC, 8);
+  memcpy(header + 8, &calib_hash, 8);
+  memcpy(header + 16, &w, 4);
+  memcpy(header + 20, &h, 4);
+  fwrite(header, 1, sizeof(header), fp);
+
+  write_map(fp, lmap1);
+  write_map(fp, lmap2);
+  write_map(fp, rmap1);
+  write_map(fp, rmap2);
+
+  return !ferror(fp);
+}
+
+/* remap()'s fixed-point maps split each pixel into 32x32 sub-positions */
+static const int TAB_BITS = 5;
+static const int TAB_SIZE = 1 << TAB_BITS;
+static const int WEIGHT_BITS = 2 * TAB_BITS;
+
+/*
+ * What remap() of a 255 image gives for a pixel with some of its four
+ * source pixels outside: 255 times the weight of those inside.
+ */
+static uchar partial_coverage(int x, int y, int fxy, int src_w, int src_h)
+{
+  int fx = fxy & (TAB_SIZE - 1), fy = fxy >> TAB_BITS;
+  bool x0 = x >= 0 && x < src_w, x1 = x + 1 >= 0 && x + 1 < src_w;
+  bool y0 = y >= 0 && y < src_h, y1 = y + 1 >= 0 && y + 1 < src_h;
+  int w = 0;
+  if (x0 && y0)
+    w += (TAB_SIZE - fx) * (TAB_SIZE - fy);
+  if (x1 && y0)
+    w += fx * (TAB_SIZE - fy);
+  if (x0 && y1)
+    w += (TAB_SIZE - fx) * fy;
+  if (x1 && y1)
+    w += fx * fy;
+  return (uchar)((255 * w + (1 << (WEIGHT_BITS - 1))) >> WEIGHT_BITS);
+}
+
+/*
+ * One row of the mask. Pixels whose four source pixels are all inside
+ * are 255, checked eight at a time; the rest, along the edges of the
+ * valid area, get their partial coverage.
+ */
+static void mask_row(const short *xy, const ushort *fxy, int n, int src_w, int src_h,
+                     uchar *mask)
+{
+  int i = 0;
+
+#if CV_SIMD128
+  v_int16x8 zero = v_setzero_s16();
+  v_int16x8 lim((short)(src_w - 2), (short)(src_h - 2), (short)(src_w - 2), (short)(src_h - 2),
+                (short)(src_w - 2), (short)(src_h - 2), (short)(src_w - 2), (short)(src_h - 2));
+  v_uint32x4 all_set = v_setall_u32(0xffffffff);
+
+  for (; i <= n - 8; i += 8) {
+    /* x and y of a pixel sit in adjacent lanes: a pixel is inside when
+     * both its lanes pass, i.e. its 32-bit pair is all ones */
+    v_int16x8 p0 = v_load(xy + 2 * i), p1 = v_load(xy + 2 * i + 8);
+    v_uint32x4 ok0 = v_reinterpret_as_u32((p0 >= zero) & (p0 <= lim)) == all_set;
+    v_uint32x4 ok1 = v_reinterpret_as_u32((p1 >= zero) & (p1 <= lim)) == all_set;
+    v_uint16x8 ok = v_pack(ok0, ok1);
+    v_store_low(mask + i, v_pack(ok, ok));
+  }
+  for (int j = 0; j < i; j++) {
+    if (!mask[j])
+      mask[j] = partial_coverage(xy[2 * j], xy[2 * j + 1], fxy[j], src_w, src_h);
+  }
+#endif
+
+  for (; i < n; i++) {
+    int x = xy[2 * i], y = xy[2 * i + 1];
+    if (x >= 0 && y >= 0 && x <= src_w - 2 && y <= src_h - 2)
+      mask[i] = 255;
+    else
+      mask[i] = partial_coverage(x, y, fxy[i], src_w, src_h);
+  }
+}
+
+class MaskBody : public ParallelLoopBody {
+public:
+  MaskBody(const Mat &map1, const Mat &map2, Size src_size, Mat &mask)
+    : map1(map1), map2(map2), src_size(src_size), mask(mask) {}
+
+  void operator()(const Range &rows) const
+  {
+    for (int y = rows.start; y < rows.end; y++)
+      mask_row(map1.ptr< short >(y), map2.ptr< ushort >(y), mask.cols,
+               src_size.width, src_size.height, mask.ptr< uchar >(y));
+  }
+
+private:
+  const Mat &map1, &map2;
+  Size src_size;
+  Mat &mask;
+};
+
+void rectify_mask(const RectifyMaps &maps, Size src_size, Mat &mask)
+{
+  ScopedTimer timer("rectify_mask");
+  CV_Assert(maps.lmap1.type() == CV_16SC2 && maps.lmap2.type() == CV_16UC1);
+  mask.create(maps.lmap1.size(), CV_8U);
+  parallel_for_(Range(0, mask.rows), MaskBody(maps.lmap1, maps.lmap2, src_size, mask));
+}
+
+void remap_side_by_side(const Mat &frame, const RectifyMaps &maps,
+                        Mat &left, Mat &right, Mat *mask)
+{
+  ScopedTimer timer("remap");
+  int cx = frame.cols / 2;
+  Mat src_left = frame(Rect(0, 0, cx, frame.rows));
+  Mat src_right = frame(Rect(cx, 0, cx, frame.rows));
+
+  remap(src_left, left, maps.lmap1, maps.lmap2, INTER_LINEAR, BORDER_CONSTANT);
+  remap(src_right, right, maps.rmap1, maps.rmap2, INTER_LINEAR, BORDER_CONSTANT);
+  if (mask)
+    rectify_mask(maps, src_left.size(), *mask);
+}
@@ -0,0 +1,76 @@
+#ifndef _INCLUDED_RECTIFY_MAPS_H_
+#define _INCLUDED_RECTIFY_MAPS_H_
+
+#include <opencv2/core/core.hpp>
+#include <stdio.h>
+#include <string>
+#include "file_util.h"
+
+/*
+ * Undistort/rectify maps for both halves of a stereo pair, in OpenCV's
+ * compact fixed-point form: a CV_16SC2 integer map plus a CV_16UC1
+ * interpolation table index per pixel. That is 6 bytes per pixel per
+ * camera instead of 8 for two float maps, and lets remap() use its
+ * faster fixed-point path.
+ *
+ * The maps are cached next to the calibration file, keyed by the
+ * calibration file contents and the image size. When the cache is
+ * valid the maps point straight into the memory-mapped file.
+ */
+class RectifyMaps {
+public:
+  cv::Mat lmap1, lmap2;
+  cv::Mat rmap1, rmap2;
+
+  /* Load the cached maps, or build them from the calibration and
+   * write the cache. Returns true if the cache was used */
+  bool init(const char *calib_file, const cv::Mat &K1, const cv::Mat &D1,
+            const cv::Mat &R1, const cv::Mat &P1, const cv::Mat &K2,
+            const cv::Mat &D2, const cv::Mat &R2, const cv::Mat &P2,
+            cv::Size im_size);
+
+  /* Build the maps without touching the cache */
+  void build(const cv::Mat &K1, const cv::Mat &D1, const cv::Mat &R1, const cv::Mat &P1,
+             const cv::Mat &K2, const cv::Mat &D2, const cv::Mat &R2, const cv::Mat &P2,
+             cv::Size im_size);
+
+  /* offset is where the maps start within the file, for maps embedded
+   * in a larger file such as a binary calibration */
+  bool load(const std::string &filename, uint64_t calib_hash, cv::Size im_size,
+            size_t offset = 0);
+  bool save(const std::string &filename, uint64_t calib_hash) const;
+
+  /* Append the maps to an open file in the cache layout. Returns false
+   * on a write error */
+  bool write(FILE *fp, uint64_t calib_hash) const;
+
+  /* Projection matrix for rectifying straight to an image scaled by
+   * the given factor, as used for the coarse pass of a pyramid */
+  static cv::Mat scale_projection(const cv::Mat &P, double scale);
+
+  /* Cache file used for a calibration file and image size */
+  static std::string cache_file(const char *calib_file, cv::Size im_size);
+
+private:
+  MappedFile mapping;
+};
+
+/*
+ * Undistort and rectify both halves of a side-by-side frame with
+ * remap(), INTER_LINEAR and BORDER_CONSTANT, using the fixed-point maps.
+ *
+ * If mask is given it is filled in by rectify_mask() for the left half.
+ */
+void remap_side_by_side(const cv::Mat &frame, const RectifyMaps &maps,
+                        cv::Mat &left, cv::Mat &right, cv::Mat *mask = NULL);
+
+/*
+ * The alpha mask of the left map for a source image of src_size: the
+ * same values as remapping a 255 image with the left maps, so 255 where
+ * all four source pixels are inside, the covered fraction of 255 along
+ * the edges and 0 outside. Derived from the map bounds instead of
+ * running a third remap().
+ */
+void rectify_mask(const RectifyMaps &maps, cv::Size src_size, cv::Mat &mask);
+
+#endif
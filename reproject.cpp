@@ -0,0 +1,196 @@
+#include <opencv2/core/hal/intrin.hpp>
+#include <math.h>
+#include <algorithm>
+#include "instrument.h"
+#include "reproject.h"
+
+using namespace cv;
+
+class ReprojectBody : public ParallelLoopBody {
+public:
+  ReprojectBody(const Mat &disparity, const Matx44f &M, float z_scale, int min_disparity,
+                int first_row, Mat &xyz)
+    : disparity(disparity), M(M), z_scale(z_scale), first_row(first_row), xyz(xyz)
+  {
+    /* Disparities are fixed-point with 4 fractional bits */
+    min_raw = min_disparity * 16;
+    sparse = M(0, 1) == 0 && M(0, 2) == 0 && M(1, 0) == 0 && M(1, 2) == 0 &&
+             M(2, 0) == 0 && M(2, 1) == 0 && M(2, 2) == 0 &&
+             M(3, 0) == 0 && M(3, 1) == 0;
+  }
+
+  void operator()(const Range &rows) const
+  {
+    for (int y = rows.start; y < rows.end; y++) {
+      if (sparse)
+        sparse_row(y);
+      else
+        dense_row(y);
+    }
+  }
+
+private:
+  /* x = M00 x + M03, y = M11 y + M13, z = M23, w = M32 d + M33 */
+  void sparse_row(int y) const
+  {
+    const short *d = disparity.ptr< short >(y);
+    float *out = xyz.ptr< float >(y - first_row);
+    const float y_out = M(1, 1) * y + M(1, 3);
+    const float z_out = M(2, 3) * z_scale;
+    int x = 0;
+
+#if CV_SIMD128
+    v_float32x4 v_m00 = v_setall_f32(M(0, 0)), v_m03 = v_setall_f32(M(0, 3));
+    v_float32x4 v_m32 = v_setall_f32(M(3, 2) * (1.f / 16)), v_m33 = v_setall_f32(M(3, 3));
+    v_float32x4 v_y = v_setall_f32(y_out), v_z = v_setall_f32(z_out);
+    v_float32x4 v_one = v_setall_f32(1.f), v_zero = v_setzero_f32();
+    v_float32x4 v_missing = v_setall_f32(MISSING_Z);
+    v_float32x4 v_min = v_setall_f32((float) min_raw);
+    v_float32x4 v_step = v_setall_f32(4.f);
+    v_float32x4 v_x(0.f, 1.f, 2.f, 3.f);
+
+    for (; x <= disparity.cols - 8; x += 8) {
+      v_int32x4 d0, d1;
+      v_expand(v_load(d + x), d0, d1);
+      v_float32x4 raw[2] = { v_cvt_f32(d0), v_cvt_f32(d1) };
+
+      for (int k = 0; k < 2; k++) {
+        v_float32x4 invalid = raw[k] < v_min;
+        v_float32x4 iw = v_one / v_muladd(raw[k], v_m32, v_m33);
+        v_float32x4 px = v_select(invalid, v_zero, v_muladd(v_x, v_m00, v_m03) * iw);
+        v_float32x4 py = v_select(invalid, v_zero, v_y * iw);
+        v_float32x4 pz = v_select(invalid, v_missing, v_z * iw);
+        v_store_interleave(out + 3 * (x + 4 * k), px, py, pz);
+        v_x += v_step;
+      }
+    }
+#endif
+
+    for (; x < disparity.cols; x++) {
+      float *p = out + 3 * x;
+      if (d[x] < min_raw) {
+        p[0] = p[1] = 0;
+        p[2] = MISSING_Z;
+        continue;
+      }
+      float iw = 1.f / (M(3, 2) * (d[x] * (1.f / 16)) + M(3, 3));
+      p[0] = (M(0, 0) * x + M(0, 3)) * iw;
+      p[1] = y_out * iw;
+      p[2] = z_out * iw;
+    }
+  }
+
+  /* Any other Q: the full 4x4 product for every pixel */
+  void dense_row(int y) const
+  {
+    const short *d = disparity.ptr< short >(y);
+    float *out = xyz.ptr< float >(y - first_row);
+
+    for (int x = 0; x < disparity.cols; x++) {
+      float *p = out + 3 * x;
+      if (d[x] < min_raw) {
+        p[0] = p[1] = 0;
+        p[2] = MISSING_Z;
+        continue;
+      }
+      Vec4f v = M * Vec4f((float) x, (float) y, d[x] * (1.f / 16), 1.f);
+      float iw = 1.f / v[3];
+      p[0] = v[0] * iw;
+      p[1] = v[1] * iw;
+      p[2] = v[2] * iw * z_scale;
+    }
+  }
+
+  const Mat &disparity;
+  Matx44f M;
+  float z_scale;
+  int min_raw;
+  bool sparse;
+  int first_row;
+  Mat &xyz;
+};
+
+void reproject_disparity(const Mat &disparity, const Mat &Q, int min_disparity, Mat &xyz,
+                         Range rows)
+{
+  ScopedTimer timer("reproject");
+  CV_Assert(disparity.type() == CV_16S && Q.rows == 4 && Q.cols == 4);
+
+  Mat QF;
+  Q.convertTo(QF, CV_32F);
+  Matx44f M = QF;
+
+  /* Flip the sign of w's constant term and of z, as the point cloud
+   * output has always done */
+  float z_scale = -M(3, 3);
+  M(3, 3) = z_scale;
+
+  if (rows == Range::all())
+    rows = Range(0, disparity.rows);
+
+  xyz.create(rows.size(), disparity.cols, CV_32FC3);
+  parallel_for_(rows, ReprojectBody(disparity, M, z_scale, min_disparity, rows.start, xyz));
+}
+
+void reproject_reference(const Mat &disparity, const Mat &Q, Mat &xyz)
+{
+  Mat disparityF;
+  Mat QF;
+
+  disparity.convertTo( disparityF, CV_32F, 1./16);
+  xyz.create(disparityF.rows, disparityF.cols, CV_32FC3);
+
+  Q.convertTo( QF, CV_32F, 1.);
+  float scale = -QF.at<float>(3,3);
+  QF.at<float>(3,3)=scale;
+
+  cv::Mat_<float> vec_tmp(4,1);
+  for(int y=0; y<disparityF.rows; ++y) {
+      for(int x=0; x<disparityF.cols; ++x) {
+          vec_tmp(0)=x; vec_tmp(1)=y; vec_tmp(2)=disparityF.at<float>(y,x); vec_tmp(3)=1;
+          vec_tmp = QF*vec_tmp;
+          vec_tmp /= vec_tmp(3);
+          cv::Vec3f &point = xyz.at<cv::Vec3f>(y,x);
+          point[0] = vec_tmp(0);
+          point[1] = vec_tmp(1);
+          point[2] = vec_tmp(2) * scale;
+      }
+  }
+}
+
+ReprojectionCheck check_reprojection(const Mat &disparity, const Mat &Q, int min_disparity,
+                                     float rel_tolerance)
+{
+  ReprojectionCheck check;
+  Mat expected, actual;
+
+  reproject_reference(disparity, Q, expected);
+  reproject_disparity(disparity, Q, min_disparity, actual);
+
+  for (int y = 0; y < disparity.rows; y++) {
+    for (int x = 0; x < disparity.cols; x++) {
+      const Vec3f &e = expected.at< Vec3f >(y, x);
+      const Vec3f &a = actual.at< Vec3f >(y, x);
+      check.checked++;
+
+      /* Unmatched pixels must come out as the missing point exactly */
+      if (disparity.at< short >(y, x) < min_disparity * 16) {
+        check.invalid++;
+        if (a[0] != 0 || a[1] != 0 || a[2] != MISSING_Z)
+          check.mismatched++;
+        continue;
+      }
+      for (int c = 0; c < 3; c++) {
+        if (cvIsInf(e[c]) && cvIsInf(a[c]) && (e[c] > 0) == (a[c] > 0))
+          continue;
+        float err = fabs(a[c] - e[c]) / std::max(1.f, fabs(e[c]));
+        check.max_err = std::max(check.max_err, err);
+        if (!(err <= rel_tolerance)) {
+          check.mismatched++;
+          break;
+        }
+      }
+    }
+  }
+  return check;
+}
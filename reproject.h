@@ -0,0 +1,46 @@
+#ifndef _INCLUDED_REPROJECT_H_
+#define _INCLUDED_REPROJECT_H_
+
+#include <opencv2/core/core.hpp>
+
+/* Z given to points with no valid disparity, the same value that
+ * reprojectImageTo3D() uses for missing values */
+static const float MISSING_Z = 10000.f;
+
+/*
+ * Reproject a CV_16S fixed-point disparity map, as StereoSGBM computes
+ * it, to a CV_32FC3 point cloud. Each point is Q * (x, y, d, 1) divided
+ * by its w, with z flipped in sign the way stereoRectify()'s Q needs.
+ *
+ * Pixels with a disparity below min_disparity (which is how StereoSGBM
+ * marks unmatched pixels) are skipped and set to (0, 0, MISSING_Z).
+ * Rows run in parallel, and the usual Q from stereoRectify(), which only
+ * has 5 non-trivial entries, takes a SIMD fast path.
+ *
+ * Given a row range, only those rows are reprojected and xyz holds just
+ * that band, so callers can stream a large cloud out a band at a time.
+ */
+void reproject_disparity(const cv::Mat &disparity, const cv::Mat &Q, int min_disparity,
+                         cv::Mat &xyz, cv::Range rows = cv::Range::all());
+
+/* The original per-pixel Q * (x, y, d, 1) reprojection into CV_32FC3,
+ * kept to check reproject_disparity() against. Every pixel is
+ * reprojected, unmatched ones included */
+void reproject_reference(const cv::Mat &disparity, const cv::Mat &Q, cv::Mat &xyz);
+
+struct ReprojectionCheck {
+  int checked;
+  int invalid;    /* Of those, pixels below min_disparity */
+  int mismatched;
+  float max_err;  /* Largest relative error of a valid point */
+
+  ReprojectionCheck() : checked(0), invalid(0), mismatched(0), max_err(0) {}
+};
+
+/* Compare reproject_disparity() with reproject_reference() on every
+ * pixel. Valid points must agree to rel_tolerance relative to their
+ * size (absolute below 1), unmatched ones must be the missing point */
+ReprojectionCheck check_reprojection(const cv::Mat &disparity, const cv::Mat &Q,
+                                     int min_disparity, float rel_tolerance = 1e-4f);
+
+#endif
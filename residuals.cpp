@@ -0,0 +1,257 @@
+#include <opencv2/calib3d/calib3d.hpp>
+#include <math.h>
+#include <algorithm>
+#include "instrument.h"
+#include "residuals.h"
+
+using namespace std;
+using namespace cv;
+
+/* Size the outputs for these views, so the workers only fill them in */
+static void allocate(const vector< vector< Point2f > > &img_points, Residuals &out)
+{
+  int n = (int) img_points.size();
+  out.view_rms.assign(n, 0.f);
+  out.view_max.assign(n, 0.f);
+  out.first.resize(n + 1);
+  out.first[0] = 0;
+  for (int v = 0; v < n; v++)
+    out.first[v + 1] = out.first[v] + (int) img_points[v].size();
+  out.corner_err.resize(out.first[n]);
+}
+
+static void summarize(Residuals &out)
+{
+  double total = 0;
+  for (int v = 0; v < out.views(); v++) {
+    int n = out.first[v + 1] - out.first[v];
+    total += (double) out.view_rms[v] * out.view_rms[v] * n;
+  }
+  int corners = out.first.empty() ? 0 : out.first.back();
+  out.rms = corners ? sqrt(total / corners) : 0;
+}
+
+/* Fill in one view's RMS and worst corner from its corner errors */
+static void finish_view(Residuals &out, int v)
+{
+  const float *err = &out.corner_err[0] + out.first[v];
+  int n = out.first[v + 1] - out.first[v];
+  float sum = 0, worst = 0;
+  for (int i = 0; i < n; i++) {
+    sum += err[i] * err[i];
+    worst = std::max(worst, err[i]);
+  }
+  out.view_rms[v] = n ? sqrt(sum / n) : 0;
+  out.view_max[v] = worst;
+}
+
+/*
+ * Projects each view with the pinhole model and up to the 8 rational
+ * distortion coefficients, written out so the per-corner loop has no
+ * branches and no allocations. Longer distortion vectors (thin prism,
+ * tilted sensor) go through projectPoints() instead.
+ */
+class ReprojectionBody : public ParallelLoopBody {
+public:
+  ReprojectionBody(const vector< vector< Point3f > > &object_points,
+                   const vector< vector< Point2f > > &img_points,
+                   const vector< Mat > &rvecs, const vector< Mat > &tvecs,
+                   const Mat &K, const Mat &D, Residuals &out)
+    : object_points(object_points), img_points(img_points), rvecs(rvecs), tvecs(tvecs),
+      K(K), D(D), out(out)
+  {
+    Mat_< double > d;
+    D.reshape(1, 1).convertTo(d, CV_64F);
+    general = d.cols > 8;
+    for (int i = 0; i < 8; i++)
+      dist[i] = i < d.cols ? (float) d(i) : 0.f;
+
+    Matx33d Kd(K);
+    fx = (float) Kd(0, 0);
+    skew = (float) Kd(0, 1);
+    cx = (float) Kd(0, 2);
+    fy = (float) Kd(1, 1);
+    cy = (float) Kd(1, 2);
+  }
+
+  void operator()(const Range &views) const
+  {
+    /* Scratch for the whole range, sized for the largest board */
+    vector< Point2f > projected;
+    size_t most = 0;
+    for (int v = views.start; v < views.end; v++)
+      most = std::max(most, img_points[v].size());
+    projected.reserve(most);
+
+    for (int v = views.start; v < views.end; v++) {
+      if (general)
+        projectPoints(object_points[v], rvecs[v], tvecs[v], K, D, projected);
+      else
+        project(v, projected);
+
+      const Point2f *img = &img_points[v][0];
+      const Point2f *proj = &projected[0];
+      float *err = &out.corner_err[0] + out.first[v];
+      int n = (int) img_points[v].size();
+      for (int i = 0; i < n; i++) {
+        float dx = img[i].x - proj[i].x, dy = img[i].y - proj[i].y;
+        err[i] = sqrt(dx * dx + dy * dy);
+      }
+      finish_view(out, v);
+    }
+  }
+
+private:
+  void project(int v, vector< Point2f > &projected) const
+  {
+    Matx33d R;
+    Rodrigues(rvecs[v], R);
+    Vec3d t = tvecs[v];
+    float r[9], tx = (float) t[0], ty = (float) t[1], tz = (float) t[2];
+    for (int i = 0; i < 9; i++)
+      r[i] = (float) R.val[i];
+
+    const float k1 = dist[0], k2 = dist[1], p1 = dist[2], p2 = dist[3];
+    const float k3 = dist[4], k4 = dist[5], k5 = dist[6], k6 = dist[7];
+    const Point3f *obj = &object_points[v][0];
+    int n = (int) object_points[v].size();
+    projected.resize(n);
+    Point2f *out_pt = &projected[0];
+
+    for (int i = 0; i < n; i++) {
+      float X = r[0] * obj[i].x + r[1] * obj[i].y + r[2] * obj[i].z + tx;
+      float Y = r[3] * obj[i].x + r[4] * obj[i].y + r[5] * obj[i].z + ty;
+      float Z = r[6] * obj[i].x + r[7] * obj[i].y + r[8] * obj[i].z + tz;
+      float iz = Z != 0 ? 1.f / Z : 1.f;
+      float x = X * iz, y = Y * iz;
+      float r2 = x * x + y * y, r4 = r2 * r2, r6 = r4 * r2;
+      float radial = (1 + k1 * r2 + k2 * r4 + k3 * r6) / (1 + k4 * r2 + k5 * r4 + k6 * r6);
+      float xd = x * radial + 2 * p1 * x * y + p2 * (r2 + 2 * x * x);
+      float yd = y * radial + p1 * (r2 + 2 * y * y) + 2 * p2 * x * y;
+      out_pt[i].x = fx * xd + skew * yd + cx;
+      out_pt[i].y = fy * yd + cy;
+    }
+  }
+
+  const vector< vector< Point3f > > &object_points;
+  const vector< vector< Point2f > > &img_points;
+  const vector< Mat > &rvecs;
+  const vector< Mat > &tvecs;
+  Mat K, D;
+  Residuals &out;
+  bool general;
+  float dist[8];
+  float fx, fy, cx, cy, skew;
+};
+
+void reprojection_residuals(const vector< vector< Point3f > > &object_points,
+                            const vector< vector< Point2f > > &img_points,
+                            const vector< Mat > &rvecs, const vector< Mat > &tvecs,
+                            const Mat &K, const Mat &D, Residuals &out)
+{
+  ScopedTimer timer("reprojection_residuals");
+  allocate(img_points, out);
+  parallel_for_(Range(0, (int) img_points.size()),
+                ReprojectionBody(object_points, img_points, rvecs, tvecs, K, D, out));
+  summarize(out);
+}
+
+class EpipolarBody : public ParallelLoopBody {
+public:
+  EpipolarBody(const vector< vector< Point2f > > &left_points,
+               const vector< vector< Point2f > > &right_points,
+               const Mat &K1, const Mat &D1, const Mat &K2, const Mat &D2, const Mat &F,
+               Residuals &out)
+    : left_points(left_points), right_points(right_points), K1(K1), D1(D1), K2(K2), D2(D2),
+      F(F), out(out)
+  {
+  }
+
+  void operator()(const Range &views) const
+  {
+    vector< Point2f > ul, ur;
+    float f[9];
+    for (int i = 0; i < 9; i++)
+      f[i] = (float) F.val[i];
+
+    for (int v = views.start; v < views.end; v++) {
+      /* Back to pixels in the undistorted images, where F applies */
+      undistortPoints(left_points[v], ul, K1, D1, noArray(), K1);
+      undistortPoints(right_points[v], ur, K2, D2, noArray(), K2);
+
+      float *err = &out.corner_err[0] + out.first[v];
+      int n = (int) ul.size();
+      for (int i = 0; i < n; i++) {
+        float x1 = ul[i].x, y1 = ul[i].y, x2 = ur[i].x, y2 = ur[i].y;
+        /* Line in the right image, F x1, and in the left, F^T x2 */
+        float a2 = f[0] * x1 + f[1] * y1 + f[2];
+        float b2 = f[3] * x1 + f[4] * y1 + f[5];
+        float c2 = f[6] * x1 + f[7] * y1 + f[8];
+        float a1 = f[0] * x2 + f[3] * y2 + f[6];
+        float b1 = f[1] * x2 + f[4] * y2 + f[7];
+        float d = fabs(a2 * x2 + b2 * y2 + c2);
+        err[i] = 0.5f * (d / sqrt(a2 * a2 + b2 * b2) + d / sqrt(a1 * a1 + b1 * b1));
+      }
+      finish_view(out, v);
+    }
+  }
+
+private:
+  const vector< vector< Point2f > > &left_points;
+  const vector< vector< Point2f > > &right_points;
+  Mat K1, D1, K2, D2;
+  Matx33d F;
+  Residuals &out;
+};
+
+void epipolar_residuals(const vector< vector< Point2f > > &left_points,
+                        const vector< vector< Point2f > > &right_points,
+                        const Mat &K1, const Mat &D1, const Mat &K2, const Mat &D2,
+                        const Mat &F, Residuals &out)
+{
+  ScopedTimer timer("epipolar_residuals");
+  allocate(left_points, out);
+  parallel_for_(Range(0, (int) left_points.size()),
+                EpipolarBody(left_points, right_points, K1, D1, K2, D2, F, out));
+  summarize(out);
+}
+
+vector< int > Residuals::inliers(double k, double min_rms) const
+{
+  vector< int > keep;
+  if (view_rms.empty())
+    return keep;
+
+  /* Median and scaled median absolute deviation, which a few bad views
+   * can't drag along the way they would a mean and standard deviation */
+  vector< float > sorted(view_rms);
+  std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+  float median = sorted[sorted.size() / 2];
+  for (size_t i = 0; i < sorted.size(); i++)
+    sorted[i] = fabs(view_rms[i] - median);
+  std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+  double sigma = 1.4826 * sorted[sorted.size() / 2];
+
+  double limit = std::max(median + k * sigma, min_rms);
+  for (int v = 0; v < views(); v++) {
+    if (view_rms[v] <= limit)
+      keep.push_back(v);
+  }
+  return keep;
+}
+
+void Residuals::print(FILE *fp, const char *name) const
+{
+  int corners = first.empty() ? 0 : first.back();
+  fprintf(fp, "# %s: %d views, %d corners, rms %.3f px\n", name, views(), corners, rms);
+  if (views() == 0)
+    return;
+
+  fprintf(fp, "# %s view rms_px max_px worst_corner\n", name);
+  for (int v = 0; v < views(); v++) {
+    const float *err = &corner_err[0] + first[v];
+    int n = first[v + 1] - first[v];
+    int worst = (int) (std::max_element(err, err + n) - err);
+    fprintf(fp, "%s %d %.3f %.3f %d\n", name, v, view_rms[v], view_max[v], worst);
+  }
+}
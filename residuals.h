@@ -0,0 +1,52 @@
+#ifndef _INCLUDED_RESIDUALS_H_
+#define _INCLUDED_RESIDUALS_H_
+
+#include <opencv2/core/core.hpp>
+#include <stdio.h>
+#include <vector>
+
+/*
+ * Per-view and per-corner errors left after a solve, in pixels. The
+ * corners of all views are stored back to back: view v's are
+ * corner_err[first[v]] up to corner_err[first[v + 1]].
+ */
+struct Residuals {
+  std::vector< float > view_rms;
+  std::vector< float > view_max;
+  std::vector< int > first;
+  std::vector< float > corner_err;
+  double rms; /* Over every corner of every view */
+
+  Residuals() : rms(0) {}
+
+  int views() const { return (int) view_rms.size(); }
+
+  /* Sorted indices of the views to keep after dropping the outliers:
+   * views whose RMS is more than k robust standard deviations above
+   * the median and also above min_rms */
+  std::vector< int > inliers(double k, double min_rms = 0.5) const;
+
+  /* One line per view with its RMS, worst corner and that corner's
+   * error, under a summary line. name labels the lines, so several
+   * cameras can share one file */
+  void print(FILE *fp, const char *name) const;
+};
+
+/* Distance between each detected corner and the board corner projected
+ * at the view's solved pose. Views run in parallel */
+void reprojection_residuals(const std::vector< std::vector< cv::Point3f > > &object_points,
+                            const std::vector< std::vector< cv::Point2f > > &img_points,
+                            const std::vector< cv::Mat > &rvecs,
+                            const std::vector< cv::Mat > &tvecs,
+                            const cv::Mat &K, const cv::Mat &D, Residuals &out);
+
+/* Distance of each corner from the epipolar line of its partner in the
+ * other image, averaged over both directions. Points are undistorted
+ * first, as F relates undistorted pixel coordinates */
+void epipolar_residuals(const std::vector< std::vector< cv::Point2f > > &left_points,
+                        const std::vector< std::vector< cv::Point2f > > &right_points,
+                        const cv::Mat &K1, const cv::Mat &D1,
+                        const cv::Mat &K2, const cv::Mat &D2,
+                        const cv::Mat &F, Residuals &out);
+
+#endif
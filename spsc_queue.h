@@ -0,0 +1,83 @@
+#ifndef _INCLUDED_SPSC_QUEUE_H_
+#define _INCLUDED_SPSC_QUEUE_H_
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+/*
+ * Bounded lock-free ring buffer for exactly one producer thread and one
+ * consumer thread. The producer only writes tail and the consumer only
+ * writes head, so neither side ever takes a lock.
+ */
+template< class T >
+class SpscQueue {
+public:
+  explicit SpscQueue(size_t capacity) : slots(capacity + 1), head(0), tail(0) {}
+
+  /* Producer side. Returns false if the queue is full */
+  bool try_push(const T &value)
+  {
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t n = advance(t);
+    if (n == head.load(std::memory_order_acquire))
+      return false;
+    slots[t] = value;
+    tail.store(n, std::memory_order_release);
+    return true;
+  }
+
+  /* Consumer side. Returns false if the queue is empty */
+  bool try_pop(T &value)
+  {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire))
+      return false;
+    value = slots[h];
+    head.store(advance(h), std::memory_order_release);
+    return true;
+  }
+
+  /* Approximate when called from a third thread */
+  size_t size() const
+  {
+    size_t h = head.load(std::memory_order_acquire);
+    size_t t = tail.load(std::memory_order_acquire);
+    return t >= h ? t - h : t + slots.size() - h;
+  }
+
+  size_t capacity() const { return slots.size() - 1; }
+
+private:
+  SpscQueue(const SpscQueue &);
+  SpscQueue &operator=(const SpscQueue &);
+
+  size_t advance(size_t i) const { return i + 1 == slots.size() ? 0 : i + 1; }
+
+  std::vector< T > slots;
+  /* Padded onto separate cache lines so the two sides don't false-share */
+  std::atomic< size_t > head;
+  char pad[64 - sizeof(std::atomic< size_t >)];
+  std::atomic< size_t > tail;
+};
+
+/* Waiting strategy for a full or empty queue: yield for a while, then
+ * sleep briefly so an idle stage doesn't burn a core */
+class Backoff {
+public:
+  Backoff() : tries(0) {}
+
+  void wait()
+  {
+    if (++tries < 64)
+      std::this_thread::yield();
+    else
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+
+private:
+  int tries;
+};
+
+#endif
@@ -0,0 +1,484 @@
+#include <opencv2/core/core.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+#include <iostream>
+#include "popt_pp.h"
+#include "synthetic.h"
+#include "calibration.h"
+#include "corner_pipeline.h"
+#include "rectify_maps.h"
+#include "stripe_disparity.h"
+#include "reproject.h"
+#include "point_cloud.h"
+
+using namespace std;
+using namespace cv;
+
+/* Wall-clock samples of one stage, in milliseconds */
+struct Timings {
+  vector< double > ms;
+
+  void add(int64 start) { ms.push_back((getTickCount() - start) * 1000. / getTickFrequency()); }
+
+  double mean() const
+  {
+    double sum = 0;
+    for (size_t i = 0; i < ms.size(); i++)
+      sum += ms[i];
+    return ms.empty() ? 0 : sum / ms.size();
+  }
+
+  /* Nearest-rank percentile */
+  double percentile(double p) const
+  {
+    if (ms.empty())
+      return 0;
+    vector< double > sorted(ms);
+    sort(sorted.begin(), sorted.end());
+    int rank = (int) ceil(p / 100 * sorted.size()) - 1;
+    return sorted[std::min(std::max(rank, 0), (int) sorted.size() - 1)];
+  }
+};
+
+/* Just enough JSON for nested objects of numbers */
+class JsonWriter {
+public:
+  JsonWriter(FILE *fp) : fp(fp), depth(0), first(true) {}
+
+  void begin(const char *name = NULL)
+  {
+    key(name);
+    fputs("{", fp);
+    depth++;
+    first = true;
+  }
+
+  void end()
+  {
+    depth--;
+    fprintf(fp, "\n%*s}", 2 * depth, "");
+    first = false;
+    if (depth == 0)
+      fputs("\n", fp);
+  }
+
+  void number(const char *name, double v)
+  {
+    key(name);
+    /* JSON has no NaN or infinity */
+    if (cvIsNaN(v) || cvIsInf(v))
+      fputs("null", fp);
+    else
+      fprintf(fp, "%.6g", v);
+  }
+
+  void integer(const char *name, long v)
+  {
+    key(name);
+    fprintf(fp, "%ld", v);
+  }
+
+  void latency(const Timings &t)
+  {
+    begin("latency_ms");
+    integer("samples", (long) t.ms.size());
+    number("mean", t.mean());
+    number("p50", t.percentile(50));
+    number("p90", t.percentile(90));
+    number("p99", t.percentile(99));
+    number("max", t.percentile(100));
+    end();
+  }
+
+private:
+  void key(const char *name)
+  {
+    if (depth > 0)
+      fprintf(fp, "%s\n%*s", first ? "" : ",", 2 * depth, "");
+    if (name)
+      fprintf(fp, "\"%s\": ", name);
+    first = false;
+  }
+
+  FILE *fp;
+  int depth;
+  bool first;
+};
+
+/* Mean distance of detected corners from the true ones. The detector
+ * may number a board from the opposite corner; found is reversed when
+ * that matches better, the way the calibration tools would see a
+ * consistently held board */
+static double corner_error(vector< Point2f > &found, const vector< Point2f > &truth)
+{
+  size_t n = truth.size();
+  double direct = 0, reversed = 0;
+
+  if (found.size() != n)
+    return NAN;
+  for (size_t i = 0; i < n; i++) {
+    direct += norm(found[i] - truth[i]);
+    reversed += norm(found[n - 1 - i] - truth[i]);
+  }
+  if (reversed < direct) {
+    reverse(found.begin(), found.end());
+    direct = reversed;
+  }
+  return direct / n;
+}
+
+struct CameraResult {
+  double secs, rms;
+  Mat K, D;
+};
+
+static void write_camera(JsonWriter &json, const char *name, const CameraResult &r,
+                         const Mat &K_true)
+{
+  json.begin(name);
+  json.number("time_ms", r.secs * 1000);
+  json.number("rms_px", r.rms);
+  json.number("focal_error_px", std::max(fabs(r.K.at< double >(0, 0) - K_true.at< double >(0, 0)),
+                                         fabs(r.K.at< double >(1, 1) - K_true.at< double >(1, 1))));
+  json.number("principal_point_error_px",
+              hypot(r.K.at< double >(0, 2) - K_true.at< double >(0, 2),
+                    r.K.at< double >(1, 2) - K_true.at< double >(1, 2)));
+  json.end();
+}
+
+int main(int argc, char const *argv[])
+{
+  const char* out_filename = NULL;
+  const char* data_dir = ".";
+  int num_views = 20;
+  int runs = 30;
+  int width = 640;
+  int height = 480;
+  int seed = 1;
+
+  static struct poptOption options[] = {
+    { "out_filename",'o',POPT_ARG_STRING,&out_filename,0,"JSON report file, stdout if not given","STR" },
+    { "data_dir",'d',POPT_ARG_STRING,&data_dir,0,"Directory for the generated videos, images and clouds","STR" },
+    { "views",'n',POPT_ARG_INT,&num_views,0,"Chessboard views to render","NUM" },
+    { "runs",'r',POPT_ARG_INT,&runs,0,"Timed runs of each per-frame stage","NUM" },
+    { "width",'W',POPT_ARG_INT,&width,0,"Width of one camera image","NUM" },
+    { "height",'H',POPT_ARG_INT,&height,0,"Height of one camera image","NUM" },
+    { "seed",'s',POPT_ARG_INT,&seed,0,"Random seed for poses, textures and noise","NUM" },
+    POPT_AUTOHELP
+    { NULL, 0, 0, NULL, 0, NULL, NULL }
+  };
+
+  POpt popt(NULL, argc, argv, options, 0);
+  int c;
+  while((c = popt.getNextOpt()) >= 0) {}
+
+  const Size board_size(9, 6);
+  const float square_size = 0.025f;
+  const string dir = string(data_dir) + "/";
+
+  SyntheticRig rig = make_synthetic_rig(Size(width, height));
+  RNG rng(seed);
+  runs = std::max(runs, 1);
+
+  FILE *fp = out_filename ? fopen(out_filename, "w") : stdout;
+  if (!fp) {
+    cerr << "Unable to open report file: " << out_filename << endl;
+    exit(EXIT_FAILURE);
+  }
+  JsonWriter json(fp);
+  json.begin();
+  json.begin("config");
+  json.integer("width", width);
+  json.integer("height", height);
+  json.integer("views", num_views);
+  json.integer("runs", runs);
+  json.integer("seed", seed);
+  json.integer("threads", getNumThreads());
+  json.end();
+  json.begin("stages");
+
+  /* Chessboard views, written out as a video for the pipeline too */
+  vector< BoardPose > poses = random_board_poses(rig, board_size, square_size, num_views, rng);
+  string calib_video = dir + "synthetic_calib.avi";
+  VideoWriter writer(calib_video, CV_FOURCC('M', 'J', 'P', 'G'), 10,
+                     Size(2 * width, height));
+  vector< Mat > board_frames(poses.size());
+  for (size_t i = 0; i < poses.size(); i++) {
+    render_board(rig, board_size, square_size, poses[i], rng, board_frames[i]);
+    if (writer.isOpened())
+      writer.write(board_frames[i]);
+  }
+  writer.release();
+
+  /* Corner detection, one frame at a time and then through the pipeline */
+  vector< vector< Point3f > > object_points;
+  vector< vector< Point2f > > left_img_points, right_img_points;
+  Timings detect_times;
+  double error_sum = 0, error_max = 0;
+  int found = 0;
+  for (size_t i = 0; i < board_frames.size(); i++) {
+    Mat gray;
+    cvtColor(board_frames[i], gray, CV_BGR2GRAY);
+    Mat l = gray(Rect(0, 0, width, height)), r = gray(Rect(width, 0, width, height));
+    SideCorners left, right;
+
+    int64 start = getTickCount();
+    detect_corners(l, board_size, left);
+    detect_corners(r, board_size, right);
+    detect_times.add(start);
+
+    if (!left.found || !right.found)
+      continue;
+    vector< Point2f > true_left, true_right;
+    board_corners(rig, board_size, square_size, poses[i], true_left, true_right);
+    double el = corner_error(left.corners, true_left);
+    double er = corner_error(right.corners, true_right);
+    error_sum += el + er;
+    error_max = std::max(error_max, std::max(el, er));
+    found++;
+
+    object_points.push_back(board_object_points(board_size, square_size));
+    left_img_points.push_back(left.corners);
+    right_img_points.push_back(right.corners);
+  }
+
+  double pipeline_fps = NAN;
+  VideoCapture capture(calib_video);
+  if (capture.isOpened()) {
+    CornerPipeline pipeline(&capture, board_size, CornerPipeline::default_workers());
+    FrameCorners fc;
+    int frames = 0;
+    int64 start = getTickCount();
+    while (pipeline.next(fc))
+      frames++;
+    double secs = (getTickCount() - start) / getTickFrequency();
+    if (frames > 0)
+      pipeline_fps = frames / secs;
+  } else {
+    cerr << "Unable to read back " << calib_video << ", skipping the pipeline run" << endl;
+  }
+
+  json.begin("detection");
+  json.integer("frames", (long) board_frames.size());
+  json.integer("found_both", found);
+  json.latency(detect_times);
+  json.number("pipeline_fps", pipeline_fps);
+  json.number("corner_error_mean_px", found ? error_sum / (2 * found) : NAN);
+  json.number("corner_error_max_px", found ? error_max : NAN);
+  json.end();
+
+  if (found < 3) {
+    cerr << "Only " << found << " views found in both cameras, too few to calibrate" << endl;
+    json.end();
+    json.end();
+    if (fp != stdout)
+      fclose(fp);
+    exit(EXIT_FAILURE);
+  }
+
+  /* Intrinsics, with the flags calibrate uses */
+  int flag = CV_CALIB_FIX_K4 | CV_CALIB_FIX_K5;
+  CameraResult cam[2];
+  for (int side = 0; side < 2; side++) {
+    vector< Mat > rvecs, tvecs;
+    int64 start = getTickCount();
+    cam[side].rms = calibrateCamera(object_points, side ? right_img_points : left_img_points,
+                                    rig.image_size, cam[side].K, cam[side].D, rvecs, tvecs,
+                                    flag);
+    cam[side].secs = (getTickCount() - start) / getTickFrequency();
+  }
+  json.begin("calibrate_camera");
+  write_camera(json, "left", cam[0], rig.K1);
+  write_camera(json, "right", cam[1], rig.K2);
+  json.end();
+
+  /* Extrinsics, as calibrate_stereo does */
+  Mat R, T, E, F;
+  int64 start = getTickCount();
+  double stereo_rms = stereoCalibrate(object_points, left_img_points, right_img_points,
+                                      cam[0].K, cam[0].D, cam[1].K, cam[1].D, rig.image_size,
+                                      R, T, E, F, CV_CALIB_FIX_INTRINSIC);
+  double stereo_secs = (getTickCount() - start) / getTickFrequency();
+  Mat dR = R * rig.R.t(), rvec;
+  Rodrigues(dR, rvec);
+  json.begin("stereo_calibrate");
+  json.number("time_ms", stereo_secs * 1000);
+  json.number("rms_px", stereo_rms);
+  json.number("baseline_error_mm", fabs(norm(T) - norm(rig.T)) * 1000);
+  json.number("translation_error_mm", norm(T - rig.T) * 1000);
+  json.number("rotation_error_deg", norm(rvec) * 180 / CV_PI);
+  json.end();
+
+  /* The remaining stages rectify with the true calibration, so their
+   * accuracy is measured apart from the calibration error above */
+  Mat R1, R2, P1, P2, Q;
+  stereoRectify(rig.K1, rig.D1, rig.K2, rig.D2, rig.image_size, rig.R, rig.T,
+                R1, R2, P1, P2, Q, CALIB_ZERO_DISPARITY);
+
+  RectifyMaps maps;
+  Timings map_times;
+  for (int i = 0; i < runs; i++) {
+    start = getTickCount();
+    maps.build(rig.K1, rig.D1, R1, P1, rig.K2, rig.D2, R2, P2, rig.image_size);
+    map_times.add(start);
+  }
+  json.begin("map_init");
+  json.latency(map_times);
+  json.end();
+
+  Mat frame, true_disparity, true_depth;
+  render_plane_scene(rig, R1, P1, P2, rng, frame, true_disparity, true_depth);
+  imwrite(dir + "synthetic_plane.png", frame);
+
+  Mat left, right, mask;
+  Timings remap_times;
+  for (int i = 0; i < runs; i++) {
+    start = getTickCount();
+    remap_side_by_side(frame, maps, left, right, &mask);
+    remap_times.add(start);
+  }
+
+  /* The path undistort_rectify took before: a third remap() of a 255
+   * image for the mask */
+  Mat old_left, old_right, old_mask, full(height, width, CV_8U, Scalar(255));
+  Timings remap3_times;
+  for (int i = 0; i < runs; i++) {
+    start = getTickCount();
+    remap(frame(Rect(0, 0, width, height)), old_left, maps.lmap1, maps.lmap2,
+          INTER_LINEAR, BORDER_CONSTANT);
+    remap(frame(Rect(width, 0, width, height)), old_right, maps.rmap1, maps.rmap2,
+          INTER_LINEAR, BORDER_CONSTANT);
+    remap(full, old_mask, maps.lmap1, maps.lmap2, INTER_LINEAR, BORDER_CONSTANT);
+    remap3_times.add(start);
+  }
+  Mat mask_diff;
+  absdiff(mask, old_mask, mask_diff);
+  double mask_err;
+  minMaxLoc(mask_diff, NULL, &mask_err);
+
+  json.begin("remap");
+  json.latency(remap_times);
+  json.number("fps", 1000 / remap_times.mean());
+  json.begin("three_remaps");
+  json.latency(remap3_times);
+  json.number("fps", 1000 / remap3_times.mean());
+  json.end();
+  json.number("mask_max_diff", mask_err);
+  json.end();
+
+  int min_disp = 0;
+  cv::Ptr<cv::StereoSGBM> stereo = create_sgbm(width, min_disp, left.channels());
+  int numberOfDisparities = stereo->getNumDisparities();
+  StripeDisparity matcher(stereo);
+  Mat disparity;
+  Timings sgbm_times;
+  for (int i = 0; i < runs; i++) {
+    start = getTickCount();
+    matcher.compute(left, right, disparity);
+    sgbm_times.add(start);
+  }
+
+  long truth = 0, valid = 0, within_one = 0;
+  double abs_err = 0;
+  for (int y = 0; y < height; y++) {
+    const short *d = disparity.ptr< short >(y);
+    const float *t = true_disparity.ptr< float >(y);
+    for (int x = 0; x < width; x++) {
+      if (t[x] < min_disp || t[x] >= min_disp + numberOfDisparities)
+        continue;
+      truth++;
+      if (d[x] < min_disp * 16)
+        continue;
+      double err = fabs(d[x] / 16. - t[x]);
+      valid++;
+      abs_err += err;
+      within_one += err <= 1;
+    }
+  }
+  json.begin("sgbm");
+  json.integer("stripes", matcher.stripes());
+  json.latency(sgbm_times);
+  json.number("fps", 1000 / sgbm_times.mean());
+  json.number("coverage", truth ? (double) valid / truth : NAN);
+  json.number("within_one", valid ? (double) within_one / valid : NAN);
+  json.number("mean_abs_err_px", valid ? abs_err / valid : NAN);
+  json.end();
+
+  Mat xyz;
+  Timings reproject_times;
+  for (int i = 0; i < runs; i++) {
+    start = getTickCount();
+    reproject_disparity(disparity, Q, min_disp, xyz);
+    reproject_times.add(start);
+  }
+
+  /* X and Y against the true plane. Z is left out, the output keeps
+   * the original scaling of z by -Q(3,3) */
+  double f = P1.at< double >(0, 0), cx = P1.at< double >(0, 2), cy = P1.at< double >(1, 2);
+  double xy_err = 0;
+  long points = 0;
+  for (int y = 0; y < height; y++) {
+    const Vec3f *p = xyz.ptr< Vec3f >(y);
+    const short *d = disparity.ptr< short >(y);
+    const float *z = true_depth.ptr< float >(y);
+    for (int x = 0; x < width; x++) {
+      if (d[x] < min_disp * 16 || z[x] <= 0)
+        continue;
+      xy_err += hypot(p[x][0] - (x - cx) * z[x] / f, p[x][1] - (y - cy) * z[x] / f);
+      points++;
+    }
+  }
+  /* reproject_disparity() against the original Q * (x, y, d, 1) on the
+   * true disparity, with every tenth pixel unmatched, and on SGBM's */
+  Mat synthetic_disparity;
+  true_disparity.convertTo(synthetic_disparity, CV_16S, 16);
+  for (int y = 0; y < height; y++) {
+    short *d = synthetic_disparity.ptr< short >(y);
+    for (int x = (y * 7) % 10; x < width; x += 10)
+      d[x] = (short) ((min_disp - 1) * 16);
+  }
+  ReprojectionCheck check = check_reprojection(synthetic_disparity, Q, min_disp);
+  ReprojectionCheck sgbm_check = check_reprojection(disparity, Q, min_disp);
+
+  json.begin("reprojection");
+  json.latency(reproject_times);
+  json.number("xy_error_mean_mm", points ? xy_err / points * 1000 : NAN);
+  json.integer("check_points", check.checked + sgbm_check.checked);
+  json.integer("check_unmatched", check.invalid + sgbm_check.invalid);
+  json.integer("check_mismatched", check.mismatched + sgbm_check.mismatched);
+  json.number("check_max_rel_err", std::max(check.max_err, sgbm_check.max_err));
+  json.end();
+  bool reprojection_ok = !check.mismatched && !sgbm_check.mismatched;
+  if (!reprojection_ok)
+    cerr << "reproject_disparity() differs from the reference" << endl;
+
+  string cloud_file = dir + "synthetic.ply";
+  Timings output_times;
+  size_t written = 0;
+  for (int i = 0; i < runs; i++) {
+    PointCloudWriter cloud;
+    start = getTickCount();
+    if (!cloud.open(cloud_file.c_str(), PointCloudWriter::FORMAT_PLY))
+      break;
+    cloud.write_rows(xyz, left, mask);
+    cloud.close();
+    output_times.add(start);
+    written = cloud.points();
+  }
+  json.begin("output");
+  json.latency(output_times);
+  json.integer("points", (long) written);
+  /* 15 bytes per binary PLY vertex */
+  json.number("mb_per_s", written * 15 / 1e6 / (output_times.mean() / 1000));
+  json.end();
+
+  json.end();
+  json.end();
+  if (fp != stdout)
+    fclose(fp);
+  return reprojection_ok ? 0 : 1;
+}
@@ -0,0 +1,207 @@
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include "instrument.h"
+#include "stereo_capture.h"
+
+using namespace std;
+using namespace cv;
+
+double now_ms()
+{
+  return getTickCount() * 1000. / getTickFrequency();
+}
+
+CameraDevice::CameraDevice(int index, bool driver_timestamps)
+  : capture(index), driver_timestamps(driver_timestamps)
+{
+}
+
+bool CameraDevice::grab(double &timestamp_ms)
+{
+  if (!capture.grab())
+    return false;
+  timestamp_ms = now_ms();
+  /* 0 until the backend has a buffer timestamp to give */
+  if (driver_timestamps) {
+    double t = capture.get(CAP_PROP_POS_MSEC);
+    if (t > 0)
+      timestamp_ms = t;
+  }
+  return true;
+}
+
+bool CameraDevice::retrieve(Mat &frame)
+{
+  ScopedTimer timer("retrieve");
+  return capture.retrieve(frame);
+}
+
+FakeDevice::FakeDevice(const string &source, double fps, double offset_ms,
+                       double jitter_ms, unsigned seed)
+  : capture(source), period_ms(1000. / std::max(fps, 1.)), offset_ms(offset_ms),
+    jitter_ms(jitter_ms), start_ms(now_ms()), frames(0), rng(seed)
+{
+}
+
+bool FakeDevice::grab(double &timestamp_ms)
+{
+  if (!capture.read(frame)) {
+    capture.set(CAP_PROP_POS_FRAMES, 0);
+    if (!capture.read(frame))
+      return false;
+  }
+
+  /* Hold the frame back until its camera would have taken it */
+  uniform_real_distribution< double > jitter(-jitter_ms, jitter_ms);
+  timestamp_ms = start_ms + offset_ms + frames++ * period_ms + jitter(rng);
+  double wait = timestamp_ms - now_ms();
+  if (wait > 0)
+    this_thread::sleep_for(chrono::microseconds((long) (wait * 1000)));
+  return true;
+}
+
+bool FakeDevice::retrieve(Mat &out)
+{
+  frame.copyTo(out);
+  return !out.empty();
+}
+
+StereoCapture::Device::Device(CaptureDevice *device, int depth)
+  : device(device), filled(depth + 2), free_frames(depth + 2), pool(depth + 2), head(NULL),
+    ended(false), overruns(0)
+{
+  /* depth frames queued, the head next() is looking at and the frame
+   * the caller holds. Either queue can take the whole pool */
+  for (size_t i = 0; i < pool.size(); i++)
+    free_frames.try_push(&pool[i]);
+}
+
+StereoCapture::StereoCapture(CaptureDevice *left, CaptureDevice *right,
+                             const CaptureOptions &opts)
+  : options(opts), stopping(false), paired(0)
+{
+  if (options.queue_depth < 1)
+    options.queue_depth = 1;
+
+  devices[LEFT] = new Device(left, options.queue_depth);
+  devices[RIGHT] = new Device(right, options.queue_depth);
+  devices[LEFT]->grabber = thread(&StereoCapture::grab_loop, this, LEFT);
+  devices[RIGHT]->grabber = thread(&StereoCapture::grab_loop, this, RIGHT);
+}
+
+StereoCapture::~StereoCapture()
+{
+  stopping = true;
+  for (int side = 0; side < 2; side++) {
+    devices[side]->grabber.join();
+    delete devices[side];
+  }
+}
+
+void StereoCapture::grab_loop(Side side)
+{
+  static const char *names[2] = { "grab_left", "grab_right" };
+  Device *d = devices[side];
+  long sequence = 0;
+
+  while (!stopping) {
+    CapturedFrame *frame = NULL;
+    bool have_buffer = d->free_frames.try_pop(frame);
+
+    int64 start = getTickCount();
+    double timestamp;
+    if (!d->device->grab(timestamp))
+      break;
+    Instrument::record(names[side], start, getTickCount());
+
+    if (!have_buffer) {
+      d->overruns++;
+      sequence++;
+      continue;
+    }
+    if (!d->device->retrieve(frame->image))
+      break;
+    frame->timestamp = timestamp;
+    frame->sequence = sequence++;
+    /* Can't fail, see Device() */
+    d->filled.try_push(frame);
+  }
+  d->ended = true;
+}
+
+/* The oldest frame from a device not yet paired or dropped, waiting for
+ * one if need be. False once the device has stopped */
+bool StereoCapture::peek(Side side, CapturedFrame *&frame)
+{
+  Device *d = devices[side];
+  Backoff backoff;
+  while (!d->head && !d->filled.try_pop(d->head)) {
+    /* Anything pushed before ended was set is in the queue by now */
+    if (d->ended && !d->filled.try_pop(d->head))
+      return false;
+    backoff.wait();
+  }
+  frame = d->head;
+  return true;
+}
+
+void StereoCapture::drop(Side side)
+{
+  Device *d = devices[side];
+  d->free_frames.try_push(d->head);
+  d->head = NULL;
+  skew.unpaired[side]++;
+  Instrument::count("unpaired");
+}
+
+bool StereoCapture::next(StereoPair &pair)
+{
+  CapturedFrame *left, *right;
+  while (peek(LEFT, left) && peek(RIGHT, right)) {
+    double skew_ms = right->timestamp - left->timestamp;
+
+    /* The older frame can only be further from anything that comes
+     * after the newer one, so it will never find a partner */
+    if (fabs(skew_ms) > options.max_skew_ms) {
+      drop(skew_ms > 0 ? LEFT : RIGHT);
+      continue;
+    }
+
+    devices[LEFT]->head = devices[RIGHT]->head = NULL;
+    pair.left = left;
+    pair.right = right;
+    pair.skew_ms = skew_ms;
+    pair.index = paired++;
+
+    skew.pairs++;
+    skew.total_abs_ms += fabs(skew_ms);
+    skew.max_abs_ms = std::max(skew.max_abs_ms, fabs(skew_ms));
+    Instrument::count("pairs");
+    return true;
+  }
+  return false;
+}
+
+void StereoCapture::done(StereoPair &pair)
+{
+  devices[LEFT]->free_frames.try_push(pair.left);
+  devices[RIGHT]->free_frames.try_push(pair.right);
+  pair.left = pair.right = NULL;
+}
+
+SkewStats StereoCapture::stats() const
+{
+  SkewStats s = skew;
+  for (int side = 0; side < 2; side++)
+    s.overruns[side] = devices[side]->overruns;
+  return s;
+}
+
+void StereoCapture::print_stats(FILE *fp) const
+{
+  SkewStats s = stats();
+  fprintf(fp, "%d pairs, skew mean %.2f ms, max %.2f ms\n", s.pairs, s.mean_abs(), s.max_abs_ms);
+  fprintf(fp, "Unpaired frames: %d left, %d right. Overruns: %d left, %d right\n",
+          s.unpaired[LEFT], s.unpaired[RIGHT], s.overruns[LEFT], s.overruns[RIGHT]);
+}
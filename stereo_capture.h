@@ -0,0 +1,167 @@
+#ifndef _INCLUDED_STEREO_CAPTURE_H_
+#define _INCLUDED_STEREO_CAPTURE_H_
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <stdio.h>
+#include <atomic>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "spsc_queue.h"
+
+/* Milliseconds on the getTickCount() clock, which is CLOCK_MONOTONIC on
+ * Linux like the V4L2 buffer timestamps */
+double now_ms();
+
+/* A camera or a stand-in for one. grab() latches a frame as soon as one
+ * is ready and says when it was taken, retrieve() then decodes it */
+class CaptureDevice {
+public:
+  virtual ~CaptureDevice() {}
+
+  virtual bool grab(double &timestamp_ms) = 0;
+  virtual bool retrieve(cv::Mat &frame) = 0;
+};
+
+class CameraDevice : public CaptureDevice {
+public:
+  /* With driver_timestamps the frame time comes from the driver (the
+   * V4L2 buffer timestamp), otherwise it is when grab() returned */
+  CameraDevice(int index, bool driver_timestamps);
+
+  bool opened() const { return capture.isOpened(); }
+
+  bool grab(double &timestamp_ms);
+  bool retrieve(cv::Mat &frame);
+
+private:
+  cv::VideoCapture capture;
+  bool driver_timestamps;
+};
+
+/*
+ * Stand-in for a camera that replays a video or an image sequence
+ * (anything VideoCapture opens, such as "imgs/left%d.jpg") at a fixed
+ * frame rate, from the start again when it runs out. Frame times are
+ * shifted by offset_ms and jittered by up to jitter_ms either way, as
+ * two free-running cameras would be.
+ */
+class FakeDevice : public CaptureDevice {
+public:
+  FakeDevice(const std::string &source, double fps, double offset_ms = 0,
+             double jitter_ms = 0, unsigned seed = 0);
+
+  bool opened() const { return capture.isOpened(); }
+
+  bool grab(double &timestamp_ms);
+  bool retrieve(cv::Mat &frame);
+
+private:
+  cv::VideoCapture capture;
+  cv::Mat frame;
+  double period_ms;
+  double offset_ms;
+  double jitter_ms;
+  double start_ms;
+  long frames;
+  std::mt19937 rng;
+};
+
+struct CapturedFrame {
+  cv::Mat image;
+  double timestamp;  /* ms, see now_ms() */
+  long sequence;     /* Frames grabbed by the device before this one */
+};
+
+/* Two frames taken within max_skew_ms of each other */
+struct StereoPair {
+  CapturedFrame *left, *right;
+  double skew_ms;    /* right minus left */
+  int index;
+
+  StereoPair() : left(NULL), right(NULL), skew_ms(0), index(-1) {}
+};
+
+struct CaptureOptions {
+  /* Frames further apart than this are never paired. Half a frame
+   * period pairs each frame with its nearest neighbour */
+  double max_skew_ms;
+  /* Frames buffered per device between its grab thread and next() */
+  int queue_depth;
+
+  CaptureOptions() : max_skew_ms(15), queue_depth(4) {}
+};
+
+/* How well the two devices kept in step */
+struct SkewStats {
+  int pairs;
+  double total_abs_ms, max_abs_ms;
+  int unpaired[2];   /* Frames dropped for having no partner, per side */
+  int overruns[2];   /* Frames grabbed while next() had every buffer */
+
+  SkewStats() : pairs(0), total_abs_ms(0), max_abs_ms(0)
+  {
+    unpaired[0] = unpaired[1] = 0;
+    overruns[0] = overruns[1] = 0;
+  }
+
+  double mean_abs() const { return pairs ? total_abs_ms / pairs : 0; }
+};
+
+/*
+ * Captures from two devices at once, each on its own grab thread, and
+ * pairs their frames by timestamp. A grab thread only calls grab() and
+ * retrieve() on its device, so neither camera waits for the other and
+ * the skew is down to when the cameras take their frames.
+ *
+ * Frames come from a small pool per device. The caller takes pairs
+ * with next() and hands them back with done(). When the caller falls
+ * behind, the grab threads keep calling grab() and throw those frames
+ * away, so the driver never builds up a backlog of old buffers.
+ */
+class StereoCapture {
+public:
+  StereoCapture(CaptureDevice *left, CaptureDevice *right,
+                const CaptureOptions &options = CaptureOptions());
+  ~StereoCapture();
+
+  /* Block until the next pair. Returns false once a device stops */
+  bool next(StereoPair &pair);
+  void done(StereoPair &pair);
+
+  SkewStats stats() const;
+  void print_stats(FILE *fp) const;
+
+private:
+  typedef SpscQueue< CapturedFrame * > FrameQueue;
+
+  enum Side { LEFT = 0, RIGHT = 1 };
+
+  struct Device {
+    CaptureDevice *device;
+    FrameQueue filled;
+    FrameQueue free_frames;
+    std::vector< CapturedFrame > pool;
+    /* Oldest filled frame, taken off the queue by next() */
+    CapturedFrame *head;
+    std::atomic< bool > ended;
+    std::atomic< int > overruns;
+    std::thread grabber;
+
+    Device(CaptureDevice *device, int depth);
+  };
+
+  void grab_loop(Side side);
+  bool peek(Side side, CapturedFrame *&frame);
+  void drop(Side side);
+
+  CaptureOptions options;
+  Device *devices[2];
+  std::atomic< bool > stopping;
+  int paired;
+  SkewStats skew;
+};
+
+#endif
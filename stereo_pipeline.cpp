@@ -0,0 +1,356 @@
+#include <stdio.h>
+#include <algorithm>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "alloc_counter.h"
+#include "instrument.h"
+#include "rectify_maps.h"
+#include "stereo_pipeline.h"
+
+using namespace std;
+using namespace cv;
+
+static const char *stage_names[NUM_STAGES] = { "decode", "rectify", "disparity", "sink" };
+
+static double ticks_to_ms(int64 ticks)
+{
+  return ticks * 1000. / getTickFrequency();
+}
+
+StereoPipeline::StereoPipeline(VideoCapture *capture, const Mat &first_frame,
+                               const RectifyMaps &maps, const Ptr< StereoSGBM > &matcher,
+                               const PipelineOptions &opts, const RectifyMaps *coarse_maps)
+  : capture(capture), maps(maps), coarse_maps(coarse_maps), options(opts),
+    decoded(std::max(opts.queue_depth, 1)), free_frames(NULL),
+    min_disparity(matcher->getMinDisparity()), num_disparities(matcher->getNumDisparities()),
+    predictor(NULL), next_worker(0),
+    stopping(false), dropped(0), first_done(0), last_done(0), saved_ms(0),
+    warm_allocations(-1), warm_frames(0)
+{
+  if (options.disparity_workers < 1)
+    options.disparity_workers = 1;
+  if (options.queue_depth < 1)
+    options.queue_depth = 1;
+  CV_Assert(!options.coarse_to_fine || coarse_maps != NULL);
+
+  for (int i = 0; i < options.disparity_workers; i++) {
+    to_worker.push_back(new FrameQueue(options.queue_depth));
+    from_worker.push_back(new FrameQueue(options.queue_depth));
+    matchers.push_back(new StripeDisparity(matcher, options.stripes));
+    if (options.coarse_to_fine)
+      pyramids.push_back(new CoarseToFineDisparity(matcher, options.pyramid));
+  }
+
+  /* Enough frames for every queue to be full with each stage holding
+   * one more, so the decoder only waits on the pool when the queues
+   * would have made it wait anyway */
+  int pool_size = options.queue_depth * (2 * options.disparity_workers + 1) +
+                  options.disparity_workers + 3;
+  free_frames = new FrameQueue(pool_size);
+  for (int i = 0; i < pool_size; i++) {
+    StereoFrame *frame = new StereoFrame;
+    allocate_frame(frame, first_frame);
+    pool.push_back(frame);
+    free_frames->try_push(frame);
+  }
+
+  /* The coarse pass already picks the ranges when coarse-to-fine is on */
+  if (options.adaptive_range && !options.coarse_to_fine)
+    predictor = new DisparityRangePredictor(min_disparity, num_disparities, options.range);
+
+  decoder = thread(&StereoPipeline::decode_loop, this, first_frame);
+  rectifier = thread(&StereoPipeline::rectify_loop, this);
+  for (int i = 0; i < options.disparity_workers; i++)
+    workers.push_back(thread(&StereoPipeline::disparity_loop, this, i));
+}
+
+StereoPipeline::~StereoPipeline()
+{
+  stopping = true;
+
+  decoder.join();
+  rectifier.join();
+  for (size_t i = 0; i < workers.size(); i++)
+    workers[i].join();
+
+  /* Frames still in the queues belong to the pool */
+  for (size_t i = 0; i < pool.size(); i++)
+    delete pool[i];
+  delete free_frames;
+  for (size_t i = 0; i < to_worker.size(); i++) {
+    delete to_worker[i];
+    delete from_worker[i];
+    delete matchers[i];
+  }
+  for (size_t i = 0; i < pyramids.size(); i++)
+    delete pyramids[i];
+  delete predictor;
+}
+
+/* Give a pool frame all its buffers up front, so the stages write into
+ * memory that is already there instead of allocating per frame */
+void StereoPipeline::allocate_frame(StereoFrame *frame, const Mat &first_frame)
+{
+  Size out_size = maps.lmap1.size();
+  int type = options.grayscale ? CV_8UC1 : first_frame.type();
+
+  frame->decoded.create(first_frame.size(), first_frame.type());
+  if (options.grayscale)
+    frame->gray.create(first_frame.size(), CV_8UC1);
+  frame->left.create(out_size, type);
+  frame->right.create(out_size, type);
+  frame->disparity.create(out_size, CV_16S);
+  frame->disparity_eq.create(out_size, CV_8U);
+  if (coarse_maps) {
+    frame->coarse_left.create(coarse_maps->lmap1.size(), type);
+    frame->coarse_right.create(coarse_maps->lmap1.size(), type);
+  }
+}
+
+int StereoPipeline::default_workers()
+{
+  int n = (int) thread::hardware_concurrency() - 2;
+  return n > 0 ? n : 1;
+}
+
+/* Blocking push and pop. Both give up once the pipeline is stopping */
+bool StereoPipeline::push(FrameQueue &q, StereoFrame *frame)
+{
+  Backoff backoff;
+  while (!q.try_push(frame)) {
+    if (stopping)
+      return false;
+    backoff.wait();
+  }
+  return true;
+}
+
+bool StereoPipeline::pop(FrameQueue &q, StereoFrame *&frame)
+{
+  Backoff backoff;
+  while (!q.try_pop(frame)) {
+    if (stopping)
+      return false;
+    backoff.wait();
+  }
+  return true;
+}
+
+void StereoPipeline::decode_loop(Mat first_frame)
+{
+  int index = 0;
+  StereoFrame *frame = NULL;
+
+  /* Backends that can deliver grayscale save us the conversion */
+  if (options.grayscale)
+    capture->set(CAP_PROP_MODE, CAP_MODE_GRAY);
+
+  while (!stopping) {
+    if (frame == NULL && !pop(*free_frames, frame))
+      return;
+    frame->start[STAGE_DECODE] = getTickCount();
+
+    if (index == 0 && !first_frame.empty())
+      first_frame.copyTo(frame->decoded);
+    else if (!capture->read(frame->decoded))
+      break;
+
+    /* Later stages only ever see frame, a header on whichever buffer
+     * holds the pixels to use */
+    if (options.grayscale && frame->decoded.channels() != 1) {
+      cvtColor(frame->decoded, frame->gray, CV_BGR2GRAY);
+      frame->frame = frame->gray;
+    } else {
+      frame->frame = frame->decoded;
+    }
+    frame->index = index++;
+    frame->end[STAGE_DECODE] = getTickCount();
+    Instrument::record(stage_names[STAGE_DECODE], frame->start[STAGE_DECODE],
+                       frame->end[STAGE_DECODE]);
+
+    if (options.drop_frames) {
+      /* A dropped frame's buffers are decoded into again */
+      if (!decoded.try_push(frame)) {
+        dropped++;
+        Instrument::count("dropped");
+        continue;
+      }
+    } else if (!push(decoded, frame)) {
+      return;
+    }
+    frame = NULL;
+  }
+
+  /* The end-of-stream marker is never dropped */
+  push(decoded, NULL);
+}
+
+void StereoPipeline::rectify_loop()
+{
+  int worker = 0;
+  StereoFrame *frame;
+
+  while (pop(decoded, frame)) {
+    if (frame == NULL)
+      break;
+
+    frame->start[STAGE_RECTIFY] = getTickCount();
+    remap_side_by_side(frame->frame, maps, frame->left, frame->right);
+    if (options.coarse_to_fine)
+      remap_side_by_side(frame->frame, *coarse_maps, frame->coarse_left, frame->coarse_right);
+    frame->end[STAGE_RECTIFY] = getTickCount();
+    Instrument::record(stage_names[STAGE_RECTIFY], frame->start[STAGE_RECTIFY],
+                       frame->end[STAGE_RECTIFY]);
+
+    if (!push(*to_worker[worker], frame))
+      return;
+    worker = (worker + 1) % options.disparity_workers;
+  }
+
+  for (size_t i = 0; i < to_worker.size(); i++)
+    push(*to_worker[i], NULL);
+}
+
+void StereoPipeline::disparity_loop(int worker)
+{
+  StripeDisparity *stereo = matchers[worker];
+  CoarseToFineDisparity *pyramid = options.coarse_to_fine ? pyramids[worker] : NULL;
+  Mat reference;
+  double scale = 255 / (num_disparities * 16.);
+  StereoFrame *frame;
+
+  while (pop(*to_worker[worker], frame)) {
+    if (frame == NULL)
+      break;
+
+    frame->start[STAGE_DISPARITY] = getTickCount();
+    frame->min_disparity = min_disparity;
+    frame->num_disparities = num_disparities;
+    if (predictor) {
+      predictor->predict(frame->min_disparity, frame->num_disparities);
+      stereo->set_range(frame->min_disparity, frame->num_disparities);
+    }
+
+    if (pyramid)
+      pyramid->compute(frame->left, frame->right, frame->coarse_left, frame->coarse_right,
+                       frame->disparity);
+    else
+      stereo->compute(frame->left, frame->right, frame->disparity);
+
+    if (pyramid && options.compare_full) {
+      /* Timed separately and taken off the stage time in the report */
+      int64 t0 = getTickCount();
+      stereo->compute(frame->left, frame->right, reference);
+      int64 t1 = getTickCount();
+      frame->reference_ms = ticks_to_ms(t1 - t0);
+      frame->agreement = compare_disparity(reference, frame->disparity, min_disparity);
+    }
+
+    if (predictor) {
+      predictor->update(frame->disparity, frame->min_disparity, frame->num_disparities);
+      normalize_unmatched(frame->disparity, frame->min_disparity, min_disparity);
+    }
+    frame->disparity.convertTo(frame->disparity_eq, CV_8U, scale);
+    frame->end[STAGE_DISPARITY] = getTickCount();
+    Instrument::record(stage_names[STAGE_DISPARITY], frame->start[STAGE_DISPARITY],
+                       frame->end[STAGE_DISPARITY]);
+
+    if (!push(*from_worker[worker], frame))
+      return;
+  }
+
+  push(*from_worker[worker], NULL);
+}
+
+bool StereoPipeline::next(StereoFrame *&frame)
+{
+  /* Workers were handed frames in turn, so collecting in the same turn
+   * restores decode order. A worker's end marker comes after all its
+   * frames, so reaching one means there are no more */
+  if (!pop(*from_worker[next_worker], frame) || frame == NULL)
+    return false;
+
+  next_worker = (next_worker + 1) % options.disparity_workers;
+  frame->start[STAGE_SINK] = getTickCount();
+  return true;
+}
+
+void StereoPipeline::done(StereoFrame *frame)
+{
+  frame->end[STAGE_SINK] = getTickCount();
+  Instrument::record(stage_names[STAGE_SINK], frame->start[STAGE_SINK],
+                     frame->end[STAGE_SINK]);
+  Instrument::count("frames");
+
+  for (int s = 0; s < NUM_STAGES; s++) {
+    busy[s].add(ticks_to_ms(frame->end[s] - frame->start[s]));
+    if (s > 0)
+      queued[s].add(ticks_to_ms(frame->start[s] - frame->end[s - 1]));
+  }
+  total.add(ticks_to_ms(frame->end[STAGE_SINK] - frame->start[STAGE_DECODE]));
+
+  if (predictor) {
+    /* SGBM's cost is close to linear in the number of disparities */
+    double ms = ticks_to_ms(frame->end[STAGE_DISPARITY] - frame->start[STAGE_DISPARITY]);
+    double saved = ms * ((double) num_disparities / frame->num_disparities - 1);
+    saved_ms += saved;
+    /* Per frame only in the stats and the trace, the summary has the total */
+    Instrument::count("disparities", frame->num_disparities);
+  }
+
+  if (options.coarse_to_fine && options.compare_full) {
+    reference.add(frame->reference_ms);
+    agreement.valid_both += frame->agreement.valid_both;
+    agreement.valid_one += frame->agreement.valid_one;
+    agreement.within_one += frame->agreement.within_one;
+    agreement.mean_abs_err += frame->agreement.mean_abs_err * frame->agreement.valid_both;
+  }
+
+  if (first_done == 0)
+    first_done = frame->end[STAGE_SINK];
+  last_done = frame->end[STAGE_SINK];
+
+  /* Once every pool frame has been round, all buffers should exist */
+  if (warm_allocations >= 0)
+    warm_frames++;
+  else if (total.count >= (int) pool.size())
+    warm_allocations = AllocationCounter::allocations();
+
+  /* The pool holds every frame, so there is always room */
+  free_frames->try_push(frame);
+}
+
+void StereoPipeline::print_stats()
+{
+  double secs = ticks_to_ms(last_done - first_done) / 1000.;
+
+  printf("Processed %d frames with %d disparity workers", total.count, options.disparity_workers);
+  if (total.count > 1 && secs > 0)
+    printf(" (%.1f frames/sec)", (total.count - 1) / secs);
+  printf(", dropped %d\n", (int) dropped);
+
+  for (int s = 0; s < NUM_STAGES; s++) {
+    printf("  %-10s busy %7.2f ms avg %7.2f ms max", stage_names[s],
+           busy[s].mean(), busy[s].max_ms);
+    if (s > 0)
+      printf(", queued %7.2f ms avg %7.2f ms max", queued[s].mean(), queued[s].max_ms);
+    printf("\n");
+  }
+  printf("  %-10s       %7.2f ms avg %7.2f ms max\n", "latency", total.mean(), total.max_ms);
+  if (AllocationCounter::installed() && warm_frames > 0) {
+    long n = AllocationCounter::allocations() - warm_allocations;
+    printf("Mat allocations after warm-up: %ld in %d frames (%.2f per frame)\n",
+           n, warm_frames, (double) n / warm_frames);
+  }
+  if (options.coarse_to_fine && options.compare_full && reference.count) {
+    const DisparityAgreement &a = agreement;
+    printf("Coarse-to-fine at 1/%d: disparity %.2f ms avg against %.2f ms at full resolution\n",
+           1 << options.pyramid.levels, busy[STAGE_DISPARITY].mean() - reference.mean(),
+           reference.mean());
+    printf("  %.2f%% of %d matched pixels within 1px, mean error %.3f px, "
+           "%d pixels matched by only one\n",
+           a.valid_both ? 100. * a.within_one / a.valid_both : 100., a.valid_both,
+           a.valid_both ? a.mean_abs_err / a.valid_both : 0., a.valid_one);
+  }
+  if (predictor && total.count)
+    printf("Adaptive disparity range saved ~%.1f ms per frame\n", saved_ms / total.count);
+}
@@ -0,0 +1,185 @@
+#ifndef _INCLUDED_STEREO_PIPELINE_H_
+#define _INCLUDED_STEREO_PIPELINE_H_
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "rectify_maps.h"
+#include "disparity_range.h"
+#include "multires_disparity.h"
+#include "spsc_queue.h"
+#include "stripe_disparity.h"
+
+enum PipelineStage {
+  STAGE_DECODE,
+  STAGE_RECTIFY,
+  STAGE_DISPARITY,
+  STAGE_SINK,
+  NUM_STAGES
+};
+
+/* One side-by-side frame on its way through the pipeline. Frames come
+ * from a pool and keep their buffers from one use to the next */
+struct StereoFrame {
+  int index;             /* Position in the video, counting dropped frames */
+  cv::Mat decoded;       /* As read from the capture */
+  cv::Mat gray;          /* Converted at decode time with grayscale */
+  cv::Mat frame;         /* decoded or gray, whichever the later stages use */
+  cv::Mat left, right;   /* Rectified halves */
+  cv::Mat coarse_left, coarse_right; /* Reduced size pair for coarse-to-fine */
+  cv::Mat disparity;     /* CV_16S, 4 fractional bits */
+  cv::Mat disparity_eq;  /* Scaled to CV_8U for display */
+  int min_disparity;     /* Disparity range searched for this frame */
+  int num_disparities;
+
+  /* getTickCount() on entering and leaving each stage */
+  int64 start[NUM_STAGES];
+  int64 end[NUM_STAGES];
+
+  /* With compare_full, the cost of the plain full resolution matcher on
+   * this frame and how well the coarse-to-fine result matches it */
+  double reference_ms;
+  DisparityAgreement agreement;
+
+  StereoFrame() : index(-1), min_disparity(0), num_disparities(0), reference_ms(0) {}
+};
+
+struct PipelineOptions {
+  /* Threads running StereoSGBM, each on whole frames */
+  int disparity_workers;
+  /* How each worker splits its frame. One stripe by default, as the
+   * workers already keep the cores busy */
+  StripeOptions stripes;
+  /* Capacity of each queue between stages */
+  int queue_depth;
+  /* When the pipeline falls behind, drop new frames at the decoder
+   * instead of stalling it. Meant for live sources */
+  bool drop_frames;
+  /* Narrow each frame's disparity search to the range seen in the
+   * frames before it */
+  bool adaptive_range;
+  RangeOptions range;
+  /* Match a reduced size pair first and refine at full resolution in
+   * bands. Needs the coarse maps passed to the pipeline */
+  bool coarse_to_fine;
+  PyramidOptions pyramid;
+  /* Also run the plain full resolution matcher on every frame and
+   * report the difference. Costs the time coarse-to-fine saves */
+  bool compare_full;
+  /* Match on grayscale, converted once at decode time or delivered
+   * directly by backends that support it */
+  bool grayscale;
+
+  PipelineOptions()
+    : disparity_workers(1), queue_depth(4), drop_frames(false), adaptive_range(false),
+      coarse_to_fine(false), compare_full(false), grayscale(false)
+  {
+    stripes.stripes = 1;
+  }
+};
+
+/* Running totals for one latency measurement */
+struct LatencyStats {
+  int count;
+  double total_ms;
+  double max_ms;
+
+  LatencyStats() : count(0), total_ms(0), max_ms(0) {}
+
+  void add(double ms)
+  {
+    count++;
+    total_ms += ms;
+    if (ms > max_ms)
+      max_ms = ms;
+  }
+
+  double mean() const { return count ? total_ms / count : 0; }
+};
+
+/*
+ * Decode, rectify and disparity stages for side-by-side stereo video,
+ * each on its own threads and connected by bounded lock-free queues.
+ * Rectified frames are dealt round-robin to the disparity workers and
+ * collected in the same order, so next() returns frames in decode order.
+ *
+ * The caller is the sink: it takes frames with next(), writes or shows
+ * them, and hands them back with done() so their latency is counted.
+ */
+class StereoPipeline {
+public:
+  /* first_frame is the frame the caller already read to size the maps.
+   * coarse_maps rectify to the reduced size for coarse-to-fine */
+  StereoPipeline(cv::VideoCapture *capture, const cv::Mat &first_frame,
+                 const RectifyMaps &maps, const cv::Ptr< cv::StereoSGBM > &matcher,
+                 const PipelineOptions &options, const RectifyMaps *coarse_maps = NULL);
+  ~StereoPipeline();
+
+  /* Block until the next frame is through the disparity stage.
+   * Returns false at the end of the video */
+  bool next(StereoFrame *&frame);
+
+  /* Release a frame returned by next() */
+  void done(StereoFrame *frame);
+
+  /* Per-stage busy time and time spent queued before each stage */
+  void print_stats();
+
+  /* Disparity workers to use when the user did not ask for a number:
+   * leave a core each for decoding and rectification */
+  static int default_workers();
+
+private:
+  typedef SpscQueue< StereoFrame * > FrameQueue;
+
+  bool push(FrameQueue &q, StereoFrame *frame);
+  bool pop(FrameQueue &q, StereoFrame *&frame);
+
+  void allocate_frame(StereoFrame *frame, const cv::Mat &first_frame);
+
+  void decode_loop(cv::Mat first_frame);
+  void rectify_loop();
+  void disparity_loop(int worker);
+
+  cv::VideoCapture *capture;
+  const RectifyMaps &maps;
+  const RectifyMaps *coarse_maps;
+  PipelineOptions options;
+
+  FrameQueue decoded;
+  /* Frames handed back by the sink for the decoder to reuse */
+  FrameQueue *free_frames;
+  std::vector< StereoFrame * > pool;
+  std::vector< FrameQueue * > to_worker;
+  std::vector< FrameQueue * > from_worker;
+  std::vector< StripeDisparity * > matchers;
+  std::vector< CoarseToFineDisparity * > pyramids;
+  int min_disparity, num_disparities;
+  DisparityRangePredictor *predictor;
+  int next_worker;
+
+  std::atomic< bool > stopping;
+  std::atomic< int > dropped;
+
+  /* Only touched by the sink thread */
+  int64 first_done;
+  int64 last_done;
+  LatencyStats busy[NUM_STAGES];
+  LatencyStats queued[NUM_STAGES];
+  LatencyStats total;
+  double saved_ms;
+  LatencyStats reference;
+  DisparityAgreement agreement;
+  /* Allocation count once the pool was warm, and frames since */
+  long warm_allocations;
+  int warm_frames;
+
+  std::thread decoder;
+  std::thread rectifier;
+  std::vector< std::thread > workers;
+};
+
+#endif
@@ -0,0 +1,212 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+#include "disparity_range.h"
+#include "instrument.h"
+#include "stripe_disparity.h"
+
+using namespace std;
+using namespace cv;
+
+Ptr< StereoSGBM > create_sgbm(int half_width, int min_disparity, int channels)
+{
+  int window_size = 7;
+  int num_disparities = ((half_width / 8) + 15) & -16;
+
+  return StereoSGBM::create(min_disparity, num_disparities, window_size,
+                            /* P1 */ 8 * channels * window_size * window_size,
+                            /* P2 */ 32 * channels * window_size * window_size,
+                            /* disp12MaxDiff */ 1,
+                            /* preFilterCap */ 63,
+                            /* uniquenessRatio */ 2,
+                            /* speckleWindowSize */ 50,
+                            /* speckleRange */ 2,
+                            StereoSGBM::MODE_HH);
+}
+
+Ptr< StereoSGBM > clone_sgbm(const Ptr< StereoSGBM > &m, int mode)
+{
+  return StereoSGBM::create(m->getMinDisparity(), m->getNumDisparities(), m->getBlockSize(),
+                            m->getP1(), m->getP2(), m->getDisp12MaxDiff(),
+                            m->getPreFilterCap(), m->getUniquenessRatio(),
+                            m->getSpeckleWindowSize(), m->getSpeckleRange(),
+                            mode < 0 ? m->getMode() : mode);
+}
+
+int parse_sgbm_mode(const char *name)
+{
+  if (strcasecmp(name, "sgbm") == 0)
+    return StereoSGBM::MODE_SGBM;
+  if (strcasecmp(name, "hh") == 0)
+    return StereoSGBM::MODE_HH;
+  if (strcasecmp(name, "3way") == 0)
+    return StereoSGBM::MODE_SGBM_3WAY;
+#ifdef HAVE_SGBM_HH4
+  if (strcasecmp(name, "hh4") == 0)
+    return StereoSGBM::MODE_HH4;
+#endif
+  return -1;
+}
+
+StripeDisparity::StripeDisparity(const Ptr< StereoSGBM > &matcher, const StripeOptions &options)
+  : prototype(matcher), options(options),
+    min_disparity(matcher->getMinDisparity()), num_disparities(matcher->getNumDisparities()),
+    planned_rows(-1)
+{
+  /* Half the block for the matching window, plus a margin for the
+   * smoothness term to settle along the vertical paths */
+  overlap = options.overlap > 0 ? options.overlap : matcher->getBlockSize() / 2 + 16;
+}
+
+/* Split rows into stripes, each matching its core rows plus overlap */
+void StripeDisparity::plan(int rows)
+{
+  int n = options.stripes > 0 ? options.stripes : getNumThreads();
+
+  if (options.max_stripe_rows > 2 * overlap) {
+    int core = options.max_stripe_rows - 2 * overlap;
+    n = std::max(n, (rows + core - 1) / core);
+  }
+  /* Stripes thinner than their overlap would mostly match overlap */
+  n = std::max(1, std::min(n, rows / std::max(overlap, 1)));
+
+  cores.clear();
+  for (int i = 0; i < n; i++)
+    cores.push_back(Range(rows * i / n, rows * (i + 1) / n));
+
+  /* Each stripe's output, kept between calls so it isn't reallocated */
+  scratch.resize(n);
+
+  if ((int) matchers.size() != n) {
+    matchers.clear();
+    for (int i = 0; i < n; i++) {
+      matchers.push_back(clone_sgbm(prototype, options.mode));
+      matchers[i]->setMinDisparity(min_disparity);
+      matchers[i]->setNumDisparities(num_disparities);
+    }
+  }
+  planned_rows = rows;
+}
+
+void StripeDisparity::set_range(int min_disp, int num_disp)
+{
+  min_disparity = min_disp;
+  num_disparities = num_disp;
+  for (size_t i = 0; i < matchers.size(); i++) {
+    matchers[i]->setMinDisparity(min_disp);
+    matchers[i]->setNumDisparities(num_disp);
+  }
+}
+
+class StripeBody : public ParallelLoopBody {
+public:
+  StripeBody(const Mat &left, const Mat &right, const vector< Range > &cores,
+             const vector< Ptr< StereoSGBM > > &matchers, vector< Mat > &scratch,
+             int overlap, Mat &disparity, const vector< Range > *ranges = NULL, int full_min = 0)
+    : left(left), right(right), cores(cores), matchers(matchers), scratch(scratch),
+      overlap(overlap), disparity(disparity), ranges(ranges), full_min(full_min) {}
+
+  void operator()(const Range &range) const
+  {
+    for (int i = range.start; i < range.end; i++) {
+      const Range &core = cores[i];
+      Range rows(std::max(core.start - overlap, 0), std::min(core.end + overlap, left.rows));
+      Mat &stripe = scratch[i];
+      Mat out = disparity.rowRange(core);
+
+      if (ranges) {
+        matchers[i]->setMinDisparity((*ranges)[i].start);
+        matchers[i]->setNumDisparities((*ranges)[i].size());
+      }
+      matchers[i]->compute(left.rowRange(rows), right.rowRange(rows), stripe);
+      stripe.rowRange(core.start - rows.start, core.end - rows.start).copyTo(out);
+      if (ranges)
+        normalize_unmatched(out, (*ranges)[i].start, full_min);
+    }
+  }
+
+private:
+  const Mat &left, &right;
+  const vector< Range > &cores;
+  const vector< Ptr< StereoSGBM > > &matchers;
+  vector< Mat > &scratch;
+  int overlap;
+  Mat &disparity;
+  const vector< Range > *ranges;
+  int full_min;
+};
+
+void StripeDisparity::compute(const Mat &left, const Mat &right, Mat &disparity)
+{
+  ScopedTimer timer("sgbm");
+  CV_Assert(left.size() == right.size() && left.type() == right.type());
+
+  if (planned_rows != left.rows)
+    plan(left.rows);
+
+  if (matchers.size() == 1) {
+    matchers[0]->compute(left, right, disparity);
+    return;
+  }
+
+  disparity.create(left.size(), CV_16S);
+  parallel_for_(Range(0, (int) cores.size()),
+                StripeBody(left, right, cores, matchers, scratch, overlap, disparity),
+                (double) cores.size());
+}
+
+void StripeDisparity::compute(const Mat &left, const Mat &right, const vector< Range > &ranges,
+                              Mat &disparity)
+{
+  ScopedTimer timer("sgbm");
+  CV_Assert(left.size() == right.size() && left.type() == right.type());
+
+  if (planned_rows != left.rows)
+    plan(left.rows);
+  CV_Assert(ranges.size() == cores.size());
+
+  disparity.create(left.size(), CV_16S);
+  parallel_for_(Range(0, (int) cores.size()),
+                StripeBody(left, right, cores, matchers, scratch, overlap, disparity,
+                           &ranges, min_disparity),
+                (double) cores.size());
+
+  /* Leave the matchers searching the configured range */
+  set_range(min_disparity, num_disparities);
+}
+
+const vector< Range > &StripeDisparity::stripe_rows(int rows)
+{
+  if (planned_rows != rows)
+    plan(rows);
+  return cores;
+}
+
+DisparityAgreement compare_disparity(const Mat &a, const Mat &b, int min_disparity)
+{
+  CV_Assert(a.size() == b.size() && a.type() == CV_16S && b.type() == CV_16S);
+
+  const int min_raw = min_disparity * 16;
+  DisparityAgreement r;
+  double err_sum = 0;
+
+  for (int y = 0; y < a.rows; y++) {
+    const short *pa = a.ptr< short >(y), *pb = b.ptr< short >(y);
+    for (int x = 0; x < a.cols; x++) {
+      bool va = pa[x] >= min_raw, vb = pb[x] >= min_raw;
+      if (va != vb) {
+        r.valid_one++;
+      } else if (va) {
+        int diff = abs(pa[x] - pb[x]);
+        r.valid_both++;
+        if (diff <= 16)
+          r.within_one++;
+        err_sum += diff;
+      }
+    }
+  }
+  if (r.valid_both)
+    r.mean_abs_err = err_sum / r.valid_both / 16.;
+  return r;
+}
@@ -0,0 +1,104 @@
+#ifndef _INCLUDED_STRIPE_DISPARITY_H_
+#define _INCLUDED_STRIPE_DISPARITY_H_
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+#include <vector>
+
+/* MODE_HH4 arrived in OpenCV 3.4 */
+#if CV_VERSION_MAJOR > 3 || (CV_VERSION_MAJOR == 3 && CV_VERSION_MINOR >= 4)
+#define HAVE_SGBM_HH4 1
+#endif
+
+struct StripeOptions {
+  /* Number of horizontal stripes, 0 for one per OpenCV thread.
+   * 1 runs the matcher on the whole image as before */
+  int stripes;
+  /* Extra rows matched above and below each stripe and then thrown
+   * away, so the cost aggregation near the seams sees the same
+   * neighbourhood as in a single call. 0 picks a default from the
+   * block size */
+  int overlap;
+  /* Upper bound on the rows a stripe matches including its overlap,
+   * which bounds the matcher's scratch memory. 0 for no limit */
+  int max_stripe_rows;
+  /* StereoSGBM::MODE_* to run each stripe with, -1 to keep the mode
+   * the matcher was created with */
+  int mode;
+
+  StripeOptions() : stripes(0), overlap(0), max_stripe_rows(0), mode(-1) {}
+};
+
+/* What the tools bound stripes to when they split an image: at a few
+ * hundred rows each matcher's buffers stay a small slice of the whole */
+static const int DEFAULT_MAX_STRIPE_ROWS = 256;
+
+/* The matcher undistort_rectify, stereo_bench and the depth service
+ * share, with the disparity range sized for images half_width wide.
+ * The smoothness penalties scale with the channels of the input */
+cv::Ptr< cv::StereoSGBM > create_sgbm(int half_width, int min_disparity, int channels);
+
+/* Copy of a StereoSGBM with the same parameters. Matchers keep scratch
+ * buffers between calls, so concurrent callers each need their own */
+cv::Ptr< cv::StereoSGBM > clone_sgbm(const cv::Ptr< cv::StereoSGBM > &matcher, int mode = -1);
+
+/* StereoSGBM::MODE_* for "sgbm", "hh", "3way" or "hh4", -1 if unknown */
+int parse_sgbm_mode(const char *name);
+
+/*
+ * StereoSGBM split into horizontal stripes that are matched concurrently
+ * with their own matcher each and stitched back together. Each stripe
+ * is matched with overlap rows of context either side, so the result
+ * differs from a single compute() call only where the aggregation paths
+ * would have carried information further than the overlap.
+ */
+class StripeDisparity {
+public:
+  StripeDisparity(const cv::Ptr< cv::StereoSGBM > &matcher,
+                  const StripeOptions &options = StripeOptions());
+
+  /* Same contract as StereoMatcher::compute(): CV_16S output with 4
+   * fractional bits */
+  void compute(const cv::Mat &left, const cv::Mat &right, cv::Mat &disparity);
+
+  /* Like compute(), but stripe i only searches the disparities in
+   * ranges[i], one range per row band of stripe_rows(). Pixels left
+   * unmatched get the unmatched value of the full range */
+  void compute(const cv::Mat &left, const cv::Mat &right,
+               const std::vector< cv::Range > &ranges, cv::Mat &disparity);
+
+  /* Search a different disparity range from the next compute() on */
+  void set_range(int min_disparity, int num_disparities);
+
+  /* Output rows each stripe produces for an image of the given height */
+  const std::vector< cv::Range > &stripe_rows(int rows);
+
+  int stripes() const { return (int) matchers.size(); }
+
+private:
+  void plan(int rows);
+
+  cv::Ptr< cv::StereoSGBM > prototype;
+  StripeOptions options;
+  int overlap;
+  int min_disparity, num_disparities;
+  int planned_rows;
+  std::vector< cv::Range > cores;
+  std::vector< cv::Ptr< cv::StereoSGBM > > matchers;
+  std::vector< cv::Mat > scratch;
+};
+
+/* How closely two disparity maps agree, counting only pixels valid in
+ * both (at or above min_disparity) */
+struct DisparityAgreement {
+  int valid_both;
+  int valid_one;       /* Valid in one map only */
+  int within_one;      /* Differ by at most one pixel */
+  double mean_abs_err; /* In pixels */
+
+  DisparityAgreement() : valid_both(0), valid_one(0), within_one(0), mean_abs_err(0) {}
+};
+
+DisparityAgreement compare_disparity(const cv::Mat &a, const cv::Mat &b, int min_disparity);
+
+#endif
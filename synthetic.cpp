@@ -0,0 +1,207 @@
+#include <opencv2/calib3d/calib3d.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "calibration.h"
+#include "synthetic.h"
+
+using namespace std;
+using namespace cv;
+
+/* Texture pixels per chessboard square */
+static const int SQUARE_PX = 32;
+
+/* Grey level around the rendered targets */
+static const double BACKGROUND = 128;
+
+SyntheticRig make_synthetic_rig(Size image_size)
+{
+  SyntheticRig rig;
+  double f = 0.9 * image_size.width;
+  double cx = image_size.width / 2., cy = image_size.height / 2.;
+
+  rig.image_size = image_size;
+  rig.K1 = (Mat_< double >(3, 3) << f, 0, cx, 0, f, cy, 0, 0, 1);
+  rig.K2 = (Mat_< double >(3, 3) << f * 1.005, 0, cx + 4, 0, f * 1.005, cy - 3, 0, 0, 1);
+  rig.D1 = Mat::zeros(1, 5, CV_64F);
+  rig.D2 = Mat::zeros(1, 5, CV_64F);
+  Rodrigues(Vec3d(0.005, -0.01, 0.002), rig.R);
+  rig.T = (Mat_< double >(3, 1) << -0.06, 0.0005, 0.001);
+  return rig;
+}
+
+/* Pose of a target in the right camera, from its pose in the left */
+static void right_pose(const SyntheticRig &rig, const Mat &R_left, const Mat &t_left,
+                       Mat &R_right, Mat &t_right)
+{
+  R_right = rig.R * R_left;
+  t_right = rig.R * t_left + rig.T;
+}
+
+/* Render a texture lying on the z=0 plane of a target with pose (R, t).
+ * S maps texture pixels to target plane coordinates */
+static void render_plane(const Mat &texture, const Mat &K, const Mat &R, const Mat &t,
+                         const Mat &S, Size size, Mat &out)
+{
+  Mat Rt(3, 3, CV_64F);
+  R.col(0).copyTo(Rt.col(0));
+  R.col(1).copyTo(Rt.col(1));
+  t.copyTo(Rt.col(2));
+
+  Mat H = K * Rt * S;
+  warpPerspective(texture, out, H, size, INTER_LINEAR, BORDER_CONSTANT, Scalar::all(BACKGROUND));
+}
+
+static void add_noise(Mat &img, RNG &rng)
+{
+  Mat noise(img.size(), CV_16S);
+  GaussianBlur(img, img, Size(3, 3), 0.7);
+  rng.fill(noise, RNG::NORMAL, 0, 2);
+  add(img, noise, img, noArray(), CV_8U);
+}
+
+static void side_by_side(const Mat &left, const Mat &right, Mat &frame)
+{
+  Mat gray(left.rows, left.cols * 2, CV_8U);
+  Mat l = gray(Rect(0, 0, left.cols, left.rows));
+  Mat r = gray(Rect(left.cols, 0, left.cols, left.rows));
+  left.copyTo(l);
+  right.copyTo(r);
+  cvtColor(gray, frame, CV_GRAY2BGR);
+}
+
+void board_corners(const SyntheticRig &rig, Size board_size, float square_size,
+                   const BoardPose &pose, vector< Point2f > &left, vector< Point2f > &right)
+{
+  vector< Point3f > obj = board_object_points(board_size, square_size);
+  Mat Rb, R2, t2, rvec2;
+
+  projectPoints(obj, pose.rvec, pose.tvec, rig.K1, rig.D1, left);
+
+  Rodrigues(pose.rvec, Rb);
+  right_pose(rig, Rb, pose.tvec, R2, t2);
+  Rodrigues(R2, rvec2);
+  projectPoints(obj, rvec2, t2, rig.K2, rig.D2, right);
+}
+
+static bool inside(const vector< Point2f > &pts, Size size, float margin)
+{
+  for (size_t i = 0; i < pts.size(); i++) {
+    if (pts[i].x < margin || pts[i].y < margin ||
+        pts[i].x > size.width - margin || pts[i].y > size.height - margin)
+      return false;
+  }
+  return true;
+}
+
+vector< BoardPose > random_board_poses(const SyntheticRig &rig, Size board_size,
+                                       float square_size, int count, RNG &rng)
+{
+  const double f = rig.K1.at< double >(0, 0);
+  const double board_w = (board_size.width - 1) * square_size;
+  const double board_h = (board_size.height - 1) * square_size;
+  /* Room for the white border around the corners */
+  const float margin = 0.06f * rig.image_size.width;
+  vector< BoardPose > poses;
+
+  for (int tries = 0; (int) poses.size() < count && tries < count * 1000; tries++) {
+    BoardPose p;
+    Mat Rb;
+    p.rvec = (Mat_< double >(3, 1) << rng.uniform(-0.5, 0.5), rng.uniform(-0.5, 0.5),
+              rng.uniform(-0.3, 0.3));
+    Rodrigues(p.rvec, Rb);
+
+    /* Board spanning 30-60% of the image width, anywhere in view */
+    double z = f * board_w / (rng.uniform(0.3, 0.6) * rig.image_size.width);
+    double half_w = z * rig.image_size.width / (2 * f);
+    double half_h = z * rig.image_size.height / (2 * f);
+    Mat centre = (Mat_< double >(3, 1) << rng.uniform(-0.5, 0.5) * half_w,
+                  rng.uniform(-0.5, 0.5) * half_h, z);
+    Mat board_centre = (Mat_< double >(3, 1) << board_w / 2, board_h / 2, 0);
+    p.tvec = centre - Rb * board_centre;
+
+    vector< Point2f > l, r;
+    board_corners(rig, board_size, square_size, p, l, r);
+    if (inside(l, rig.image_size, margin) && inside(r, rig.image_size, margin))
+      poses.push_back(p);
+  }
+  return poses;
+}
+
+void render_board(const SyntheticRig &rig, Size board_size, float square_size,
+                  const BoardPose &pose, RNG &rng, Mat &frame)
+{
+  /* Squares around the inner corners, plus a white square of border */
+  Mat texture((board_size.height + 3) * SQUARE_PX, (board_size.width + 3) * SQUARE_PX,
+              CV_8U, Scalar(255));
+  for (int r = 0; r <= board_size.height; r++)
+    for (int c = 0; c <= board_size.width; c++)
+      if ((r + c) % 2 == 0)
+        texture(Rect((c + 1) * SQUARE_PX, (r + 1) * SQUARE_PX, SQUARE_PX, SQUARE_PX)) = Scalar(0);
+
+  /* The first inner corner falls between texture pixels 2*SQUARE_PX-1
+   * and 2*SQUARE_PX */
+  double s = square_size / SQUARE_PX, o = (2 * SQUARE_PX - 0.5) * s;
+  Mat S = (Mat_< double >(3, 3) << s, 0, -o, 0, s, -o, 0, 0, 1);
+
+  Mat Rb, R2, t2, left, right;
+  Rodrigues(pose.rvec, Rb);
+  right_pose(rig, Rb, pose.tvec, R2, t2);
+
+  render_plane(texture, rig.K1, Rb, pose.tvec, S, rig.image_size, left);
+  render_plane(texture, rig.K2, R2, t2, S, rig.image_size, right);
+  add_noise(left, rng);
+  add_noise(right, rng);
+  side_by_side(left, right, frame);
+}
+
+void render_plane_scene(const SyntheticRig &rig, const Mat &R1, const Mat &P1, const Mat &P2,
+                        RNG &rng, Mat &frame, Mat &disparity, Mat &depth)
+{
+  /* Texture with detail at several scales for the matcher to lock on to */
+  const int tex_size = 1024;
+  const double plane_size = 4.0;
+  Mat coarse(tex_size / 16, tex_size / 16, CV_8U), fine(tex_size, tex_size, CV_8U), texture;
+  rng.fill(coarse, RNG::UNIFORM, 0, 256);
+  rng.fill(fine, RNG::UNIFORM, 0, 256);
+  resize(coarse, texture, fine.size(), 0, 0, INTER_CUBIC);
+  addWeighted(texture, 0.5, fine, 0.5, 0, texture);
+  GaussianBlur(texture, texture, Size(3, 3), 0.8);
+
+  double s = plane_size / tex_size;
+  Mat S = (Mat_< double >(3, 3) << s, 0, -plane_size / 2, 0, s, -plane_size / 2, 0, 0, 1);
+
+  /* A slanted plane 1.5m away */
+  Mat Rp, R2, t2, left, right;
+  Rodrigues(Vec3d(0.15, -0.25, 0.05), Rp);
+  Mat tp = (Mat_< double >(3, 1) << 0, 0, 1.5);
+  right_pose(rig, Rp, tp, R2, t2);
+
+  render_plane(texture, rig.K1, Rp, tp, S, rig.image_size, left);
+  render_plane(texture, rig.K2, R2, t2, S, rig.image_size, right);
+  add_noise(left, rng);
+  add_noise(right, rng);
+  side_by_side(left, right, frame);
+
+  /* Intersect each rectified left pixel's ray with the plane n.X = d */
+  Mat n = Rp.col(2);
+  double d = n.dot(tp);
+  Mat R1d;
+  R1.convertTo(R1d, CV_64F);
+  Matx33d R1m = R1d;
+  Matx33d R1t = R1m.t();
+  Vec3d nv(n.at< double >(0), n.at< double >(1), n.at< double >(2));
+  double f = P1.at< double >(0, 0), cx = P1.at< double >(0, 2), cy = P1.at< double >(1, 2);
+  double fb = -P2.at< double >(0, 3);
+
+  disparity.create(rig.image_size, CV_32F);
+  depth.create(rig.image_size, CV_32F);
+  for (int y = 0; y < rig.image_size.height; y++) {
+    float *disp = disparity.ptr< float >(y), *z = depth.ptr< float >(y);
+    for (int x = 0; x < rig.image_size.width; x++) {
+      Vec3d ray = R1t * Vec3d((x - cx) / f, (y - cy) / f, 1);
+      double denom = nv.dot(ray);
+      double t = denom != 0 ? d / denom : -1;
+      z[x] = t > 0 ? (float) t : 0;
+      disp[x] = t > 0 ? (float) (fb / t) : -1;
+    }
+  }
+}
@@ -0,0 +1,52 @@
+#ifndef _INCLUDED_SYNTHETIC_H_
+#define _INCLUDED_SYNTHETIC_H_
+
+#include <opencv2/core/core.hpp>
+#include <vector>
+
+/*
+ * A stereo rig with known calibration, for rendering test data. The
+ * lenses are distortion-free so that every planar target renders with
+ * a single homography per camera.
+ */
+struct SyntheticRig {
+  cv::Size image_size;  /* One camera, side-by-side frames are twice as wide */
+  cv::Mat K1, D1, K2, D2;
+  cv::Mat R, T;         /* Right camera from left: X2 = R X1 + T */
+};
+
+/* Rig with a 60mm baseline, a slight toe-in and slightly mismatched
+ * focal lengths, in metres */
+SyntheticRig make_synthetic_rig(cv::Size image_size);
+
+/* A chessboard pose, in left camera coordinates */
+struct BoardPose {
+  cv::Mat rvec, tvec;
+};
+
+/* Random poses that keep the whole board in view of both cameras */
+std::vector< BoardPose > random_board_poses(const SyntheticRig &rig, cv::Size board_size,
+                                            float square_size, int count, cv::RNG &rng);
+
+/* Render one side-by-side 8-bit BGR frame of the board. Mild blur and
+ * noise keep the corner detector from seeing perfect edges */
+void render_board(const SyntheticRig &rig, cv::Size board_size, float square_size,
+                  const BoardPose &pose, cv::RNG &rng, cv::Mat &frame);
+
+/* Where the board's inner corners land in each camera */
+void board_corners(const SyntheticRig &rig, cv::Size board_size, float square_size,
+                   const BoardPose &pose, std::vector< cv::Point2f > &left,
+                   std::vector< cv::Point2f > &right);
+
+/*
+ * Side-by-side frame of a randomly textured, slanted plane filling the
+ * view, together with the true disparity of every pixel of the left
+ * image once rectified with R1, P1 and P2 from stereoRectify() with
+ * CALIB_ZERO_DISPARITY. depth gets the matching Z in the rectified
+ * left camera. Both are CV_32F.
+ */
+void render_plane_scene(const SyntheticRig &rig, const cv::Mat &R1, const cv::Mat &P1,
+                        const cv::Mat &P2, cv::RNG &rng, cv::Mat &frame,
+                        cv::Mat &disparity, cv::Mat &depth);
+
+#endif
@@ -2,73 +2,218 @@
 #include <opencv2/calib3d/calib3d.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <errno.h>
 #include <stdio.h>
+#include <sys/stat.h>
+#include <string.h>
 #include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <thread>
 #include "popt_pp.h"
+#include "calibration.h"
+#include "instrument.h"
+#include "rectify_maps.h"
+#include "reproject.h"
+#include "point_cloud.h"
+#include "stripe_disparity.h"
 
 using namespace std;
 using namespace cv;
 
-static void saveXYZ(const char* filename, const Mat& mat, const Mat& img, const Mat& mask)
+/* Time the striped matcher against a single compute() call on the
+ * whole pair, and report how far the two disparity maps differ */
+static void
+benchmark_disparity (const cv::Ptr<cv::StereoSGBM> &single, StripeDisparity &striped,
+                     const cv::Mat &left, const cv::Mat &right, int min_disp, int runs)
 {
-    const double max_z = 1.0e4;
-    FILE* fp = fopen(filename, "wt");
-    if (!fp) {
-      printf ("Failed to open output file %s\n", filename);
-      return;
-    }
-    for(int y = 0; y < mat.rows; y++)
-    {
-        for(int x = 0; x < mat.cols; x++)
-        {
-            Vec3f point = mat.at<Vec3f>(y, x);
-            Vec3b col = img.at<Vec3b>(y, x);
-            uint8_t alpha = mask.at<uint8_t>(y, x);
-            if(fabs(point[2] - max_z) < FLT_EPSILON || fabs(point[2]) > max_z) continue;
-            if (alpha == 0) continue; /* Ignore alpha=0.0 color */
-
-            fprintf(fp, "%f;%f;%f;%u;%u;%u\n", point[0], point[1], point[2], col[2], col[1], col[0]);
-        }
-    }
-    fclose(fp);
+  Mat reference, disparity;
+  int64 single_ticks = 0, striped_ticks = 0;
+
+  for (int i = 0; i < runs; i++) {
+    int64 t0 = getTickCount();
+    single->compute(left, right, reference);
+    int64 t1 = getTickCount();
+    striped.compute(left, right, disparity);
+    int64 t2 = getTickCount();
+    single_ticks += t1 - t0;
+    striped_ticks += t2 - t1;
+  }
+
+  double single_ms = single_ticks * 1000. / getTickFrequency() / runs;
+  double striped_ms = striped_ticks * 1000. / getTickFrequency() / runs;
+  printf("Single call: %.1f ms (%.1f pairs/sec)\n", single_ms, 1000. / single_ms);
+  printf("%d stripes:  %.1f ms (%.1f pairs/sec), %.2fx\n", striped.stripes(),
+         striped_ms, 1000. / striped_ms, single_ms / striped_ms);
+
+  DisparityAgreement a = compare_disparity(reference, disparity, min_disp);
+  printf("Agreement: %.2f%% of %d matched pixels within 1px, mean error %.3f px, "
+         "%d pixels matched by only one\n",
+         a.valid_both ? 100. * a.within_one / a.valid_both : 100., a.valid_both,
+         a.mean_abs_err, a.valid_one);
 }
 
 static void
-reproject_and_save (cv::Mat &disparity, cv::Mat &in_img, cv::Mat &mask, cv::Mat Q, const char *filename)
+reproject_and_save (cv::Mat &disparity, cv::Mat &in_img, cv::Mat &mask, cv::Mat Q, int min_disp,
+                    const char *filename)
 {
-  Mat disparityF;
-  Mat disparityT;
-  Mat QF;
+  ScopedTimer timer("reproject_and_save");
   Mat img;
 
-  //cv::normalize(disparity, disparityF, 0, 256, cv::NORM_MINMAX, CV_32F);
-  disparity.convertTo( disparityF, CV_32F, 1./16);
   in_img.convertTo(img, CV_8U);
+  save_point_cloud(filename, disparity, Q, min_disp, img, mask);
+}
 
-  cv::Mat_<cv::Vec3f> XYZ(disparityF.rows,disparityF.cols);   // Output point cloud
-
-  Q.convertTo( QF, CV_32F, 1.);
-  float scale = -QF.at<float>(3,3);
-  QF.at<float>(3,3)=scale;
-
-#if 1
-  cv::Mat_<float> vec_tmp(4,1);
-  for(int y=0; y<disparityF.rows; ++y) {
-      for(int x=0; x<disparityF.cols; ++x) {
-          vec_tmp(0)=x; vec_tmp(1)=y; vec_tmp(2)=disparityF.at<float>(y,x); vec_tmp(3)=1;
-          vec_tmp = QF*vec_tmp;
-          vec_tmp /= vec_tmp(3);
-          cv::Vec3f &point = XYZ.at<cv::Vec3f>(y,x);
-          point[0] = vec_tmp(0);
-          point[1] = vec_tmp(1);
-          point[2] = vec_tmp(2) * scale;
-      }
+static bool
+is_image_file (const string &path)
+{
+  static const char *exts[] = { ".png", ".jpg", ".jpeg", ".bmp", ".tif", ".tiff", ".ppm", ".pgm" };
+  for (size_t i = 0; i < sizeof(exts) / sizeof(exts[0]); i++) {
+    size_t n = strlen(exts[i]);
+    if (path.size() > n && strcasecmp(path.c_str() + path.size() - n, exts[i]) == 0)
+      return true;
+  }
+  return false;
+}
+
+/* Input images for batch mode: every image in a directory, the files
+ * matching a glob pattern, or the paths listed one per line in a file */
+static void
+list_inputs (const char *spec, vector<string> &files)
+{
+  struct stat st;
+  vector<cv::String> found;
+
+  if (stat(spec, &st) == 0 && S_ISDIR(st.st_mode)) {
+    cv::glob(string(spec) + "/*", found, false);
+    for (size_t i = 0; i < found.size(); i++)
+      if (is_image_file(found[i]))
+        files.push_back(found[i]);
+  } else if (strpbrk(spec, "*?[")) {
+    cv::glob(spec, found, false);
+    files.assign(found.begin(), found.end());
+  } else {
+    ifstream list(spec);
+    string line;
+    while (getline(list, line)) {
+      if (!line.empty() && line[0] != '#')
+        files.push_back(line);
+    }
+  }
+}
+
+static string
+base_name (const string &path)
+{
+  size_t slash = path.find_last_of('/');
+  return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+/* Outputs are named after the input's base name alone, so two inputs
+ * from different directories would overwrite each other. Reports the
+ * first such pair. Point clouds drop the extension as well */
+static bool
+find_name_clash (const vector<string> &inputs, bool point_clouds, string &first, string &second)
+{
+  map<string, size_t> seen;
+  for (size_t i = 0; i < inputs.size(); i++) {
+    string name = base_name(inputs[i]);
+    if (point_clouds)
+      name = name.substr(0, name.find_last_of('.'));
+    pair<map<string, size_t>::iterator, bool> it = seen.insert(make_pair(name, i));
+    if (!it.second) {
+      first = inputs[it.first->second];
+      second = inputs[i];
+      return true;
+    }
   }
-#else
-  reprojectImageTo3D(disparityF, XYZ, QF, true);
-#endif
+  return false;
+}
+
+/* Everything needed to turn a side-by-side image into outputs, shared
+ * read-only between the batch workers */
+struct BatchJob {
+  vector<string> inputs;
+  string out_dir;
+  const char *point_cloud_ext;
+  Size im_size;
+  const RectifyMaps *maps;
+  Mat Q;
+  cv::Ptr<cv::StereoSGBM> matcher;
+  StripeOptions stripe_options;
+  int min_disp;
+  Mat first; /* inputs[0], already read to size the maps */
+
+  std::atomic<int> next;
+  std::atomic<int> done;
+  std::atomic<int> failed;
+};
+
+/* imwrite() that says which file it could not write */
+static bool
+write_image (const string &filename, const Mat &img)
+{
+  bool ok;
+  try {
+    ok = imwrite(filename, img);
+  } catch (const cv::Exception &) {
+    ok = false;
+  }
+  if (!ok)
+    printf("Failed to write %s\n", filename.c_str());
+  return ok;
+}
+
+static void
+batch_worker (BatchJob *job)
+{
+  /* A matcher of our own, kept warm across images */
+  StripeDisparity stereo(job->matcher, job->stripe_options);
+  Mat imgU1, imgU2, maskU, disparity, disparity_eq;
+
+  for (int i = job->next++; i < (int) job->inputs.size(); i = job->next++) {
+    const string &input = job->inputs[i];
+    Mat img = i == 0 ? job->first : imread(input, CV_LOAD_IMAGE_COLOR);
+    if (img.empty()) {
+      printf("Failed to read %s\n", input.c_str());
+      job->failed++;
+      continue;
+    }
+    if (img.size() != job->im_size) {
+      printf("Skipping %s: %dx%d, expected %dx%d like the first image\n", input.c_str(),
+             img.cols, img.rows, job->im_size.width, job->im_size.height);
+      job->failed++;
+      continue;
+    }
 
-  saveXYZ(filename, XYZ, img, mask);
+    string name = base_name(input);
+    string prefix = job->out_dir + "/";
+    bool ok = true;
+
+    remap_side_by_side(img, *job->maps, imgU1, imgU2, &maskU);
+    ok &= write_image(prefix + "left" + name, imgU1);
+    ok &= write_image(prefix + "right" + name, imgU2);
+
+    stereo.compute(imgU1, imgU2, disparity);
+    cv::normalize(disparity, disparity_eq, 0, 256, cv::NORM_MINMAX, CV_8U);
+    ok &= write_image(prefix + "disparity" + name, disparity_eq);
+
+    if (job->point_cloud_ext) {
+      string stem = name.substr(0, name.find_last_of('.'));
+      string cloud = prefix + stem + "." + job->point_cloud_ext;
+      if (!save_point_cloud(cloud.c_str(), disparity, job->Q, job->min_disp, imgU1, maskU)) {
+        printf("Failed to write %s\n", cloud.c_str());
+        ok = false;
+      }
+    }
+    if (ok)
+      job->done++;
+    else
+      job->failed++;
+    Instrument::count("images");
+  }
 }
 
 int main(int argc, char const *argv[])
@@ -78,13 +223,31 @@ int main(int argc, char const *argv[])
   const char* calib_file = "extrinsics.yml";
   const char* point_cloud_filename = NULL;
   int show_results = 0;
+  int verify = 0;
+  int num_stripes = 1;
+  int max_stripe_rows = -1;
+  const char* sgbm_mode = NULL;
+  int bench_runs = 0;
+  const char* batch_spec = NULL;
+  int num_workers = (int) std::thread::hardware_concurrency();
+  int show_stats = 0;
+  const char* trace_file = NULL;
 
   static struct poptOption options[] = {
     { "in_filename",'i',POPT_ARG_STRING,&img_filename,0,"input image path","STR" },
     { "out_filename",'o',POPT_ARG_STRING,&out_filename,0,"out image path","STR" },
     { "calib_file",'c',POPT_ARG_STRING,&calib_file,0,"Stereo calibration file","STR" },
-    { "point_cloud",'p',POPT_ARG_STRING,&point_cloud_filename,0,"Write point cloud","STR" },
+    { "point_cloud",'p',POPT_ARG_STRING,&point_cloud_filename,0,"Write point cloud (.ply or .xyzrgb for binary, text otherwise)","STR" },
     { "show-results",'s',POPT_ARG_NONE,&show_results,0,"Display resulting image and depth map",NULL },
+    { "stripes",'S',POPT_ARG_INT,&num_stripes,0,"Horizontal stripes matched in parallel, 0 for one per core, 1 (default) for a single call","NUM" },
+    { "max_stripe_rows",'X',POPT_ARG_INT,&max_stripe_rows,0,"Most rows a stripe matches, bounding matcher memory (default 256 unless -S 1), 0 for no limit","NUM" },
+    { "sgbm_mode",'m',POPT_ARG_STRING,&sgbm_mode,0,"SGBM mode for the stripes: sgbm, hh, 3way or hh4","STR" },
+    { "benchmark",'b',POPT_ARG_INT,&bench_runs,0,"Time striped against single-call disparity over this many runs","NUM" },
+    { "batch",'B',POPT_ARG_STRING,&batch_spec,0,"Process a directory, glob pattern or list file of images. -o is then the output directory and -p the point cloud extension","STR" },
+    { "threads",'j',POPT_ARG_INT,&num_workers,0,"Batch worker threads","NUM" },
+    { "verify_reprojection",'V',POPT_ARG_NONE,&verify,0,"Check the point cloud reprojection against the reference",NULL },
+    { "stats",'I',POPT_ARG_NONE,&show_stats,0,"Print per-stage timings at exit",NULL },
+    { "trace",'T',POPT_ARG_STRING,&trace_file,0,"Write a Chrome trace of the timed stages","STR" },
     POPT_AUTOHELP
     { NULL, 0, 0, NULL, 0, NULL, NULL }
   };
@@ -93,15 +256,52 @@ int main(int argc, char const *argv[])
   int c;
   while((c = popt.getNextOpt()) >= 0) {}
 
-  if (img_filename == NULL || out_filename == NULL) {
+  if (show_stats || trace_file)
+    Instrument::enable(trace_file != NULL);
+
+  if ((img_filename == NULL && batch_spec == NULL) || out_filename == NULL) {
     cerr << "Please supply input and output file names" << endl;
     exit (1);
   }
-  Mat R1, R2, P1, P2, Q;
-  Mat K1, K2, R;
-  Vec3d T;
-  Mat D1, D2;
+  StereoCalibration calib;
+  if (!calib.load(calib_file)) {
+      printf ("Could not open stereo calibration file %s\n", calib_file);
+      exit(1);
+  }
+  Mat &Q = calib.Q;
+
+  StripeOptions stripe_options;
+  stripe_options.stripes = num_stripes;
+  if (max_stripe_rows >= 0)
+    stripe_options.max_stripe_rows = max_stripe_rows;
+  else if (num_stripes != 1)
+    stripe_options.max_stripe_rows = DEFAULT_MAX_STRIPE_ROWS;
+  if (sgbm_mode && (stripe_options.mode = parse_sgbm_mode(sgbm_mode)) < 0) {
+    cerr << "Unknown SGBM mode: " << sgbm_mode << endl;
+    exit(1);
+  }
+
+  /* In batch mode the first image sizes the maps */
+  BatchJob job;
+  if (batch_spec) {
+    list_inputs(batch_spec, job.inputs);
+    if (job.inputs.empty()) {
+      cerr << "No images found for " << batch_spec << endl;
+      exit(1);
+    }
+    string first, second;
+    if (find_name_clash(job.inputs, point_cloud_filename != NULL, first, second)) {
+      cerr << first << " and " << second << " would write the same outputs" << endl;
+      exit(1);
+    }
+    img_filename = job.inputs[0].c_str();
+  }
+
   Mat img = imread(img_filename, CV_LOAD_IMAGE_COLOR);
+  if (img.empty()) {
+    cerr << "Failed to read " << img_filename << endl;
+    exit(1);
+  }
   Size im_size = img.size();
   int cy = im_size.height;
   int cx = im_size.width / 2;
@@ -109,62 +309,69 @@ int main(int argc, char const *argv[])
   Mat img1 = img(Rect(0, 0, cx, cy));
   Mat img2 = img(Rect(cx, 0, cx, cy));
 
-  cv::FileStorage fs1(calib_file, cv::FileStorage::READ);
-  if (!fs1.isOpened()) {
-      printf ("Could not open stereo calibration file %s\n", calib_file);
-      exit(1);
-  }
-  fs1["K1"] >> K1;
-  fs1["K2"] >> K2;
-  fs1["D1"] >> D1;
-  fs1["D2"] >> D2;
-  fs1["R"] >> R;
-  fs1["T"] >> T;
-
-  fs1["R1"] >> R1;
-  fs1["R2"] >> R2;
-  fs1["P1"] >> P1;
-  fs1["P2"] >> P2;
-  fs1["Q"] >> Q;
-
-  cv::Mat lmapx, lmapy, rmapx, rmapy;
+  RectifyMaps maps;
   cv::Mat imgU1, imgU2;
 
   /* Alpha mask used to ignore useless pixels in output */
-  cv::Mat mask(cx, cy, CV_8U);
   cv::Mat maskU;
-  mask = cv::Scalar(255);
 
-  cv::initUndistortRectifyMap(K1, D1, R1, P1, img1.size(), CV_32F, lmapx, lmapy);
-  cv::initUndistortRectifyMap(K2, D2, R2, P2, img2.size(), CV_32F, rmapx, rmapy);
+  calib.init_maps(maps, calib_file, img1.size());
+
+  int min_disp = 0;
+  cv::Ptr<cv::StereoSGBM> stereo = create_sgbm(cx, min_disp, img.channels());
+
+  if (batch_spec) {
+    /* One image at a time per worker, so each matches as a single stripe */
+    job.out_dir = out_filename;
+    job.point_cloud_ext = point_cloud_filename;
+    job.im_size = im_size;
+    job.maps = &maps;
+    job.Q = Q;
+    job.matcher = stereo;
+    job.stripe_options = stripe_options;
+    job.stripe_options.stripes = 1;
+    job.stripe_options.max_stripe_rows = std::max(max_stripe_rows, 0);
+    job.min_disp = min_disp;
+    job.first = img;
+    job.next = 0;
+    job.done = 0;
+    job.failed = 0;
+
+    if (mkdir(out_filename, 0755) != 0 && errno != EEXIST) {
+      cerr << "Could not create output directory " << out_filename << ": "
+           << strerror(errno) << endl;
+      exit(1);
+    }
 
-  cv::remap(img1, imgU1, lmapx, lmapy, cv::INTER_LINEAR, BORDER_CONSTANT);
-  cv::remap(img2, imgU2, rmapx, rmapy, cv::INTER_LINEAR, BORDER_CONSTANT);
-  cv::remap(mask, maskU, lmapx, lmapy, cv::INTER_LINEAR, BORDER_CONSTANT);
+    int64 t0 = getTickCount();
+    vector<std::thread> workers;
+    for (int i = 0; i < std::max(num_workers, 1); i++)
+      workers.push_back(std::thread(batch_worker, &job));
+    for (size_t i = 0; i < workers.size(); i++)
+      workers[i].join();
+
+    double secs = (getTickCount() - t0) / getTickFrequency();
+    printf("Processed %d of %d images in %.1fs (%.1f images/sec), %d failed\n",
+           (int) job.done, (int) job.inputs.size(), secs, job.done / secs, (int) job.failed);
+    Instrument::report(trace_file);
+    return job.failed == 0 ? 0 : 1;
+  }
+
+  remap_side_by_side(img, maps, imgU1, imgU2, &maskU);
 
   imwrite(string("left") + out_filename, imgU1);
   imwrite(string("right") + out_filename, imgU2);
 
-  int window_size = 7;
-  int min_disp = 0;
-  int numberOfDisparities = ((cx/8) + 15) & -16;
-
-  cv::Ptr<cv::StereoSGBM> stereo = cv::StereoSGBM::create (min_disp, numberOfDisparities, window_size,
-        /* P1 */ 8*3*window_size * window_size,
-        /* P2 */ 32*3*window_size * window_size,
-        /* disp12MaxDiff = */ 1,
-        /* prefilterCaps */ 63,
-        /*uniquenessRatio = */ 2, // 10,
-        /*speckleWindowSize = */ 50, // 100,
-        /*speckleRange = */ 2, // 32
-        StereoSGBM::MODE_HH
-    );
+  StripeDisparity striped(stereo, stripe_options);
 
   Mat disparity, disparity_eq;
 
-  cout << "Computing disparity with " << numberOfDisparities << " disparities" << endl;
+  cout << "Computing disparity with " << stereo->getNumDisparities() << " disparities" << endl;
+
+  striped.compute (imgU1, imgU2, disparity);
 
-  stereo->compute (imgU1, imgU2, disparity);
+  if (bench_runs > 0)
+    benchmark_disparity(stereo, striped, imgU1, imgU2, min_disp, bench_runs);
 
   /* Scale from signed 16-bit fixed point to 0..255 for display and storage */
   //disparity.convertTo(disparity_eq, CV_8U, 255/(numberOfDisparities*16.));
@@ -176,10 +383,20 @@ int main(int argc, char const *argv[])
   {
     printf("storing the point cloud...");
     fflush(stdout);
-    reproject_and_save (disparity, imgU1, maskU, Q, point_cloud_filename);
+    reproject_and_save (disparity, imgU1, maskU, Q, min_disp, point_cloud_filename);
     printf("\n");
   }
 
+  if (verify) {
+    ReprojectionCheck check = check_reprojection(disparity, Q, min_disp);
+    printf("Reprojection check: %d of %d points differ, max relative error %g\n",
+           check.mismatched, check.checked, check.max_err);
+    if (check.mismatched)
+      exit(1);
+  }
+
+  Instrument::report(trace_file);
+
   if (show_results) {
     imshow("left", imgU1);
     imshow("right", imgU2);
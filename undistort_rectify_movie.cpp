@@ -5,6 +5,10 @@
 #include <stdio.h>
 #include <iostream>
 #include "popt_pp.h"
+#include "alloc_counter.h"
+#include "calibration.h"
+#include "instrument.h"
+#include "stereo_pipeline.h"
 
 using namespace std;
 using namespace cv;
@@ -14,11 +18,43 @@ int main(int argc, char const *argv[])
   const char* vid_filename = NULL;
   const char* out_filename = NULL;
   const char* calib_file = "extrinsics.yml";
+  int num_workers = StereoPipeline::default_workers();
+  int queue_depth = 4;
+  int drop_frames = 0;
+  int no_display = 0;
+  int num_stripes = 1;
+  int max_stripe_rows = -1;
+  const char* sgbm_mode = NULL;
+  int adaptive_range = 0;
+  int range_margin = RangeOptions().margin;
+  int pyramid_levels = 0;
+  int compare_full = 0;
+  int grayscale = 0;
+  int count_allocations = 0;
+  int show_stats = 0;
+  double stats_interval = 1.0;
+  const char* trace_file = NULL;
 
   static struct poptOption options[] = {
     { "in_filename",'i',POPT_ARG_STRING,&vid_filename,0,"input video file","STR" },
     { "out_filename",'o',POPT_ARG_STRING,&out_filename,0,"out image path","STR" },
     { "calib_file",'c',POPT_ARG_STRING,&calib_file,0,"Stereo calibration file","STR" },
+    { "threads",'j',POPT_ARG_INT,&num_workers,0,"Disparity worker threads","NUM" },
+    { "queue_depth",'q',POPT_ARG_INT,&queue_depth,0,"Frames queued between stages","NUM" },
+    { "drop_frames",'d',POPT_ARG_NONE,&drop_frames,0,"Drop frames when falling behind instead of waiting",NULL },
+    { "stripes",'S',POPT_ARG_INT,&num_stripes,0,"Horizontal stripes per frame, 0 for one per core, 1 (default) for a single call","NUM" },
+    { "max_stripe_rows",'X',POPT_ARG_INT,&max_stripe_rows,0,"Most rows a stripe matches, bounding matcher memory (default 256 unless -S 1), 0 for no limit","NUM" },
+    { "sgbm_mode",'m',POPT_ARG_STRING,&sgbm_mode,0,"SGBM mode: sgbm, hh, 3way or hh4","STR" },
+    { "adaptive_range",'a',POPT_ARG_NONE,&adaptive_range,0,"Narrow the disparity search to the range of recent frames",NULL },
+    { "range_margin",'M',POPT_ARG_INT,&range_margin,0,"Disparities of margin around the adaptive range","NUM" },
+    { "pyramid_levels",'P',POPT_ARG_INT,&pyramid_levels,0,"Coarse-to-fine disparity from 1/2^N resolution (1 or 2), 0 for off","NUM" },
+    { "compare_full",'R',POPT_ARG_NONE,&compare_full,0,"Report coarse-to-fine latency and accuracy against full resolution",NULL },
+    { "grayscale",'g',POPT_ARG_NONE,&grayscale,0,"Match on grayscale, converted at decode time",NULL },
+    { "count_allocations",'A',POPT_ARG_NONE,&count_allocations,0,"Count image buffer allocations per frame",NULL },
+    { "stats",'I',POPT_ARG_NONE,&show_stats,0,"Print fps and per-stage p50/p99 periodically and at exit",NULL },
+    { "stats_interval",'L',POPT_ARG_DOUBLE,&stats_interval,0,"Seconds between stats lines","SECS" },
+    { "trace",'T',POPT_ARG_STRING,&trace_file,0,"Write a Chrome trace of the timed stages","STR" },
+    { "no_display",'n',POPT_ARG_NONE,&no_display,0,"Don't show the output windows",NULL },
     POPT_AUTOHELP
     { NULL, 0, 0, NULL, 0, NULL, NULL }
   };
@@ -32,6 +68,16 @@ int main(int argc, char const *argv[])
       exit(EXIT_FAILURE);
   }
 
+  if (pyramid_levels < 0 || pyramid_levels > 2) {
+      cerr << "Pyramid levels must be 0, 1 or 2" << endl;
+      exit(EXIT_FAILURE);
+  }
+
+  if (count_allocations)
+    AllocationCounter::install();
+  if (show_stats || trace_file)
+    Instrument::enable(trace_file != NULL);
+
   VideoCapture capture(vid_filename);
   if(!capture.isOpened()){
      //error in opening the video input
@@ -39,40 +85,27 @@ int main(int argc, char const *argv[])
       exit(EXIT_FAILURE);
   }
 
-  Mat R1, R2, P1, P2, Q;
-  Mat K1, K2, R;
-  Vec3d T;
-  Mat D1, D2;
+  StereoCalibration calib;
   Mat frame;
   Size im_size;
-  int cy;
-  int cx = 1280;
-
-  cv::FileStorage fs1(calib_file, cv::FileStorage::READ);
-  fs1["K1"] >> K1;
-  fs1["K2"] >> K2;
-  fs1["D1"] >> D1;
-  fs1["D2"] >> D2;
-  fs1["R"] >> R;
-  fs1["T"] >> T;
-
-  fs1["R1"] >> R1;
-  fs1["R2"] >> R2;
-  fs1["P1"] >> P1;
-  fs1["P2"] >> P2;
-  fs1["Q"] >> Q;
-
-  cv::Mat lmapx, lmapy, rmapx, rmapy;
-  cv::Mat imgU1, imgU2;
+
+  if (!calib.load(calib_file)) {
+      cerr << "Unable to open calibration file: " << calib_file << endl;
+      exit(EXIT_FAILURE);
+  }
+
+  RectifyMaps maps;
 
   int window_size = 9;
   int min_disp = 0; // -20;
   int numberOfDisparities = 128; // ((cx/8) + 15) & -16;
+  /* The smoothness penalties grow with the channels summed in the cost */
+  int channels = grayscale ? 1 : 3;
   
 #if 1
   cv::Ptr<cv::StereoSGBM> stereo = cv::StereoSGBM::create (min_disp, numberOfDisparities, window_size,
-        /* P1 */ 8*3*window_size * window_size,
-        /* P2 */ 32*3*window_size * window_size,
+        /* P1 */ 8*channels*window_size * window_size,
+        /* P2 */ 32*channels*window_size * window_size,
         /* disp12MaxDiff = */ 2,
         /* prefilterCaps */ 5,
         /*uniquenessRatio = */ 2, // 10,
@@ -85,44 +118,74 @@ int main(int argc, char const *argv[])
         7, 100, 1000, 32, 0, 15, 50, 16, StereoSGBM::MODE_SGBM_3WAY);
 #endif
 
-  int i = 0;
-  while (capture.read(frame)) {
-    if (i++ % 4 != 0)
-      continue;
-    if ( im_size == Size() ) {
-      im_size = frame.size();
-      im_size.width /= 2;
-      cy = im_size.height;
-      cx = im_size.width;
-      cv::initUndistortRectifyMap(K1, D1, R1, P1, im_size, CV_32F, lmapx, lmapy);
-      cv::initUndistortRectifyMap(K2, D2, R2, P2, im_size, CV_32F, rmapx, rmapy);
-    }
-    //imwrite(string("left") + out_filename, imgU1);
-    //imwrite(string("right") + out_filename, imgU2);
-
-    Mat img1 = frame(Rect(0, 0, cx, cy));
-    Mat img2 = frame(Rect(cx, 0, cx, cy));
-
-    cv::remap(img1, imgU1, lmapx, lmapy, cv::INTER_LINEAR);
-    cv::remap(img2, imgU2, rmapx, rmapy, cv::INTER_LINEAR);
-
-    Mat disparity, disparity_eq;
+  /* The first frame gives the size of the maps, then goes down the pipeline */
+  if (!capture.read(frame)) {
+      cerr << "No frames in video file: " << vid_filename << endl;
+      exit(EXIT_FAILURE);
+  }
+  im_size = frame.size();
+  im_size.width /= 2;
+  calib.init_maps(maps, calib_file, im_size);
+
+  /* Maps rectifying straight to the coarse pyramid level */
+  RectifyMaps coarse_maps;
+  if (pyramid_levels > 0) {
+    double scale = 1. / (1 << pyramid_levels);
+    coarse_maps.build(calib.K1, calib.D1, calib.R1,
+                      RectifyMaps::scale_projection(calib.P1, scale),
+                      calib.K2, calib.D2, calib.R2,
+                      RectifyMaps::scale_projection(calib.P2, scale),
+                      Size(im_size.width >> pyramid_levels, im_size.height >> pyramid_levels));
+  }
 
-    cout << "Computing disparity with " << numberOfDisparities << " disparities" << endl;
+  PipelineOptions pipeline_options;
+  pipeline_options.disparity_workers = num_workers;
+  pipeline_options.queue_depth = queue_depth;
+  pipeline_options.drop_frames = drop_frames;
+  pipeline_options.stripes.stripes = num_stripes;
+  if (max_stripe_rows >= 0)
+    pipeline_options.stripes.max_stripe_rows = max_stripe_rows;
+  else if (num_stripes != 1)
+    pipeline_options.stripes.max_stripe_rows = DEFAULT_MAX_STRIPE_ROWS;
+  pipeline_options.adaptive_range = adaptive_range;
+  pipeline_options.range.margin = range_margin;
+  pipeline_options.coarse_to_fine = pyramid_levels > 0;
+  pipeline_options.pyramid.levels = pyramid_levels;
+  pipeline_options.compare_full = compare_full;
+  pipeline_options.grayscale = grayscale;
+  if (adaptive_range && pyramid_levels > 0)
+      cerr << "Ignoring --adaptive_range, the coarse pass picks the disparity ranges" << endl;
+  if (sgbm_mode && (pipeline_options.stripes.mode = parse_sgbm_mode(sgbm_mode)) < 0) {
+      cerr << "Unknown SGBM mode: " << sgbm_mode << endl;
+      exit(EXIT_FAILURE);
+  }
 
-    stereo->compute (imgU1, imgU2, disparity);
+  cout << "Computing disparity with " << numberOfDisparities << " disparities" << endl;
 
-    disparity.convertTo(disparity_eq, CV_8U, 255/(numberOfDisparities*16.));
+  StereoPipeline pipeline(&capture, frame, maps, stereo, pipeline_options, &coarse_maps);
+  StereoFrame *out;
 
+  while (pipeline.next(out)) {
     if (out_filename)
-      imwrite(string("disparity") + out_filename, disparity_eq);
-
-    imshow("left", imgU1);
-    imshow("right", imgU2);
-    imshow("disparity", disparity_eq);
-    c = (char)waitKey(10);
-    if( c == 27 || c == 'q' || c == 'Q' ) //Allow ESC to quit
-      exit(-1);
+      imwrite(string("disparity") + out_filename, out->disparity_eq);
+
+    if (!no_display) {
+      imshow("left", out->left);
+      imshow("right", out->right);
+      imshow("disparity", out->disparity_eq);
+    }
+    pipeline.done(out);
+    if (show_stats)
+      Instrument::print_periodic(stdout, "frames", stats_interval);
+
+    if (!no_display) {
+      c = (char)waitKey(1);
+      if( c == 27 || c == 'q' || c == 'Q' ) //Allow ESC to quit
+        break;
+    }
   }
+
+  pipeline.print_stats();
+  Instrument::report(trace_file);
   return 0;
 }
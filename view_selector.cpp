@@ -0,0 +1,117 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include "view_selector.h"
+
+using namespace std;
+using namespace cv;
+
+/* Views less sharp than this fraction of the median are never used */
+static const float MIN_RELATIVE_SHARPNESS = 0.5f;
+
+static float edge_length(const Point2f &a, const Point2f &b)
+{
+  return (float) cv::norm(b - a);
+}
+
+ViewFeatures view_features(const vector< Point2f > &corners, Size board_size,
+                           Size im_size, float sharpness)
+{
+  ViewFeatures f;
+  int w = board_size.width, h = board_size.height;
+  const Point2f &tl = corners[0];
+  const Point2f &tr = corners[w - 1];
+  const Point2f &bl = corners[(h - 1) * w];
+  const Point2f &br = corners[h * w - 1];
+
+  Point2f centre = (tl + tr + bl + br) * 0.25f;
+  f.cx = centre.x / im_size.width;
+  f.cy = centre.y / im_size.height;
+
+  /* Shoelace formula over the outer corners */
+  float area = 0.5f * fabs((tl.x * tr.y - tr.x * tl.y) + (tr.x * br.y - br.x * tr.y) +
+                           (br.x * bl.y - bl.x * br.y) + (bl.x * tl.y - tl.x * bl.y));
+  f.scale = area / im_size.area();
+
+  /* A board turned away from the camera has its far edge shorter */
+  float left = edge_length(tl, bl), right = edge_length(tr, br);
+  float top = edge_length(tl, tr), bottom = edge_length(bl, br);
+  f.tilt_x = (right - left) / (right + left);
+  f.tilt_y = (bottom - top) / (bottom + top);
+
+  f.sharpness = sharpness;
+  return f;
+}
+
+/* Tilts are small numbers compared to positions, so weigh them up */
+static float feature_distance(const ViewFeatures &a, const ViewFeatures &b)
+{
+  float dx = a.cx - b.cx, dy = a.cy - b.cy;
+  float ds = 2.0f * (a.scale - b.scale);
+  float dtx = 4.0f * (a.tilt_x - b.tilt_x), dty = 4.0f * (a.tilt_y - b.tilt_y);
+  return dx * dx + dy * dy + ds * ds + dtx * dtx + dty * dty;
+}
+
+ViewSelector::ViewSelector(int max_views) : max_views(max_views)
+{
+}
+
+void ViewSelector::add(const ViewFeatures &features)
+{
+  views.push_back(features);
+}
+
+vector< int > ViewSelector::select() const
+{
+  int n = (int) views.size();
+  vector< int > chosen;
+
+  if (max_views <= 0 || n <= max_views) {
+    for (int i = 0; i < n; i++)
+      chosen.push_back(i);
+    return chosen;
+  }
+
+  vector< float > sharpness;
+  for (int i = 0; i < n; i++)
+    sharpness.push_back(views[i].sharpness);
+  nth_element(sharpness.begin(), sharpness.begin() + n / 2, sharpness.end());
+  float median = sharpness[n / 2];
+
+  /* Quality weight in 0..1, or -1 for views too blurred to use */
+  vector< float > quality(n);
+  int best = -1;
+  for (int i = 0; i < n; i++) {
+    float rel = median > 0 ? views[i].sharpness / median : 1.0f;
+    quality[i] = rel < MIN_RELATIVE_SHARPNESS ? -1.0f : std::min(rel, 1.0f);
+    if (quality[i] >= 0 && (best < 0 || views[i].sharpness > views[best].sharpness))
+      best = i;
+  }
+  if (best < 0)
+    return chosen;
+
+  /* Greedy farthest-point sampling: repeatedly take the view furthest
+   * from everything already chosen, weighted by its quality */
+  vector< float > dist(n, FLT_MAX);
+  int next = best;
+  while (next >= 0 && (int) chosen.size() < max_views) {
+    chosen.push_back(next);
+    quality[next] = -1.0f;
+
+    next = -1;
+    float next_score = 0;
+    for (int i = 0; i < n; i++) {
+      if (quality[i] < 0)
+        continue;
+      dist[i] = std::min(dist[i], feature_distance(views[i], views[chosen.back()]));
+      float score = dist[i] * quality[i];
+      if (next < 0 || score > next_score) {
+        next = i;
+        next_score = score;
+      }
+    }
+  }
+
+  sort(chosen.begin(), chosen.end());
+  return chosen;
+}
@@ -0,0 +1,56 @@
+#ifndef _INCLUDED_VIEW_SELECTOR_H_
+#define _INCLUDED_VIEW_SELECTOR_H_
+
+#include <opencv2/core/core.hpp>
+#include <vector>
+
+/* Where and how a detected board sits in the image */
+struct ViewFeatures {
+  float cx, cy;         /* Board centre, as a fraction of the image size */
+  float scale;          /* Board area as a fraction of the image area */
+  float tilt_x, tilt_y; /* Foreshortening across the board's two axes, -1..1 */
+  float sharpness;      /* Focus/motion blur measure, higher is sharper */
+};
+
+ViewFeatures view_features(const std::vector< cv::Point2f > &corners, cv::Size board_size,
+                           cv::Size im_size, float sharpness);
+
+/*
+ * Picks a bounded, diverse subset of the detected views before they go
+ * to calibrateCamera/stereoCalibrate. Consecutive video frames are
+ * nearly identical, so only views that add a new board position, size
+ * or tilt are worth the solver time. Blurred views are dropped first.
+ */
+class ViewSelector {
+public:
+  /* max_views <= 0 keeps every view */
+  ViewSelector(int max_views);
+
+  void add(const ViewFeatures &features);
+  int size() const { return (int) views.size(); }
+
+  /* Indices, in the order add() was called, of the views to keep */
+  std::vector< int > select() const;
+
+private:
+  int max_views;
+  std::vector< ViewFeatures > views;
+};
+
+/* Drop every entry of views whose index is not in the sorted keep list */
+template< typename T >
+void keep_views(std::vector< T > &views, const std::vector< int > &keep)
+{
+  for (size_t i = 0; i < keep.size(); i++)
+    views[i] = views[keep[i]];
+  views.resize(keep.size());
+}
+
+/* The solver's work grows at least linearly with the view count, so
+ * scaling the measured time gives a lower bound for what was saved */
+inline double solver_time_saved(double secs, int n_used, int n_found)
+{
+  return n_used > 0 ? secs * (n_found - n_used) / n_used : 0;
+}
+
+#endif